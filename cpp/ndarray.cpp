@@ -1,15 +1,41 @@
 #include <algorithm>
+#include <array>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <cmath>
+#include <complex>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
 #include <functional>
 #include <exception>
 #include <initializer_list>
 #include <iostream>
 #include <iterator>
+#include <limits>
+#include <map>
 #include <memory>
+#include <mutex>
 #include <numeric>
 #include <sstream>
 #include <string>
+#include <thread>
+#include <tuple>
+#include <type_traits>
 #include <vector>
 
+#if defined(__F16C__) || defined(__FMA__)
+#include <immintrin.h>
+#endif
+
+#ifdef __linux__
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
 template<class E>
 class Error : public std::exception {
 public:
@@ -36,490 +62,6848 @@ struct ValueError {
     static const char *tag() { return "ValueError"; }
 };
 
+struct LinAlgError {
+    static const char *tag() { return "LinAlgError"; }
+};
+
 template<class T>
-class ndarray {
+struct complex_traits {
+    typedef typename std::conditional<std::is_floating_point<T>::value, T, double>::type real_type;
+    typedef std::complex<real_type> complex_type;
+};
+
+template<class T>
+struct complex_traits<std::complex<T>> {
+    typedef T real_type;
+    typedef std::complex<T> complex_type;
+};
+
+/**
+ * IEEE 754 binary16: 1 sign, 5 exponent and 10 mantissa bits.
+ *
+ * Scalar conversions are branch-light bit manipulation with round-to-nearest-even; bulk conversions use
+ * F16C when the target has it.
+ */
+struct Binary16 {
+    static float to_float(uint16_t h) {
+        const uint32_t shifted_exp = 0x7c00u << 13;
+        uint32_t bits = (h & 0x7fffu) << 13;
+        const uint32_t exp = bits & shifted_exp;
+        bits += (127 - 15) << 23;
+        float f;
+        if (exp == shifted_exp) {
+            bits += (128 - 16) << 23;  // Inf or NaN
+            std::memcpy(&f, &bits, sizeof(f));
+        } else if (exp == 0) {
+            bits += 1 << 23;  // zero or subnormal, renormalized by a float subtraction
+            std::memcpy(&f, &bits, sizeof(f));
+            f -= 6.103515625e-05f;
+        } else {
+            std::memcpy(&f, &bits, sizeof(f));
+        }
+        return (h & 0x8000u) ? -f : f;
+    }
+
+    static uint16_t from_float(float f) {
+        uint32_t bits;
+        std::memcpy(&bits, &f, sizeof(bits));
+        const uint32_t sign = bits & 0x80000000u;
+        bits ^= sign;
+        uint32_t h;
+        if (bits >= ((127u + 16) << 23)) {
+            h = (bits > (255u << 23)) ? 0x7e00u : 0x7c00u;  // NaN, or Inf and overflow
+        } else if (bits < (113u << 23)) {
+            // Subnormal result: adding 0.5 lets the FPU do the rounding into the low mantissa bits.
+            float g;
+            std::memcpy(&g, &bits, sizeof(g));
+            g += 0.5f;
+            std::memcpy(&h, &g, sizeof(h));
+            h -= 0x3f000000u;
+        } else {
+            const uint32_t odd = (bits >> 13) & 1;
+            bits += ((15u - 127) << 23) + 0xfff + odd;
+            h = bits >> 13;
+        }
+        return static_cast<uint16_t>(h | (sign >> 16));
+    }
+
+    static void to_float(const uint16_t *in, float *out, size_t n) {
+        size_t i = 0;
+#ifdef __F16C__
+        for (; i + 8 <= n; i += 8) {
+            _mm256_storeu_ps(out + i, _mm256_cvtph_ps(_mm_loadu_si128(reinterpret_cast<const __m128i *>(in + i))));
+        }
+#endif
+        for (; i < n; ++i) {
+            out[i] = to_float(in[i]);
+        }
+    }
+
+    static void from_float(const float *in, uint16_t *out, size_t n) {
+        size_t i = 0;
+#ifdef __F16C__
+        for (; i + 8 <= n; i += 8) {
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(out + i),
+                    _mm256_cvtps_ph(_mm256_loadu_ps(in + i), _MM_FROUND_TO_NEAREST_INT));
+        }
+#endif
+        for (; i < n; ++i) {
+            out[i] = from_float(in[i]);
+        }
+    }
+};
+
+/**
+ * bfloat16: the upper half of a binary32, i.e. float's 8 exponent bits with 7 mantissa bits.
+ */
+struct BFloat16 {
+    static float to_float(uint16_t h) {
+        const uint32_t bits = static_cast<uint32_t>(h) << 16;
+        float f;
+        std::memcpy(&f, &bits, sizeof(f));
+        return f;
+    }
+
+    static uint16_t from_float(float f) {
+        uint32_t bits;
+        std::memcpy(&bits, &f, sizeof(bits));
+        if ((bits & 0x7fffffffu) > 0x7f800000u) {
+            return static_cast<uint16_t>((bits >> 16) | 0x40);  // keep NaN quiet after truncation
+        }
+        return static_cast<uint16_t>((bits + 0x7fff + ((bits >> 16) & 1)) >> 16);
+    }
+
+    // Plain loops: the compiler vectorizes the shifts and adds by itself.
+    static void to_float(const uint16_t *in, float *out, size_t n) {
+        for (size_t i = 0; i < n; ++i) {
+            out[i] = to_float(in[i]);
+        }
+    }
+
+    static void from_float(const float *in, uint16_t *out, size_t n) {
+        for (size_t i = 0; i < n; ++i) {
+            out[i] = from_float(in[i]);
+        }
+    }
+};
+
+/**
+ * 16-bit floating point storage type in the given Encoding; every operation is carried out in float.
+ *
+ * Arithmetic values convert implicitly into it, while converting out takes a static_cast, so mixed
+ * expressions like h * 2 stay in this type rather than becoming ambiguous.
+ */
+template<class Encoding>
+class half_precision {
 public:
-    typedef T dtype;
+    half_precision() = default;
 
-    static ndarray arange(int n, int start = 0) {
-        std::vector<T> ary(n);
-        std::iota(ary.begin(), ary.end(), start);
+    template<class U, class = typename std::enable_if<std::is_arithmetic<U>::value>::type>
+    half_precision(U value) : bits_(Encoding::from_float(static_cast<float>(value))) {
+    }
 
-        auto data = transform_data(ary);
+    template<class U, class = typename std::enable_if<std::is_arithmetic<U>::value>::type>
+    explicit operator U() const {
+        return static_cast<U>(Encoding::to_float(bits_));
+    }
 
-        return ndarray({n}, std::move(data));
+    static half_precision from_bits(uint16_t bits) {
+        half_precision h;
+        h.bits_ = bits;
+        return h;
     }
 
-    static ndarray scalar(const T &s) {
-        return ndarray({}, {std::make_shared<T>(s)});
+    uint16_t bits() const {
+        return bits_;
     }
 
-    template<template<class, class...> class Container, class... Ts>
-    static ndarray full(const Container<int, Ts...> &shape, const T &fill_value) {
-        int size = get_size(shape);
-        auto data = transform_data(std::vector<T>(size, fill_value));
-        return ndarray(Shape(shape.begin(), shape.end()), std::move(data));
+    half_precision operator-() const {
+        return from_bits(bits_ ^ 0x8000u);
     }
 
-    static ndarray full(std::initializer_list<int> shape, const T &fill_value) {
-        ndarray (*delegate)(const std::initializer_list<int> &, const T &) = &ndarray::full;
-        return delegate(shape, fill_value);
+    half_precision &operator+=(half_precision rhs) {
+        return *this = *this + rhs;
     }
 
-    ndarray() : shape_({0}) {
+    half_precision &operator-=(half_precision rhs) {
+        return *this = *this - rhs;
     }
 
-    ndarray(std::initializer_list<ndarray> ary) {
-        auto shape = get_shape(ary);
-        if (shape.empty()) {
-            return;
+    half_precision &operator*=(half_precision rhs) {
+        return *this = *this * rhs;
+    }
+
+    half_precision &operator/=(half_precision rhs) {
+        return *this = *this / rhs;
+    }
+
+    friend half_precision operator+(half_precision lhs, half_precision rhs) {
+        return float(lhs) + float(rhs);
+    }
+
+    friend half_precision operator-(half_precision lhs, half_precision rhs) {
+        return float(lhs) - float(rhs);
+    }
+
+    friend half_precision operator*(half_precision lhs, half_precision rhs) {
+        return float(lhs) * float(rhs);
+    }
+
+    friend half_precision operator/(half_precision lhs, half_precision rhs) {
+        return float(lhs) / float(rhs);
+    }
+
+    friend bool operator==(half_precision lhs, half_precision rhs) {
+        return float(lhs) == float(rhs);
+    }
+
+    friend bool operator!=(half_precision lhs, half_precision rhs) {
+        return float(lhs) != float(rhs);
+    }
+
+    friend bool operator<(half_precision lhs, half_precision rhs) {
+        return float(lhs) < float(rhs);
+    }
+
+    friend bool operator>(half_precision lhs, half_precision rhs) {
+        return float(lhs) > float(rhs);
+    }
+
+    friend bool operator<=(half_precision lhs, half_precision rhs) {
+        return float(lhs) <= float(rhs);
+    }
+
+    friend bool operator>=(half_precision lhs, half_precision rhs) {
+        return float(lhs) >= float(rhs);
+    }
+
+    friend std::ostream &operator<<(std::ostream &os, half_precision h) {
+        return os << float(h);
+    }
+
+private:
+    uint16_t bits_ = 0;
+};
+
+typedef half_precision<Binary16> float16;
+typedef half_precision<BFloat16> bfloat16;
+
+/**
+ * Type that sums and products of T are accumulated in, wider than T for the 16-bit storage types.
+ */
+template<class T>
+struct accumulator_traits {
+    typedef T type;
+};
+
+template<class Encoding>
+struct accumulator_traits<half_precision<Encoding>> {
+    typedef float type;
+};
+
+/**
+ * out[i] = static_cast<To>(in[i]), through the bulk conversions between float and the 16-bit types.
+ */
+template<class From, class To>
+void convert_values(const From *in, To *out, size_t n) {
+    for (size_t i = 0; i < n; ++i) {
+        out[i] = static_cast<To>(in[i]);
+    }
+}
+
+template<class Encoding>
+void convert_values(const half_precision<Encoding> *in, float *out, size_t n) {
+    static_assert(sizeof(half_precision<Encoding>) == sizeof(uint16_t), "half_precision must be bare bits");
+    Encoding::to_float(reinterpret_cast<const uint16_t *>(in), out, n);
+}
+
+template<class Encoding>
+void convert_values(const float *in, half_precision<Encoding> *out, size_t n) {
+    static_assert(sizeof(half_precision<Encoding>) == sizeof(uint16_t), "half_precision must be bare bits");
+    Encoding::from_float(in, reinterpret_cast<uint16_t *>(out), n);
+}
+
+/**
+ * numpy's name for dtype T, e.g. "int32", "float64", "complex128", "float16".
+ */
+template<class T>
+struct dtype_traits {
+    static const char *name() {
+        static const std::string name = make_name();
+        return name.c_str();
+    }
+
+private:
+    static std::string make_name() {
+        const std::string bits = std::to_string(sizeof(T) * 8);
+        if (std::is_same<T, bool>::value) {
+            return "bool";
+        }
+        if (std::is_floating_point<T>::value) {
+            return "float" + bits;
+        }
+        if (std::is_integral<T>::value) {
+            return (std::is_signed<T>::value ? "int" : "uint") + bits;
         }
+        return "void" + bits;
+    }
+};
 
-        auto data = flatten_data(ary);
-        if (data.empty()) {
-            return;
+template<class R>
+struct dtype_traits<std::complex<R>> {
+    static const char *name() {
+        static const std::string name = "complex" + std::to_string(sizeof(std::complex<R>) * 8);
+        return name.c_str();
+    }
+};
+
+template<>
+struct dtype_traits<float16> {
+    static const char *name() { return "float16"; }
+};
+
+template<>
+struct dtype_traits<bfloat16> {
+    static const char *name() { return "bfloat16"; }
+};
+
+/**
+ * Process-wide accounting of the memory held by ndarrays, by dtype and by tagged scope.
+ *
+ * Two kinds of allocation are counted per dtype: data, the blocks element values live in, and handles,
+ * the per-array vectors of element pointers (16 bytes per element, for views too). Memory adopted
+ * through from_buffer is not owned and not counted.
+ */
+class MemoryStats {
+public:
+    struct Counters {
+        long long allocations = 0;
+        long long bytes_allocated = 0;
+        long long live_buffers = 0;
+        long long live_bytes = 0;
+        long long peak_bytes = 0;
+    };
+
+    struct DtypeCounters {
+        Counters data;
+        Counters handles;
+    };
+
+    /**
+     * While alive, allocations made by the constructing thread are also attributed to tag; scopes nest,
+     * the innermost one wins. ndarray's worker threads re-enter the scope their parallel_for started in.
+     */
+    class Scope {
+    public:
+        explicit Scope(const std::string &tag) : previous_(current_tag()) {
+            current_tag() = tag_id(tag);
         }
 
-        shape_ = std::move(shape);
-        data_ = std::move(data);
+        /**
+         * Re-enter, on another thread, a scope captured with active_scope().
+         */
+        explicit Scope(int tag) : previous_(current_tag()) {
+            current_tag() = tag;
+        }
+
+        ~Scope() {
+            current_tag() = previous_;
+        }
+
+        Scope(const Scope &) = delete;
+        Scope &operator=(const Scope &) = delete;
+
+    private:
+        int previous_;
+    };
+
+    /**
+     * Id of the calling thread's innermost scope (0 outside any), for Scope(int).
+     */
+    static int active_scope() {
+        return current_tag();
     }
 
-    ndarray(std::initializer_list<T> ary) {
-        Shape shape = {static_cast<int>(ary.size())};
+    /**
+     * Record an allocation of bytes for dtype; returns the tag to pass to release.
+     */
+    static int acquire(const char *dtype, bool handles, size_t bytes) {
+        const int tag = current_tag();
+        auto &state = get();
+        std::lock_guard<std::mutex> lock(state.mutex);
+        auto &counters = state.dtypes[dtype];
+        add(handles ? counters.handles : counters.data, bytes);
+        add(state.total, bytes);
+        if (tag != 0) {
+            add(state.scopes[state.tags[tag]], bytes);
+        }
+        return tag;
+    }
 
-        auto data = transform_data(ary);
+    static void release(const char *dtype, bool handles, size_t bytes, int tag) {
+        auto &state = get();
+        std::lock_guard<std::mutex> lock(state.mutex);
+        auto &counters = state.dtypes[dtype];
+        remove(handles ? counters.handles : counters.data, bytes);
+        remove(state.total, bytes);
+        if (tag != 0) {
+            remove(state.scopes[state.tags[tag]], bytes);
+        }
+    }
 
-        shape_ = std::move(shape);
-        data_ = std::move(data);
+    static Counters total() {
+        auto &state = get();
+        std::lock_guard<std::mutex> lock(state.mutex);
+        return state.total;
     }
 
-    ndarray(const ndarray &) = default;
-    ndarray(ndarray &&) = default;
-    ~ndarray() = default;
+    static DtypeCounters dtype(const std::string &name) {
+        auto &state = get();
+        std::lock_guard<std::mutex> lock(state.mutex);
+        auto it = state.dtypes.find(name);
+        return (it != state.dtypes.end()) ? it->second : DtypeCounters();
+    }
 
-    ndarray &operator=(const ndarray &rhs) {
-        const Shape &lshape = shape(), &rshape = rhs.shape();
-        Data ldata = data_, rdata = rhs.data_;
-        Shape shape;
-        auto retval = braodcast(lshape, rshape, false, ldata, rdata, shape);
-        if (!retval) {
-            std::ostringstream oss;
-            oss << "could not broadcast input array from shape ";
-            dump_shape(oss, rshape);
-            oss << " into shape ";
-            dump_shape(oss, lshape);
-            throw Error<ValueError>(oss.str());
+    static Counters scope(const std::string &tag) {
+        auto &state = get();
+        std::lock_guard<std::mutex> lock(state.mutex);
+        auto it = state.scopes.find(tag);
+        return (it != state.scopes.end()) ? it->second : Counters();
+    }
+
+    /**
+     * Restart the cumulative counters and peaks from what is live now.
+     */
+    static void reset_peaks() {
+        auto &state = get();
+        std::lock_guard<std::mutex> lock(state.mutex);
+        auto restart = [] (Counters &counters) {
+            counters.allocations = counters.live_buffers;
+            counters.bytes_allocated = counters.live_bytes;
+            counters.peak_bytes = counters.live_bytes;
+        };
+        restart(state.total);
+        for (auto &entry : state.dtypes) {
+            restart(entry.second.data);
+            restart(entry.second.handles);
+        }
+        for (auto &entry : state.scopes) {
+            restart(entry.second);
+        }
+    }
+
+    /**
+     * {"total": {...}, "dtypes": {"int32": {"data": {...}, "handles": {...}}, ...}, "scopes": {"tag": {...}, ...}}
+     */
+    static std::string to_json() {
+        auto &state = get();
+        std::lock_guard<std::mutex> lock(state.mutex);
+        std::ostringstream oss;
+        oss << "{\"total\": ";
+        dump(oss, state.total);
+        oss << ", \"dtypes\": {";
+        const char *separator = "";
+        for (const auto &entry : state.dtypes) {
+            oss << separator << '"' << entry.first << "\": {\"data\": ";
+            dump(oss, entry.second.data);
+            oss << ", \"handles\": ";
+            dump(oss, entry.second.handles);
+            oss << '}';
+            separator = ", ";
         }
+        oss << "}, \"scopes\": {";
+        separator = "";
+        for (const auto &entry : state.scopes) {
+            oss << separator << '"';
+            for (char c : entry.first) {
+                if ((c == '"') || (c == '\\')) {
+                    oss << '\\';
+                }
+                oss << c;
+            }
+            oss << "\": ";
+            dump(oss, entry.second);
+            separator = ", ";
+        }
+        oss << "}}";
+        return oss.str();
+    }
+
+private:
+    struct State {
+        std::mutex mutex;
+        Counters total;
+        std::map<std::string, DtypeCounters> dtypes;
+        std::map<std::string, Counters> scopes;
+        // Tag ids index tags; id 0 is the untagged default.
+        std::vector<std::string> tags = {""};
+    };
+
+    static State &get() {
+        static State state;
+        return state;
+    }
 
-        // assert(data_.size() == rdata.size());
+    static int &current_tag() {
+        static thread_local int tag = 0;
+        return tag;
+    }
 
-        for (size_t i = 0; i < data_.size(); ++i) {
-            *data_[i] = *rdata[i];
+    static int tag_id(const std::string &tag) {
+        auto &state = get();
+        std::lock_guard<std::mutex> lock(state.mutex);
+        auto it = std::find(state.tags.begin(), state.tags.end(), tag);
+        if (it != state.tags.end()) {
+            return it - state.tags.begin();
         }
+        state.tags.push_back(tag);
+        return state.tags.size() - 1;
+    }
 
-        return *this;
+    static void add(Counters &counters, size_t bytes) {
+        ++counters.allocations;
+        counters.bytes_allocated += bytes;
+        ++counters.live_buffers;
+        counters.live_bytes += bytes;
+        counters.peak_bytes = std::max(counters.peak_bytes, counters.live_bytes);
     }
 
-    ndarray &operator=(ndarray &&rhs) {
-        return (*this) = rhs;
+    static void remove(Counters &counters, size_t bytes) {
+        --counters.live_buffers;
+        counters.live_bytes -= bytes;
     }
 
-    template<class U>
-    ndarray &opeartor=(const U &rhs) {
-        return (*this) = ndarray::scalar(static_cast<T>(rhs));
+    static void dump(std::ostream &os, const Counters &counters) {
+        os << "{\"allocations\": " << counters.allocations
+           << ", \"bytes_allocated\": " << counters.bytes_allocated
+           << ", \"live_buffers\": " << counters.live_buffers
+           << ", \"live_bytes\": " << counters.live_bytes
+           << ", \"peak_bytes\": " << counters.peak_bytes << '}';
     }
+};
 
-    const std::vector<int> &shape() const {
-        return shape_;
+/**
+ * Process-wide placement of large ndarray buffers across NUMA nodes.
+ *
+ * Buffers of at least MAPPED_BYTES are mapped straight from the kernel rather than the heap, so none of
+ * their pages exists until first written; ndarray fills them with the same thread partitioning its
+ * kernels use, so by default (FIRST_TOUCH) every page lands on the node of the thread that computes it.
+ * INTERLEAVE spreads pages round-robin over nodes and BIND restricts them to nodes, both given as a bit
+ * mask with bit i for node i. Placement and huge pages are hints: they apply to buffers allocated after
+ * the call, only on Linux, and are silently dropped where the kernel refuses them.
+ */
+class MemoryPolicy {
+public:
+    enum Placement {
+        FIRST_TOUCH, INTERLEAVE, BIND
+    };
+
+    static constexpr size_t MAPPED_BYTES = 1 << 18;
+
+    static void set_placement(Placement placement, unsigned long nodes = 0) {
+        get().placement = placement;
+        get().nodes = nodes;
     }
 
-    int ndim() const {
-        return shape_.size();
+    /**
+     * Ask for transparent huge pages (madvise(MADV_HUGEPAGE)) on large buffers.
+     */
+    static void set_huge_pages(bool enabled) {
+        get().huge_pages = enabled;
     }
 
-    int size() const {
-        return data_.size();
+    static Placement placement() {
+        return get().placement;
     }
 
-    int len() const {
-        if (ndim() == 0) {
-            throw Error<TypeError>("scalar type has no len()");
+    static unsigned long nodes() {
+        return get().nodes;
+    }
+
+    static bool huge_pages() {
+        return get().huge_pages;
+    }
+
+    static bool mapped(size_t bytes) {
+        return bytes >= MAPPED_BYTES;
+    }
+
+    /**
+     * Uninitialized storage for bytes, except that mapped storage reads as zero until written.
+     */
+    static void *allocate(size_t bytes) {
+#ifdef __linux__
+        if (mapped(bytes)) {
+            void *p = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (p == MAP_FAILED) {
+                throw std::bad_alloc();
+            }
+            if (huge_pages()) {
+                madvise(p, bytes, MADV_HUGEPAGE);
+            }
+            const Placement policy = placement();
+            unsigned long mask = nodes();
+            if ((policy != FIRST_TOUCH) && (mask != 0)) {
+                // MPOL_BIND and MPOL_INTERLEAVE from <linux/mempolicy.h>; the kernel reads maxnode - 1 bits.
+                const int mode = (policy == BIND) ? 2 : 3;
+                syscall(SYS_mbind, p, bytes, mode, &mask, sizeof(mask) * 8 + 1, 0);
+            }
+            return p;
         }
+#endif
+        return ::operator new(bytes);
+    }
 
-        return shape_.front();
+    static void deallocate(void *p, size_t bytes) {
+#ifdef __linux__
+        if (mapped(bytes)) {
+            munmap(p, bytes);
+            return;
+        }
+#endif
+        ::operator delete(p);
     }
 
-    template<template<class, class...> class Container, class... Ts>
-    ndarray reshape(const Container<int, Ts...> &new_shape) const {
-        // TODO negative value for unknown dimension.
-        int size = get_size(shape_);
-        if (size != get_size(new_shape)) {
-            std::ostringstream oss;
-            oss << "cannot reshape array of size " << size << " into shape (";
-            std::copy(new_shape.begin(), new_shape.end(), std::ostream_iterator<int>(oss, ","));
-            oss << ")";
-            throw Error<ValueError>(oss.str());
+private:
+    struct State {
+        std::atomic<Placement> placement{FIRST_TOUCH};
+        std::atomic<unsigned long> nodes{0};
+        std::atomic<bool> huge_pages{false};
+    };
+
+    static State &get() {
+        static State state;
+        return state;
+    }
+};
+
+/**
+ * Allocator for element values through MemoryPolicy.
+ *
+ * Trivial elements are not value-initialized one by one: heap storage is zeroed in bulk and mapped
+ * storage already reads as zero, leaving its pages for the filling threads to touch first.
+ */
+template<class T>
+struct PageAllocator {
+    typedef T value_type;
+
+    PageAllocator() = default;
+
+    template<class U>
+    PageAllocator(const PageAllocator<U> &) {
+    }
+
+    T *allocate(size_t n) {
+        const size_t bytes = n * sizeof(T);
+        void *p = MemoryPolicy::allocate(bytes);
+        if (!MemoryPolicy::mapped(bytes)) {
+            std::memset(p, 0, bytes);
         }
+        return static_cast<T *>(p);
+    }
 
-        return ndarray(Shape(new_shape.begin(), new_shape.end()), data_);
+    void deallocate(T *p, size_t n) {
+        MemoryPolicy::deallocate(p, n * sizeof(T));
     }
 
-    ndarray reshape(std::initializer_list<int> new_shape) const {
-        ndarray (ndarray::*delegate)(const std::initializer_list<int> &) const = &ndarray::reshape;
-        return (this->*delegate)(new_shape);
+    template<class U>
+    void construct(U *p) {
+        initialize(p, std::is_trivially_default_constructible<U>());
+    }
+
+    template<class U, class... Args>
+    void construct(U *p, Args &&... args) {
+        ::new (static_cast<void *>(p)) U(std::forward<Args>(args)...);
     }
 
     template<class U>
-    ndarray<U> astype() const {
-        std::vector<std::shared_ptr<U>> data(size());
-        std::transform(data_.begin(), data_.end(), data.begin(), [] (Value arg) -> std::shared_ptr<U> {
-            return std::make_shared<U>(static_cast<U>(*arg));
-        });
-        return ndarray<U>(shape_, data);
+    bool operator==(const PageAllocator<U> &) const {
+        return true;
+    }
+
+    template<class U>
+    bool operator!=(const PageAllocator<U> &) const {
+        return false;
+    }
+
+private:
+    template<class U>
+    static void initialize(U *, std::true_type) {
+    }
+
+    template<class U>
+    static void initialize(U *p, std::false_type) {
+        ::new (static_cast<void *>(p)) U();
+    }
+};
+
+/**
+ * Allocator for the element-pointer vectors of ndarray<T>, counting them as T's handles in MemoryStats.
+ *
+ * The scope tag is kept in a header in front of the block so the release is charged to the same scope.
+ */
+template<class U, class T>
+struct HandleAllocator {
+    typedef U value_type;
+
+    template<class V>
+    struct rebind {
+        typedef HandleAllocator<V, T> other;
+    };
+
+    HandleAllocator() = default;
+
+    template<class V>
+    HandleAllocator(const HandleAllocator<V, T> &) {
+    }
+
+    U *allocate(size_t n) {
+        const size_t bytes = n * sizeof(U);
+        char *block = static_cast<char *>(MemoryPolicy::allocate(HEADER + bytes));
+        const int tag = MemoryStats::acquire(dtype_traits<T>::name(), true, bytes);
+        std::memcpy(block, &tag, sizeof(tag));
+        return reinterpret_cast<U *>(block + HEADER);
+    }
+
+    void deallocate(U *p, size_t n) {
+        char *block = reinterpret_cast<char *>(p) - HEADER;
+        int tag;
+        std::memcpy(&tag, block, sizeof(tag));
+        MemoryStats::release(dtype_traits<T>::name(), true, n * sizeof(U), tag);
+        MemoryPolicy::deallocate(block, HEADER + n * sizeof(U));
     }
 
-    ndarray operator[](int index) const {
-        index = resolve_index(index, true);
+    template<class V>
+    bool operator==(const HandleAllocator<V, T> &) const {
+        return true;
+    }
+
+    template<class V>
+    bool operator!=(const HandleAllocator<V, T> &) const {
+        return false;
+    }
+
+private:
+    static constexpr size_t HEADER = alignof(std::max_align_t);
+};
+
+/**
+ * Opt-in tracer of ndarray operations, exported in the Chrome trace event format (chrome://tracing, Perfetto).
+ *
+ * Every thread appends complete events to its own fixed-size ring buffer, so recording takes no lock;
+ * once a buffer wraps, its oldest events are overwritten. Export while no traced operation is running.
+ */
+class Tracer {
+    struct Event {
+        const char *name = "";
+        long long start_ns = 0;
+        long long duration_ns = 0;
+        std::string args;
+    };
+
+public:
+    /**
+     * Start recording, keeping the last capacity events of every thread.
+     */
+    static void enable(size_t capacity = 1 << 16) {
+        auto &state = get();
+        std::lock_guard<std::mutex> lock(state.mutex);
+        state.capacity = std::max<size_t>(1, capacity);
+        enabled_flag().store(true, std::memory_order_release);
+    }
+
+    static void disable() {
+        enabled_flag().store(false, std::memory_order_release);
+    }
+
+    static bool enabled() {
+        return enabled_flag().load(std::memory_order_relaxed);
+    }
+
+    /**
+     * Drop every recorded event.
+     */
+    static void clear() {
+        auto &state = get();
+        std::lock_guard<std::mutex> lock(state.mutex);
+        for (auto &buffer : state.buffers) {
+            buffer->next.store(0, std::memory_order_release);
+        }
+    }
+
+    /**
+     * {"traceEvents": [{"name": ..., "cat": "ndarray", "ph": "X", "ts": ..., "dur": ..., "pid": 0, "tid": ..., "args": {...}}, ...]}
+     */
+    static std::string to_chrome_json() {
+        auto &state = get();
+        std::lock_guard<std::mutex> lock(state.mutex);
+        std::ostringstream oss;
+        oss << "{\"traceEvents\": [";
+        const char *separator = "";
+        for (const auto &buffer : state.buffers) {
+            const size_t end = buffer->next.load(std::memory_order_acquire), capacity = buffer->events.size();
+            for (size_t i = (end > capacity) ? (end - capacity) : 0; i < end; ++i) {
+                const Event &event = buffer->events[i % capacity];
+                oss << separator << "{\"name\": \"" << event.name << "\", \"cat\": \"ndarray\", \"ph\": \"X\", \"ts\": "
+                    << event.start_ns / 1000. << ", \"dur\": " << event.duration_ns / 1000. << ", \"pid\": 0, \"tid\": "
+                    << buffer->tid << ", \"args\": {" << event.args << "}}";
+                separator = ", ";
+            }
+        }
+        oss << "]}";
+        return oss.str();
+    }
+
+    /**
+     * Times the enclosing scope as one event named name (a string literal), when tracing is enabled.
+     */
+    class Span {
+    public:
+        explicit Span(const char *name) : active_(Tracer::enabled()) {
+            if (active_) {
+                event_.name = name;
+                event_.start_ns = now_ns();
+            }
+        }
+
+        ~Span() {
+            if (active_) {
+                event_.duration_ns = now_ns() - event_.start_ns;
+                Tracer::record(std::move(event_));
+            }
+        }
+
+        Span(const Span &) = delete;
+        Span &operator=(const Span &) = delete;
+
+        explicit operator bool() const {
+            return active_;
+        }
+
+        Span &shape(const std::string &key, const std::vector<int> &shape) {
+            std::ostringstream oss;
+            oss << '(';
+            std::copy(shape.begin(), shape.end(), std::ostream_iterator<int>(oss, ","));
+            oss << ')';
+            return arg(key, '"' + oss.str() + '"');
+        }
+
+        Span &bytes(long long bytes) {
+            return arg("bytes", std::to_string(bytes));
+        }
+
+    private:
+        Span &arg(const std::string &key, const std::string &json) {
+            event_.args += (event_.args.empty() ? "\"" : ", \"") + key + "\": " + json;
+            return *this;
+        }
+
+        bool active_;
+        Event event_;
+    };
+
+private:
+    struct Buffer {
+        std::vector<Event> events;
+        std::atomic<size_t> next{0};
+        int tid = 0;
+    };
+
+    struct State {
+        std::mutex mutex;
+        size_t capacity = 1 << 16;
+        // Buffers outlive their threads so the events of finished threads can still be exported.
+        std::vector<std::shared_ptr<Buffer>> buffers;
+    };
+
+    static State &get() {
+        static State state;
+        return state;
+    }
+
+    static std::atomic<bool> &enabled_flag() {
+        static std::atomic<bool> enabled(false);
+        return enabled;
+    }
+
+    static long long now_ns() {
+        static const auto epoch = std::chrono::steady_clock::now();
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - epoch).count();
+    }
+
+    static void record(Event event) {
+        static thread_local std::shared_ptr<Buffer> buffer;
+        if (!buffer) {
+            auto &state = get();
+            std::lock_guard<std::mutex> lock(state.mutex);
+            buffer = std::make_shared<Buffer>();
+            buffer->events.resize(state.capacity);
+            buffer->tid = state.buffers.size();
+            state.buffers.push_back(buffer);
+        }
+        const size_t index = buffer->next.load(std::memory_order_relaxed);
+        buffer->events[index % buffer->events.size()] = std::move(event);
+        buffer->next.store(index + 1, std::memory_order_release);
+    }
+};
+
+/**
+ * Precomputed forward complex FFT of one length, shared through a process-wide cache.
+ *
+ * Lengths made of 2, 3 and 5 run a mixed-radix decimation-in-time transform (radix-4 where possible);
+ * any other prime factor switches the whole length to Bluestein's chirp-z convolution on a power of 2.
+ */
+template<class R>
+class FftPlan {
+public:
+    typedef std::complex<R> Complex;
+
+    static std::shared_ptr<const FftPlan> get(int n) {
+        static std::mutex mutex;
+        static std::map<int, std::shared_ptr<const FftPlan>> cache;
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto it = cache.find(n);
+            if (it != cache.end()) {
+                return it->second;
+            }
+        }
+
+        // Built unlocked: a Bluestein plan fetches its power-of-2 sub-plan from the cache.
+        auto plan = std::make_shared<const FftPlan>(n);
+        std::lock_guard<std::mutex> lock(mutex);
+        return cache.emplace(n, std::move(plan)).first->second;
+    }
+
+    explicit FftPlan(int n) : n_(n) {
+        int rest = n;
+        for (int p : {4, 2, 3, 5}) {
+            for (; (rest > 1) && (rest % p == 0); rest /= p) {
+                factors_.push_back(p);
+                factors_.push_back(rest / p);
+            }
+        }
+
+        if (rest == 1) {
+            twiddles_.resize(n);
+            for (int k = 0; k < n; ++k) {
+                twiddles_[k] = std::polar<double>(1.0, -2.0 * M_PI * k / n);
+            }
+            return;
+        }
+
+        // Bluestein: x[k] * w[k] convolved with conj(w), w[k] = exp(-i pi k^2 / n).
+        factors_.clear();
+        for (m_ = 1; m_ < 2 * n - 1; m_ *= 2) {
+        }
+        sub_ = get(m_);
+        chirp_.resize(n);
+        for (int k = 0; k < n; ++k) {
+            long long k2 = static_cast<long long>(k) * k % (2LL * n);
+            chirp_[k] = std::polar<double>(1.0, -M_PI * k2 / n);
+        }
+        std::vector<Complex> filter(m_);
+        filter[0] = std::conj(chirp_[0]);
+        for (int k = 1; k < n; ++k) {
+            filter[k] = filter[m_ - k] = std::conj(chirp_[k]);
+        }
+        filter_.resize(m_);
+        sub_->forward(filter.data(), filter_.data());
+    }
+
+    int size() const {
+        return n_;
+    }
+
+    /**
+     * Unnormalized forward transform, out[k] = sum(in[j] * exp(-2i pi jk / n)); in and out must not overlap.
+     */
+    void forward(const Complex *in, Complex *out) const {
+        if (n_ == 1) {
+            out[0] = in[0];
+        } else if (!factors_.empty()) {
+            work(out, in, 1, factors_.data());
+        } else {
+            std::vector<Complex> a(m_), b(m_);
+            for (int k = 0; k < n_; ++k) {
+                a[k] = in[k] * chirp_[k];
+            }
+            sub_->forward(a.data(), b.data());
+            for (int k = 0; k < m_; ++k) {
+                b[k] = std::conj(b[k] * filter_[k]);
+            }
+            sub_->forward(b.data(), a.data());
+            const R scale = R(1) / m_;
+            for (int k = 0; k < n_; ++k) {
+                out[k] = std::conj(a[k]) * scale * chirp_[k];
+            }
+        }
+    }
+
+private:
+    void work(Complex *out, const Complex *in, int fstride, const int *factors) const {
+        const int p = factors[0], m = factors[1];
+        Complex *begin = out, *end = out + p * m;
+        if (m == 1) {
+            for (; out != end; ++out, in += fstride) {
+                *out = *in;
+            }
+        } else {
+            for (; out != end; out += m, in += fstride) {
+                work(out, in, fstride * p, factors + 2);
+            }
+        }
+
+        switch (p) {
+        case 2:
+            butterfly2(begin, fstride, m);
+            break;
+        case 3:
+            butterfly3(begin, fstride, m);
+            break;
+        case 4:
+            butterfly4(begin, fstride, m);
+            break;
+        default:
+            butterfly_generic(begin, fstride, m, p);
+            break;
+        }
+    }
+
+    void butterfly2(Complex *out, int fstride, int m) const {
+        for (int k = 0; k < m; ++k) {
+            Complex t = out[k + m] * twiddles_[k * fstride];
+            out[k + m] = out[k] - t;
+            out[k] += t;
+        }
+    }
+
+    void butterfly3(Complex *out, int fstride, int m) const {
+        const R epi3 = twiddles_[fstride * m].imag();
+        for (int k = 0; k < m; ++k) {
+            Complex s1 = out[k + m] * twiddles_[k * fstride];
+            Complex s2 = out[k + 2 * m] * twiddles_[2 * k * fstride];
+            Complex s3 = s1 + s2, s0 = (s1 - s2) * epi3;
+            Complex mid = out[k] - s3 * R(0.5);
+            out[k] += s3;
+            out[k + 2 * m] = Complex(mid.real() + s0.imag(), mid.imag() - s0.real());
+            out[k + m] = Complex(mid.real() - s0.imag(), mid.imag() + s0.real());
+        }
+    }
+
+    void butterfly4(Complex *out, int fstride, int m) const {
+        for (int k = 0; k < m; ++k) {
+            Complex s0 = out[k + m] * twiddles_[k * fstride];
+            Complex s1 = out[k + 2 * m] * twiddles_[2 * k * fstride];
+            Complex s2 = out[k + 3 * m] * twiddles_[3 * k * fstride];
+            Complex s5 = out[k] - s1;
+            out[k] += s1;
+            Complex s3 = s0 + s2, s4 = s0 - s2;
+            out[k + 2 * m] = out[k] - s3;
+            out[k] += s3;
+            out[k + m] = Complex(s5.real() + s4.imag(), s5.imag() - s4.real());
+            out[k + 3 * m] = Complex(s5.real() - s4.imag(), s5.imag() + s4.real());
+        }
+    }
+
+    // Radix 5 (and any other small radix) as a direct DFT over the p strided inputs.
+    void butterfly_generic(Complex *out, int fstride, int m, int p) const {
+        std::vector<Complex> scratch(p);
+        for (int u = 0; u < m; ++u) {
+            for (int q = 0; q < p; ++q) {
+                scratch[q] = out[u + q * m];
+            }
+            for (int q1 = 0, k = u; q1 < p; ++q1, k += m) {
+                int index = 0;
+                out[k] = scratch[0];
+                for (int q = 1; q < p; ++q) {
+                    index = (index + fstride * k) % n_;
+                    out[k] += scratch[q] * twiddles_[index];
+                }
+            }
+        }
+    }
+
+    int n_;
+    std::vector<int> factors_;
+    std::vector<Complex> twiddles_;
+
+    int m_ = 0;
+    std::shared_ptr<const FftPlan> sub_;
+    std::vector<Complex> chirp_;
+    std::vector<Complex> filter_;
+};
+
+/**
+ * Chunk codec of the native serialization format: byte shuffle, then an LZ77 variant in the spirit of LZ4.
+ *
+ * A compressed block is a run of sequences: a token byte (literal count << 4 | match length - 4, each nibble
+ * extended by 255-continuation bytes when it is 15), the literals, then a 2-byte little-endian match offset.
+ * The last sequence has literals only.
+ */
+struct ChunkCodec {
+    /**
+     * Group byte i of every element together, which turns slowly varying numbers into long runs.
+     */
+    static std::vector<uint8_t> shuffle(const uint8_t *data, size_t size, size_t item) {
+        std::vector<uint8_t> out(size);
+        size_t count = size / item;
+        for (size_t b = 0; b < item; ++b) {
+            for (size_t i = 0; i < count; ++i) {
+                out[b * count + i] = data[i * item + b];
+            }
+        }
+        return out;
+    }
+
+    static void unshuffle(const std::vector<uint8_t> &data, uint8_t *out, size_t item) {
+        size_t count = data.size() / item;
+        for (size_t b = 0; b < item; ++b) {
+            for (size_t i = 0; i < count; ++i) {
+                out[i * item + b] = data[b * count + i];
+            }
+        }
+    }
+
+    static std::vector<uint8_t> compress(const std::vector<uint8_t> &in) {
+        constexpr int HASH_BITS = 12, MIN_MATCH = 4;
+        std::vector<uint8_t> out;
+        std::vector<int> table(1 << HASH_BITS, -1);
+        const size_t n = in.size();
+        size_t anchor = 0, i = 0;
+
+        auto emit = [&out, &in] (size_t literal_begin, size_t literal_end, size_t offset, size_t match) {
+            size_t literals = literal_end - literal_begin;
+            size_t extra = (match >= MIN_MATCH) ? (match - MIN_MATCH) : 0;
+            out.push_back(static_cast<uint8_t>((std::min<size_t>(literals, 15) << 4) | std::min<size_t>(extra, 15)));
+            if (literals >= 15) {
+                put_length(out, literals - 15);
+            }
+            out.insert(out.end(), std::next(in.begin(), literal_begin), std::next(in.begin(), literal_end));
+            if (match >= MIN_MATCH) {
+                out.push_back(static_cast<uint8_t>(offset & 0xff));
+                out.push_back(static_cast<uint8_t>(offset >> 8));
+                if (extra >= 15) {
+                    put_length(out, extra - 15);
+                }
+            }
+        };
+
+        while (i + MIN_MATCH <= n) {
+            uint32_t word;
+            std::memcpy(&word, &in[i], sizeof(word));
+            int &slot = table[(word * 2654435761U) >> (32 - HASH_BITS)];
+            size_t candidate = slot;
+            slot = static_cast<int>(i);
+            if ((candidate == static_cast<size_t>(-1)) || (i - candidate > 0xffff) || (i - candidate == 0)
+                    || (std::memcmp(&in[candidate], &in[i], MIN_MATCH) != 0)) {
+                ++i;
+                continue;
+            }
+
+            size_t match = MIN_MATCH;
+            while ((i + match < n) && (in[candidate + match] == in[i + match])) {
+                ++match;
+            }
+            emit(anchor, i, i - candidate, match);
+            i += match;
+            anchor = i;
+        }
+        emit(anchor, n, 0, 0);
+        return out;
+    }
+
+    static std::vector<uint8_t> decompress(const std::vector<uint8_t> &in, size_t size) {
+        std::vector<uint8_t> out;
+        out.reserve(size);
+        size_t i = 0;
+        auto corrupt = [] () {
+            throw Error<ValueError>("corrupt compressed chunk");
+        };
+        while (i < in.size()) {
+            uint8_t token = in[i++];
+            size_t literals = token >> 4;
+            if (literals == 15) {
+                literals += get_length(in, i);
+            }
+            if ((i + literals > in.size()) || (out.size() + literals > size)) {
+                corrupt();
+            }
+            out.insert(out.end(), std::next(in.begin(), i), std::next(in.begin(), i + literals));
+            i += literals;
+            if (i == in.size()) {
+                // The last sequence carries literals only.
+                if ((token & 0x0f) != 0) {
+                    corrupt();
+                }
+                break;
+            }
+
+            if (i + 2 > in.size()) {
+                corrupt();
+            }
+            size_t offset = in[i] | (in[i + 1] << 8);
+            i += 2;
+            size_t match = (token & 0x0f) + 4;
+            if ((token & 0x0f) == 15) {
+                match += get_length(in, i);
+            }
+            if ((offset == 0) || (offset > out.size()) || (out.size() + match > size)) {
+                corrupt();
+            }
+            for (size_t from = out.size() - offset; match > 0; --match, ++from) {
+                out.push_back(out[from]);
+            }
+        }
+        if (out.size() != size) {
+            corrupt();
+        }
+        return out;
+    }
+
+    static uint32_t crc32(const uint8_t *data, size_t size) {
+        static const std::vector<uint32_t> table = [] () {
+            std::vector<uint32_t> table(256);
+            for (uint32_t i = 0; i < 256; ++i) {
+                uint32_t c = i;
+                for (int k = 0; k < 8; ++k) {
+                    c = (c & 1) ? (0xedb88320U ^ (c >> 1)) : (c >> 1);
+                }
+                table[i] = c;
+            }
+            return table;
+        }();
+
+        uint32_t crc = 0xffffffffU;
+        for (size_t i = 0; i < size; ++i) {
+            crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+        }
+        return crc ^ 0xffffffffU;
+    }
+
+private:
+    static void put_length(std::vector<uint8_t> &out, size_t length) {
+        for (; length >= 255; length -= 255) {
+            out.push_back(255);
+        }
+        out.push_back(static_cast<uint8_t>(length));
+    }
+
+    static size_t get_length(const std::vector<uint8_t> &in, size_t &i) {
+        size_t length = 0;
+        for (uint8_t byte = 255; byte == 255; length += byte) {
+            if (i >= in.size()) {
+                throw Error<ValueError>("corrupt compressed chunk");
+            }
+            byte = in[i++];
+        }
+        return length;
+    }
+};
+
+/**
+ * Philox4x32-10 counter-based generator (Salmon et al., "Parallel random numbers: as easy as 1, 2, 3").
+ *
+ * Every 128-bit counter maps to four random words through a keyed bijection, so any block of the stream
+ * can be produced on its own, in any order and on any thread, with the same result.
+ */
+class Philox {
+public:
+    struct Block {
+        uint32_t words[4];
+    };
+
+    explicit Philox(uint64_t key) : key_{static_cast<uint32_t>(key), static_cast<uint32_t>(key >> 32)} {
+    }
+
+    /**
+     * Block number index of stream number stream.
+     */
+    Block operator()(uint64_t index, uint64_t stream) const {
+        Block ctr = {{static_cast<uint32_t>(index), static_cast<uint32_t>(index >> 32),
+                static_cast<uint32_t>(stream), static_cast<uint32_t>(stream >> 32)}};
+        uint32_t k0 = key_[0], k1 = key_[1];
+        for (int round = 0; round < 10; ++round) {
+            const uint64_t p0 = static_cast<uint64_t>(0xD2511F53) * ctr.words[0];
+            const uint64_t p1 = static_cast<uint64_t>(0xCD9E8D57) * ctr.words[2];
+            ctr = {{static_cast<uint32_t>(p1 >> 32) ^ ctr.words[1] ^ k0, static_cast<uint32_t>(p1),
+                    static_cast<uint32_t>(p0 >> 32) ^ ctr.words[3] ^ k1, static_cast<uint32_t>(p0)}};
+            k0 += 0x9E3779B9;
+            k1 += 0xBB67AE85;
+        }
+        return ctr;
+    }
+
+private:
+    uint32_t key_[2];
+};
+
+/**
+ * While alive, marks the constructing thread as a worker of some parallel region. parallel_for started
+ * on such a thread runs inline, so nested parallelism (a kernel calling gemm, a lazy::eval worker running
+ * a kernel) stays within one set of hardware threads instead of multiplying them.
+ */
+class ParallelRegion {
+public:
+    ParallelRegion() : previous_(active()) {
+        active() = true;
+    }
+
+    ~ParallelRegion() {
+        active() = previous_;
+    }
+
+    ParallelRegion(const ParallelRegion &) = delete;
+    ParallelRegion &operator=(const ParallelRegion &) = delete;
+
+    static bool &active() {
+        static thread_local bool flag = false;
+        return flag;
+    }
+
+private:
+    bool previous_;
+};
+
+/**
+ * Multi-operand strided iteration engine shared by elementwise operators, copies and reductions.
+ *
+ * Every operand is described by its strides (in elements) over a common shape. Unit axes are dropped,
+ * axes are ordered so the smallest strides are innermost, axes that are contiguous for every operand
+ * are coalesced, and the innermost axis is cut into tiles. The walk is a sequence of rows, each handed to
+ * the inner loop as one (offset, stride) pair per operand and a shared count.
+ */
+class NdIter {
+public:
+    NdIter(const std::vector<int> &shape, const std::vector<std::vector<int>> &strides, int tile = 1 << 12)
+            : num_operands_(strides.size()) {
+        std::vector<int> axes;
+        for (int axis = 0; axis < static_cast<int>(shape.size()); ++axis) {
+            if (shape[axis] == 0) {
+                empty_ = true;
+            } else if (shape[axis] != 1) {
+                axes.push_back(axis);
+            }
+        }
+        auto weight = [&strides] (int axis) -> long long {
+            long long sum = 0;
+            for (const auto &operand : strides) {
+                sum += std::abs(operand[axis]);
+            }
+            return sum;
+        };
+        std::stable_sort(axes.begin(), axes.end(), [&weight] (int lhs, int rhs) -> bool {
+            return weight(lhs) > weight(rhs);
+        });
+
+        for (int axis : axes) {
+            bool contiguous = !shape_.empty();
+            for (int op = 0; contiguous && (op < num_operands_); ++op) {
+                contiguous = (stride(shape_.size() - 1, op) == static_cast<long long>(strides[op][axis]) * shape[axis]);
+            }
+            if (contiguous) {
+                shape_.back() *= shape[axis];
+                for (int op = 0; op < num_operands_; ++op) {
+                    stride(shape_.size() - 1, op) = strides[op][axis];
+                }
+                continue;
+            }
+            shape_.push_back(shape[axis]);
+            for (int op = 0; op < num_operands_; ++op) {
+                strides_.push_back(strides[op][axis]);
+            }
+        }
+        if (shape_.empty()) {
+            shape_.push_back(1);
+            strides_.assign(num_operands_, 0);
+        }
+
+        inner_strides_.resize(num_operands_);
+        for (int op = 0; op < num_operands_; ++op) {
+            inner_strides_[op] = stride(shape_.size() - 1, op);
+        }
+        tile_ = std::max(1, std::min(tile, shape_.back()));
+        num_tiles_ = (shape_.back() + tile_ - 1) / tile_;
+        num_rows_ = empty_ ? 0 : num_tiles_;
+        for (size_t axis = 0; axis + 1 < shape_.size(); ++axis) {
+            num_rows_ *= shape_[axis];
+        }
+    }
+
+    /**
+     * Number of rows, i.e. calls to the inner loop; ranges of rows can be walked independently.
+     */
+    long long num_rows() const {
+        return num_rows_;
+    }
+
+    /**
+     * Call f(offsets, strides, count) for rows [begin, end), offsets and strides holding one entry per operand.
+     */
+    template<class F>
+    void for_each(long long begin, long long end, F f) const {
+        if (begin >= end) {
+            return;
+        }
+
+        // One buffer for the outer index and the row offsets.
+        const int outer = shape_.size() - 1;
+        std::vector<long long> scratch(outer + num_operands_);
+        long long *index = scratch.data(), *row = index + outer;
+        const int *inner_strides = inner_strides_.data();
+
+        long long rest = begin / num_tiles_;
+        int tile_index = begin % num_tiles_;
+        for (int axis = outer - 1; axis >= 0; --axis) {
+            index[axis] = rest % shape_[axis];
+            rest /= shape_[axis];
+        }
+
+        for (long long r = begin; r < end; ++r) {
+            for (int op = 0; op < num_operands_; ++op) {
+                long long offset = static_cast<long long>(tile_index) * tile_ * inner_strides[op];
+                for (int axis = 0; axis < outer; ++axis) {
+                    offset += index[axis] * stride(axis, op);
+                }
+                row[op] = offset;
+            }
+            f(row, inner_strides, std::min(tile_, shape_.back() - tile_index * tile_));
+
+            if (++tile_index < num_tiles_) {
+                continue;
+            }
+            tile_index = 0;
+            for (int axis = outer - 1; axis >= 0; --axis) {
+                if (++index[axis] < shape_[axis]) {
+                    break;
+                }
+                index[axis] = 0;
+            }
+        }
+    }
+
+    template<class F>
+    void for_each(F f) const {
+        for_each(0, num_rows_, f);
+    }
+
+    /**
+     * Upper bound of count in the inner loop.
+     */
+    int row_size() const {
+        return tile_;
+    }
+
+private:
+    long long &stride(int axis, int op) {
+        return strides_[axis * num_operands_ + op];
+    }
+
+    long long stride(int axis, int op) const {
+        return strides_[axis * num_operands_ + op];
+    }
+
+    int num_operands_;
+    bool empty_ = false;
+    std::vector<int> shape_;
+    std::vector<long long> strides_;
+    std::vector<int> inner_strides_;
+    int tile_ = 1;
+    int num_tiles_ = 1;
+    long long num_rows_ = 0;
+};
+
+/**
+ * Division by a loop-invariant integer as a multiply-high and shifts (Granlund-Montgomery, as libdivide does),
+ * truncating toward zero exactly like the built-in operator /.
+ *
+ * Types up to 32 bits work in 32-bit arithmetic; 64-bit types need a 128-bit multiply.
+ */
+template<class T>
+class IntDivider {
+    static_assert(std::is_integral<T>::value, "IntDivider requires an integral type");
+
+    typedef typename std::conditional<(sizeof(T) <= 4),
+            typename std::conditional<std::is_signed<T>::value, int32_t, uint32_t>::type,
+            typename std::conditional<std::is_signed<T>::value, int64_t, uint64_t>::type>::type Word;
+    typedef typename std::make_unsigned<Word>::type UWord;
+
+    static constexpr int BITS = sizeof(Word) * 8;
+
+public:
+#ifdef __SIZEOF_INT128__
+    static constexpr bool supported = true;
+#else
+    static constexpr bool supported = (sizeof(T) <= 4);
+#endif
+
+    explicit IntDivider(T divisor) : negative_(divisor < 0) {
+        UWord d = negative_ ? (UWord(0) - static_cast<UWord>(static_cast<Word>(divisor))) : static_cast<UWord>(divisor);
+        int log2 = 0;
+        while ((log2 < BITS - 1) && ((UWord(1) << (log2 + 1)) <= d)) {
+            ++log2;
+        }
+
+        if ((d & (d - 1)) == 0) {
+            shift_ = log2;
+            return;
+        }
+
+        // l = ceil(log2(d)), magic = floor(2^N * (2^l - d) / d) + 1 unsigned, floor(2^(N - 1 + l) / d) + 1 signed.
+        int l = log2 + 1;
+        shift_ = l - 1;
+        if (std::is_signed<T>::value) {
+            magic_ = static_cast<UWord>(div_wide(l - 1, d) + 1);
+        } else {
+            magic_ = static_cast<UWord>(div_wide(0, d, l) + 1);
+        }
+        is_power_of_2_ = false;
+    }
+
+    T operator()(T value) const {
+        Word n = value;
+        Word q;
+        if (std::is_signed<T>::value) {
+            if (is_power_of_2_) {
+                // Bias negative dividends by d - 1 so the arithmetic shift truncates toward zero.
+                q = n;
+                if (shift_ > 0) {
+                    UWord bias = static_cast<UWord>(n >> (BITS - 1)) >> (BITS - shift_);
+                    q = static_cast<Word>(static_cast<UWord>(n) + bias) >> shift_;
+                }
+            } else {
+                q = static_cast<Word>(mulhi_signed(static_cast<Word>(magic_), n) + n);
+                q = (q >> shift_) - (n >> (BITS - 1));
+            }
+            return static_cast<T>(negative_ ? -q : q);
+        }
+
+        UWord u = static_cast<UWord>(n);
+        if (is_power_of_2_) {
+            return static_cast<T>(u >> shift_);
+        }
+        UWord t = mulhi(magic_, u);
+        return static_cast<T>((t + ((u - t) >> 1)) >> shift_);
+    }
+
+private:
+#ifdef __SIZEOF_INT128__
+    typedef unsigned __int128 UWide64;
+    typedef __int128 Wide64;
+#else
+    typedef uint64_t UWide64;  // unused: 64-bit types report !supported
+    typedef int64_t Wide64;
+#endif
+    typedef typename std::conditional<(BITS == 32), uint64_t, UWide64>::type UWide;
+    typedef typename std::conditional<(BITS == 32), int64_t, Wide64>::type Wide;
+
+    /**
+     * floor(2^(N + extra) / d) for the signed magic, or floor(2^N * (2^l - d) / d) when l is given.
+     */
+    static UWide div_wide(int extra, UWord d, int l = -1) {
+        if (l == -1) {
+            return (UWide(1) << (BITS + extra)) / d;
+        }
+        UWide numerator = (UWide(1) << BITS) * ((UWide(1) << l) - d);
+        return numerator / d;
+    }
+
+    static UWord mulhi(UWord a, UWord b) {
+        return static_cast<UWord>((static_cast<UWide>(a) * b) >> BITS);
+    }
+
+    static Word mulhi_signed(Word a, Word b) {
+        return static_cast<Word>((static_cast<Wide>(a) * b) >> BITS);
+    }
+
+    bool negative_;
+    bool is_power_of_2_ = true;
+    int shift_ = 0;
+    UWord magic_ = 0;
+};
+
+template<class T>
+class ndarray {
+public:
+    typedef T dtype;
+    typedef typename complex_traits<T>::real_type real_type;
+    typedef typename complex_traits<T>::complex_type complex_type;
+
+    static ndarray arange(int n, int start = 0) {
+        Buffer values(n);
+        T *out = values.data();
+        parallel_for(n, 1 << 15, [out, start] (int begin, int end) {
+            for (int i = begin; i < end; ++i) {
+                out[i] = static_cast<T>(start + i);
+            }
+        });
+        return ndarray({n}, make_data(std::move(values)));
+    }
+
+    static ndarray scalar(const T &s) {
+        return ndarray({}, make_data({s}));
+    }
+
+    /**
+     * Array of shape filled with fill_value, its elements laid out in row-major (order 'C') or
+     * column-major (order 'F') order.
+     */
+    template<template<class, class...> class Container, class... Ts>
+    static ndarray full(const Container<int, Ts...> &shape, const T &fill_value, char order = 'C') {
+        if ((order != 'C') && (order != 'F')) {
+            throw Error<ValueError>("only 'C' or 'F' order is permitted");
+        }
+        int size = get_size(shape);
+        Buffer values(size);
+        T *out = values.data();
+        parallel_for(size, 1 << 15, [out, &fill_value] (int begin, int end) {
+            std::fill(out + begin, out + end, fill_value);
+        });
+        Shape result_shape(shape.begin(), shape.end());
+        Data data = make_data(std::move(values), result_shape, order);
+        return ndarray(std::move(result_shape), std::move(data));
+    }
+
+    static ndarray full(std::initializer_list<int> shape, const T &fill_value, char order = 'C') {
+        ndarray (*delegate)(const std::initializer_list<int> &, const T &, char) = &ndarray::full;
+        return delegate(shape, fill_value, order);
+    }
+
+    /**
+     * View an external buffer without copying it, element (i, j, ...) at ptr[i * strides[0] + j * strides[1] + ...].
+     *
+     * Strides count elements, not bytes; empty strides mean C-contiguous. The array keeps keep_alive
+     * (e.g. the message that owns the payload) alive for as long as any element is referenced; with no
+     * keep_alive the caller must outlive every view of the buffer.
+     */
+    static ndarray from_buffer(
+            T *ptr,
+            const std::vector<int> &shape,
+            const std::vector<int> &strides = {},
+            std::shared_ptr<const void> keep_alive = nullptr) {
+        if (std::any_of(shape.begin(), shape.end(), [] (int dim) -> bool { return dim < 0; })) {
+            throw Error<ValueError>("negative dimensions are not allowed");
+        }
+        const std::vector<int> &steps = strides.empty() ? get_strides(shape) : strides;
+        if (steps.size() != shape.size()) {
+            throw Error<ValueError>("mismatch in length of strides and shape");
+        }
+
+        // Aliasing constructor: every element shares ownership of keep_alive but points into the buffer.
+        std::shared_ptr<const void> owner = std::move(keep_alive);
+        Data data(get_size(shape));
+        std::vector<int> index(shape.size(), 0);
+        long long offset = 0;
+        for (auto &element : data) {
+            element = Value(std::const_pointer_cast<void>(owner), ptr + offset);
+            for (int axis = static_cast<int>(shape.size()) - 1; axis >= 0; --axis) {
+                offset += steps[axis];
+                if (++index[axis] < shape[axis]) {
+                    break;
+                }
+                offset -= static_cast<long long>(steps[axis]) * shape[axis];
+                index[axis] = 0;
+            }
+        }
+        return ndarray(shape, std::move(data));
+    }
+
+    /**
+     * Same as above, taking ownership of ptr: deleter(ptr) runs once the last element is released.
+     */
+    template<class Deleter, class = typename std::enable_if<
+            !std::is_convertible<Deleter, std::shared_ptr<const void>>::value>::type>
+    static ndarray from_buffer(T *ptr, const std::vector<int> &shape, const std::vector<int> &strides, Deleter deleter) {
+        return from_buffer(ptr, shape, strides, std::shared_ptr<const void>(ptr, std::move(deleter)));
+    }
+
+    /**
+     * Evaluate the Einstein summation convention on the operands.
+     *
+     * Python notation "np.einsum('ij,jk->ik', a, b)" becomes "ndarray::einsum("ij,jk->ik", a, b)".
+     * Without "->" the output subscripts are the labels appearing exactly once, in alphabetical order.
+     * With 3+ operands the pairwise contraction order is picked greedily, cheapest contraction first.
+     */
+    template<class... Arrays>
+    static ndarray einsum(const std::string &subscripts, const Arrays &... operands) {
+        return einsum_impl(subscripts, {operands...});
+    }
+
+    /**
+     * Join arrays along an existing axis, copying into a single preallocated buffer.
+     */
+    template<template<class, class...> class Container, class... Ts>
+    static ndarray concatenate(const Container<ndarray, Ts...> &arrays, int axis = 0) {
+        if (arrays.size() == 0) {
+            throw Error<ValueError>("need at least one array to concatenate");
+        }
+
+        const ndarray &first = *arrays.begin();
+        if (first.ndim() == 0) {
+            throw Error<ValueError>("zero-dimensional arrays cannot be concatenated");
+        }
+        axis = normalize_axis(axis, first.ndim());
+
+        Shape shape = first.shape_;
+        shape[axis] = 0;
+        int index = 0;
+        for (const auto &ary : arrays) {
+            if (ary.ndim() != first.ndim()) {
+                std::ostringstream oss;
+                oss << "all the input arrays must have same number of dimensions, but the array at index 0 has "
+                    << first.ndim() << " dimension(s) and the array at index " << index << " has "
+                    << ary.ndim() << " dimension(s)";
+                throw Error<ValueError>(oss.str());
+            }
+            for (int i = 0; i < ary.ndim(); ++i) {
+                if ((i != axis) && (ary.shape_[i] != first.shape_[i])) {
+                    std::ostringstream oss;
+                    oss << "all the input array dimensions except for the concatenation axis must match exactly, "
+                        << "but along dimension " << i << ", the array at index 0 has size " << first.shape_[i]
+                        << " and the array at index " << index << " has size " << ary.shape_[i];
+                    throw Error<ValueError>(oss.str());
+                }
+            }
+            shape[axis] += ary.shape_[axis];
+            ++index;
+        }
+
+        auto values = join_data<std::vector<T>>(arrays, axis, [] (const Value &arg) -> T { return *arg; });
+        return ndarray(std::move(shape), make_data(std::move(values)));
+    }
+
+    static ndarray concatenate(std::initializer_list<ndarray> arrays, int axis = 0) {
+        ndarray (*delegate)(const std::initializer_list<ndarray> &, int) = &ndarray::concatenate;
+        return delegate(arrays, axis);
+    }
+
+    /**
+     * Join arrays of the same shape along a new axis.
+     */
+    template<template<class, class...> class Container, class... Ts>
+    static ndarray stack(const Container<ndarray, Ts...> &arrays, int axis = 0) {
+        if (arrays.size() == 0) {
+            throw Error<ValueError>("need at least one array to stack");
+        }
+
+        const ndarray &first = *arrays.begin();
+        axis = normalize_axis(axis, first.ndim() + 1);
+        if (std::any_of(arrays.begin(), arrays.end(), [&first] (const ndarray &ary) -> bool {
+                return ary.shape_ != first.shape_;
+            })) {
+            throw Error<ValueError>("all input arrays must have the same shape");
+        }
+
+        Shape shape = first.shape_;
+        shape.insert(std::next(shape.begin(), axis), static_cast<int>(arrays.size()));
+
+        auto values = join_data<std::vector<T>>(arrays, axis, [] (const Value &arg) -> T { return *arg; });
+        return ndarray(std::move(shape), make_data(std::move(values)));
+    }
+
+    static ndarray stack(std::initializer_list<ndarray> arrays, int axis = 0) {
+        ndarray (*delegate)(const std::initializer_list<ndarray> &, int) = &ndarray::stack;
+        return delegate(arrays, axis);
+    }
+
+    /**
+     * Concatenate along the first axis, 1-D arrays of shape (N,) being treated as (1, N).
+     */
+    template<template<class, class...> class Container, class... Ts>
+    static ndarray vstack(const Container<ndarray, Ts...> &arrays) {
+        std::vector<ndarray> rows;
+        for (const auto &ary : arrays) {
+            rows.push_back((ary.ndim() < 2) ? ary.reshape({1, ary.size()}) : ary);
+        }
+        return concatenate(rows, 0);
+    }
+
+    static ndarray vstack(std::initializer_list<ndarray> arrays) {
+        ndarray (*delegate)(const std::initializer_list<ndarray> &) = &ndarray::vstack;
+        return delegate(arrays);
+    }
+
+    /**
+     * Concatenate along the second axis, or the first one for 1-D arrays.
+     */
+    template<template<class, class...> class Container, class... Ts>
+    static ndarray hstack(const Container<ndarray, Ts...> &arrays) {
+        int axis = ((arrays.size() > 0) && (arrays.begin()->ndim() == 1)) ? 0 : 1;
+        return concatenate(arrays, axis);
+    }
+
+    static ndarray hstack(std::initializer_list<ndarray> arrays) {
+        ndarray (*delegate)(const std::initializer_list<ndarray> &) = &ndarray::hstack;
+        return delegate(arrays);
+    }
+
+    /**
+     * Matrix product of the last two axes, broadcasting the leading ones like elementwise operators do.
+     *
+     * Python notation "a @ b" becomes "ndarray::matmul(a, b)". A 1-D operand is promoted to a matrix by
+     * prepending (a) or appending (b) a unit axis, which is removed from the result.
+     * Operands are packed once and shared by every batch that broadcasts them; many small products are
+     * spread across threads, a few large ones parallelize inside gemm instead.
+     */
+    static ndarray matmul(const ndarray &a, const ndarray &b) {
+        return matmul_impl(a, b, nullptr);
+    }
+
+    /**
+     * np.matmul(a, b, out=out): the product is written into out, straight into its storage when out is
+     * contiguous and shares no elements with the operands. out must have exactly the product's shape.
+     */
+    static ndarray &matmul(const ndarray &a, const ndarray &b, ndarray &out) {
+        matmul_impl(a, b, &out);
+        return out;
+    }
+
+    /**
+     * np.add(lhs, rhs, out=out) and friends: write the result into out (which may be a view) instead of
+     * allocating one. The operands must broadcast to out's shape; out may be one of the operands.
+     */
+    static ndarray &add(const ndarray &lhs, const ndarray &rhs, ndarray &out) {
+        lhs.operator_impl(rhs, OP_ADD, out);
+        return out;
+    }
+
+    static ndarray &subtract(const ndarray &lhs, const ndarray &rhs, ndarray &out) {
+        lhs.operator_impl(rhs, OP_SUB, out);
+        return out;
+    }
+
+    static ndarray &multiply(const ndarray &lhs, const ndarray &rhs, ndarray &out) {
+        lhs.operator_impl(rhs, OP_MUL, out);
+        return out;
+    }
+
+    static ndarray &divide(const ndarray &lhs, const ndarray &rhs, ndarray &out) {
+        lhs.operator_impl(rhs, OP_DIV, out);
+        return out;
+    }
+
+    static ndarray &negative(const ndarray &a, ndarray &out) {
+        a.elementwise(a, [] (const T &lhs, const T &) -> T { return -lhs; }, out);
+        return out;
+    }
+
+    /**
+     * Discrete Fourier transform along axis, zero-padded or cropped to n points (n = -1 keeps the length).
+     *
+     * Python notation "np.fft.fft(a, n, axis)" becomes "ndarray::fft(a, n, axis)".
+     * Lines along axis are transformed in parallel, each through the cached plan for its length.
+     */
+    static ndarray<complex_type> fft(const ndarray &a, int n = -1, int axis = -1) {
+        return fft_impl<complex_type, complex_type>(a, n, axis, n, false, [] (
+                const FftPlan<real_type> &plan, std::vector<complex_type> &in, complex_type *out) {
+            plan.forward(in.data(), out);
+        });
+    }
+
+    static ndarray<complex_type> ifft(const ndarray &a, int n = -1, int axis = -1) {
+        return fft_impl<complex_type, complex_type>(a, n, axis, n, false, [] (
+                const FftPlan<real_type> &plan, std::vector<complex_type> &in, complex_type *out) {
+            for (auto &value : in) {
+                value = std::conj(value);
+            }
+            plan.forward(in.data(), out);
+            const real_type scale = real_type(1) / plan.size();
+            for (int k = 0; k < plan.size(); ++k) {
+                out[k] = std::conj(out[k]) * scale;
+            }
+        });
+    }
+
+    /**
+     * Transform of real input, keeping the n / 2 + 1 non-negative frequencies.
+     *
+     * An even length packs even and odd samples into one complex transform of half the length.
+     */
+    static ndarray<complex_type> rfft(const ndarray &a, int n = -1, int axis = -1) {
+        return fft_impl<real_type, complex_type>(a, n, axis, n, true, [] (
+                const FftPlan<real_type> &plan, std::vector<real_type> &in, complex_type *out) {
+            int size = in.size();
+            if (size % 2 != 0) {
+                std::vector<complex_type> z(in.begin(), in.end()), full(size);
+                plan.forward(z.data(), full.data());
+                std::copy(full.begin(), std::next(full.begin(), size / 2 + 1), out);
+                return;
+            }
+
+            int half = size / 2;
+            std::vector<complex_type> z(half), zf(half);
+            for (int k = 0; k < half; ++k) {
+                z[k] = complex_type(in[2 * k], in[2 * k + 1]);
+            }
+            plan.forward(z.data(), zf.data());
+            for (int k = 0; k <= half; ++k) {
+                complex_type zk = zf[k % half], zc = std::conj(zf[(half - k) % half]);
+                complex_type even = (zk + zc) * real_type(0.5), odd = (zk - zc) * complex_type(0, -0.5);
+                out[k] = even + std::polar<real_type>(1, -M_PI * k / half) * odd;
+            }
+        });
+    }
+
+    /**
+     * Inverse of rfft, producing n real points (n = -1 means 2 * (m - 1) for m input frequencies).
+     */
+    static ndarray<real_type> irfft(const ndarray &a, int n = -1, int axis = -1) {
+        if ((n == -1) && (a.ndim() > 0)) {
+            n = 2 * (a.shape_[normalize_axis(axis, a.ndim())] - 1);
+        }
+        return fft_impl<complex_type, real_type>(a, n / 2 + 1, axis, n, false, [] (
+                const FftPlan<real_type> &plan, std::vector<complex_type> &in, real_type *out) {
+            int size = plan.size();
+            std::vector<complex_type> full(size), result(size);
+            for (int k = 0; k < size; ++k) {
+                full[k] = (k < static_cast<int>(in.size())) ? std::conj(in[k]) : in[size - k];
+            }
+            full[0] = std::conj(complex_type(in[0].real(), 0));
+            if (size % 2 == 0) {
+                full[size / 2] = complex_type(in[size / 2].real(), 0);
+            }
+            plan.forward(full.data(), result.data());
+            const real_type scale = real_type(1) / size;
+            for (int k = 0; k < size; ++k) {
+                out[k] = result[k].real() * scale;
+            }
+        });
+    }
+
+    /**
+     * Count occurrences of each non-negative integer in a 1-D array.
+     *
+     * Every thread counts its chunk into a private histogram; the histograms are summed at the end.
+     */
+    static ndarray<int> bincount(const ndarray &x, int minlength = 0) {
+        auto counts = bincount_impl<int>(x, minlength, [] (int) -> int { return 1; });
+        int size = counts.size();
+        return ndarray<int>({size}, ndarray<int>::make_data(std::move(counts)));
+    }
+
+    static ndarray<double> bincount(const ndarray &x, const ndarray<double> &weights, int minlength = 0) {
+        if (weights.shape() != x.shape()) {
+            throw Error<ValueError>("The weights and list don't have the same length.");
+        }
+        auto w = weights.values();
+        auto sums = bincount_impl<double>(x, minlength, [&w] (int i) -> double { return w[i]; });
+        int size = sums.size();
+        return ndarray<double>({size}, ndarray<double>::make_data(std::move(sums)));
+    }
+
+    /**
+     * Counts of the flattened array in bins equal-width bins over range, and the bins + 1 edges.
+     *
+     * The range defaults to (min, max) of the non-NaN values; values outside it (and NaNs) are ignored
+     * and the last bin is closed.
+     */
+    static std::pair<ndarray<int>, ndarray<double>> histogram(const ndarray &a, int bins = 10) {
+        auto values = a.values();
+        auto end = std::remove_if(values.begin(), values.end(), [] (const T &x) -> bool { return x != x; });
+        std::pair<double, double> range(0, 1);
+        if (end != values.begin()) {
+            auto minmax = std::minmax_element(values.begin(), end);
+            range = std::make_pair(static_cast<double>(*minmax.first), static_cast<double>(*minmax.second));
+        }
+        return histogram(a, bins, range);
+    }
+
+    static std::pair<ndarray<int>, ndarray<double>> histogram(const ndarray &a, int bins, std::pair<double, double> range) {
+        if (bins < 1) {
+            throw Error<ValueError>("`bins` must be positive, when an integer");
+        }
+        if (!(range.first <= range.second)) {
+            throw Error<ValueError>("max must be larger than min in range parameter.");
+        }
+        if (range.first == range.second) {
+            range.first -= 0.5;
+            range.second += 0.5;
+        }
+
+        auto values = a.values();
+        const double lo = range.first, hi = range.second, scale = bins / (hi - lo);
+        int num_values = values.size();
+        int num_chunks = std::max(1, std::min(static_cast<int>(std::thread::hardware_concurrency()), num_values / (1 << 14)));
+        std::vector<std::vector<int>> partial(num_chunks, std::vector<int>(bins, 0));
+        parallel_for(num_chunks, 1, [&] (int begin, int end) {
+            for (int c = begin; c < end; ++c) {
+                auto &counts = partial[c];
+                int first = static_cast<long long>(num_values) * c / num_chunks;
+                int last = static_cast<long long>(num_values) * (c + 1) / num_chunks;
+                for (int i = first; i < last; ++i) {
+                    const double value = static_cast<double>(values[i]);
+                    if ((value >= lo) && (value <= hi)) {
+                        ++counts[std::min(bins - 1, static_cast<int>((value - lo) * scale))];
+                    }
+                }
+            }
+        });
+
+        std::vector<int> counts(bins, 0);
+        for (const auto &chunk : partial) {
+            std::transform(counts.begin(), counts.end(), chunk.begin(), counts.begin(), std::plus<int>());
+        }
+        std::vector<double> edges(bins + 1);
+        for (int i = 0; i <= bins; ++i) {
+            edges[i] = lo + (hi - lo) * i / bins;
+        }
+        return std::make_pair(
+                ndarray<int>({bins}, ndarray<int>::make_data(std::move(counts))),
+                ndarray<double>({bins + 1}, ndarray<double>::make_data(std::move(edges))));
+    }
+
+    /**
+     * Sorted unique values of the flattened array.
+     */
+    static ndarray unique(const ndarray &a) {
+        return unique_counts(a).first;
+    }
+
+    /**
+     * Sorted unique values of the flattened array and how many times each occurs.
+     *
+     * Integers go through an LSD radix sort and one run-length pass; floating point values are counted
+     * in an open-addressing hash table first, so only the distinct keys get sorted.
+     */
+    static std::pair<ndarray, ndarray<int>> unique_counts(const ndarray &a) {
+        auto values = a.values();
+        std::vector<T> keys;
+        std::vector<int> counts;
+        count_distinct(values, keys, counts, std::is_integral<T>());
+
+        int size = keys.size();
+        return std::make_pair(
+                ndarray({size}, make_data(std::move(keys))),
+                ndarray<int>({size}, ndarray<int>::make_data(std::move(counts))));
+    }
+
+    /**
+     * Sum of the rows of values (along axis 0) sharing a segment id, as (sorted distinct ids, sums).
+     *
+     * Non-decreasing ids are reduced in one streaming pass over runs; otherwise every thread folds its chunk
+     * into a private hash table of per-id accumulators and the tables are merged at the end.
+     */
+    static std::pair<ndarray<int>, ndarray> segment_sum(const ndarray &values, const ndarray<int> &segment_ids) {
+        return segment_reduce<T>(values, segment_ids, [] (T &acc, const T &value) { acc += value; });
+    }
+
+    static std::pair<ndarray<int>, ndarray> segment_min(const ndarray &values, const ndarray<int> &segment_ids) {
+        return segment_reduce<T>(values, segment_ids, [] (T &acc, const T &value) { acc = std::min(acc, value); });
+    }
+
+    static std::pair<ndarray<int>, ndarray> segment_max(const ndarray &values, const ndarray<int> &segment_ids) {
+        return segment_reduce<T>(values, segment_ids, [] (T &acc, const T &value) { acc = std::max(acc, value); });
+    }
+
+    static std::pair<ndarray<int>, ndarray<double>> segment_mean(const ndarray &values, const ndarray<int> &segment_ids) {
+        std::vector<int> counts;
+        auto sums = segment_reduce<double>(values, segment_ids, [] (double &acc, double value) { acc += value; }, &counts);
+        const int inner = counts.empty() ? 0 : sums.second.size() / static_cast<int>(counts.size());
+        std::vector<double> means = sums.second.values();
+        for (size_t i = 0; i < means.size(); ++i) {
+            means[i] /= counts[i / inner];
+        }
+        return std::make_pair(sums.first, ndarray<double>(sums.second.shape_, ndarray<double>::make_data(std::move(means))));
+    }
+
+    /**
+     * np.add.reduceat: the i-th slice along axis sums a[indices[i]:indices[i + 1]], or is a[indices[i]]
+     * when indices[i + 1] <= indices[i]; the last slice runs to the end.
+     */
+    static ndarray reduceat(const ndarray &a, const std::vector<int> &indices, int axis = 0) {
+        return reduceat_impl(a, indices, axis, nullptr);
+    }
+
+    static ndarray &reduceat(const ndarray &a, const std::vector<int> &indices, int axis, ndarray &out) {
+        reduceat_impl(a, indices, axis, &out);
+        return out;
+    }
+
+    /**
+     * Both reduceat overloads; given out, the sums go into it and an empty array is returned. The input
+     * is copied out first, so out may alias a.
+     */
+    static ndarray reduceat_impl(const ndarray &a, const std::vector<int> &indices, int axis, ndarray *out) {
+        axis = normalize_axis(axis, a.ndim());
+        const int n = a.shape_[axis], m = indices.size();
+        for (int index : indices) {
+            if ((index < 0) || (index >= n)) {
+                std::ostringstream oss;
+                oss << "index " << index << " out-of-bounds in add.reduceat [0, " << n << ")";
+                throw Error<IndexError>(oss.str());
+            }
+        }
+
+        const int inner = get_size(Shape(std::next(a.shape_.begin(), axis + 1), a.shape_.end()));
+        const int outer = get_size(Shape(a.shape_.begin(), std::next(a.shape_.begin(), axis)));
+        Shape shape = a.shape_;
+        shape[axis] = m;
+        T *dst = (out != nullptr) ? reduction_out(*out, shape) : nullptr;
+        auto values = a.values();
+        std::vector<T> result((dst != nullptr) ? 0 : get_size(shape));
+        const T *in = values.data();
+        T *sums = (dst != nullptr) ? dst : result.data();
+        const int *bounds = indices.data();
+        parallel_for(outer * m, std::max(1, (1 << 15) / std::max(1, inner * std::max(1, n / std::max(1, m)))), [=] (int begin, int end) {
+            for (int t = begin; t < end; ++t) {
+                const int o = t / m, i = t % m;
+                const int first = bounds[i], last = std::max(first + 1, (i + 1 < m) ? bounds[i + 1] : n);
+                const T *src = in + (static_cast<long long>(o) * n + first) * inner;
+                T *sum = sums + static_cast<long long>(t) * inner;
+                std::copy(src, src + inner, sum);
+                for (int r = first + 1; r < last; ++r) {
+                    src += inner;
+                    for (int j = 0; j < inner; ++j) {
+                        sum[j] += src[j];
+                    }
+                }
+            }
+        });
+        if (out == nullptr) {
+            return ndarray(std::move(shape), make_data(std::move(result)));
+        }
+        if (dst == nullptr) {
+            *out = ndarray(std::move(shape), make_data(std::move(result)));
+        }
+        return ndarray();
+    }
+
+    /**
+     * Write the array in the native chunked format, chunk_size elements per chunk.
+     *
+     * Layout (little-endian): "NDZ1", dtype kind and item size, ndim, shape, chunk size, chunk count,
+     * then one (offset, stored size, raw size, crc32 of raw bytes, flags) entry per chunk, then the chunks.
+     * Chunks are shuffled and compressed in parallel; a chunk that does not shrink is stored raw.
+     */
+    void save(std::ostream &os, int chunk_size = 1 << 16) const {
+        static_assert(std::is_trivially_copyable<T>::value, "save requires a trivially copyable dtype");
+        if (chunk_size < 1) {
+            throw Error<ValueError>("chunk_size must be positive");
+        }
+
+        auto values = this->values();
+        int num_chunks = (size() + chunk_size - 1) / chunk_size;
+        std::vector<std::vector<uint8_t>> chunks(num_chunks);
+        std::vector<NdzChunk> table(num_chunks);
+        parallel_for(num_chunks, 1, [&] (int begin, int end) {
+            for (int c = begin; c < end; ++c) {
+                int first = c * chunk_size, count = std::min(size(), first + chunk_size) - first;
+                auto raw = reinterpret_cast<const uint8_t *>(values.data() + first);
+                size_t raw_size = static_cast<size_t>(count) * sizeof(T);
+                auto compressed = ChunkCodec::compress(ChunkCodec::shuffle(raw, raw_size, sizeof(T)));
+                table[c].raw_size = raw_size;
+                table[c].crc = ChunkCodec::crc32(raw, raw_size);
+                if (compressed.size() < raw_size) {
+                    table[c].flags = 1;
+                    chunks[c] = std::move(compressed);
+                } else {
+                    chunks[c].assign(raw, raw + raw_size);
+                }
+                table[c].stored_size = chunks[c].size();
+            }
+        });
+
+        uint64_t offset = 4 + 2 + 4 + 4 * shape_.size() + 4 + 4 + NDZ_ENTRY_SIZE * num_chunks;
+        for (auto &entry : table) {
+            entry.offset = offset;
+            offset += entry.stored_size;
+        }
+
+        os.write("NDZ1", 4);
+        char dtype[2] = {ndz_kind(), static_cast<char>(sizeof(T))};
+        os.write(dtype, 2);
+        write_pod(os, static_cast<uint32_t>(ndim()));
+        for (int dim : shape_) {
+            write_pod(os, static_cast<uint32_t>(dim));
+        }
+        write_pod(os, static_cast<uint32_t>(chunk_size));
+        write_pod(os, static_cast<uint32_t>(num_chunks));
+        for (const auto &entry : table) {
+            write_pod(os, entry.offset);
+            write_pod(os, entry.stored_size);
+            write_pod(os, entry.raw_size);
+            write_pod(os, entry.crc);
+            write_pod(os, entry.flags);
+        }
+        for (const auto &chunk : chunks) {
+            os.write(reinterpret_cast<const char *>(chunk.data()), chunk.size());
+        }
+    }
+
+    /**
+     * Read an array written by save(), decoding and verifying chunks in parallel.
+     */
+    static ndarray load(std::istream &is) {
+        auto header = read_ndz_header(is);
+        int rows = header.shape.empty() ? 1 : header.shape.front();
+        return load_rows(is, header, 0, rows);
+    }
+
+    /**
+     * Read rows [begin, end) along the first axis, only decoding the chunks that cover them.
+     */
+    static ndarray load(std::istream &is, int begin, int end) {
+        auto header = read_ndz_header(is);
+        if (header.shape.empty()) {
+            throw Error<IndexError>("invalid index to scalar variable");
+        }
+        begin = std::max(0, std::min(begin, header.shape.front()));
+        end = std::max(begin, std::min(end, header.shape.front()));
+        return load_rows(is, header, begin, end);
+    }
+
+    /**
+     * Dense linear algebra on the last two axes, batched over the leading ones.
+     *
+     * Python notation "np.linalg.solve(a, b)" becomes "ndarray::linalg::solve(a, b)".
+     */
+    struct linalg;
+
+    /**
+     * BLAS level-1 and level-2 kernels on 1-D vectors and 2-D matrices.
+     *
+     * Python notation "scipy.linalg.blas.ddot(x, y)" becomes "ndarray<double>::blas::dot(x, y)".
+     */
+    struct blas;
+
+    /**
+     * Reproducible random arrays: a given seed and sequence of calls yields the same arrays on any number
+     * of threads.
+     *
+     * Python notation "np.random.default_rng(seed).normal(size=shape)" becomes "ndarray::random(seed).normal(shape)".
+     */
+    class random;
+
+    /**
+     * Deferred computation: arithmetic on lazy operands builds a graph that only runs on eval().
+     *
+     * Python notation "dask.array.from_array(a)" becomes "ndarray::lazy(a)"; operands are lazy arrays or
+     * scalars, wrap ndarrays in lazy explicitly.
+     */
+    class lazy;
+
+    ndarray() : shape_({0}) {
+    }
+
+    ndarray(std::initializer_list<ndarray> ary) {
+        auto shape = get_shape(ary);
+        if (shape.empty()) {
+            return;
+        }
+
+        auto data = flatten_data(ary);
+        if (data.empty()) {
+            return;
+        }
+
+        shape_ = std::move(shape);
+        data_ = std::move(data);
+    }
+
+    ndarray(std::initializer_list<T> ary) {
+        Shape shape = {static_cast<int>(ary.size())};
+
+        auto data = transform_data(ary);
+
+        shape_ = std::move(shape);
+        data_ = std::move(data);
+    }
+
+    ndarray(const ndarray &other) : shape_(other.shape_), data_(other.data_), flags_(other.flags_.load(std::memory_order_relaxed)) {
+    }
+
+    ndarray(ndarray &&other)
+            : shape_(std::move(other.shape_)), data_(std::move(other.data_)), flags_(other.flags_.load(std::memory_order_relaxed)) {
+    }
+
+    ~ndarray() = default;
+
+    /**
+     * Write rhs into the elements of this array (which may be a view), broadcasting rhs to our shape.
+     *
+     * rhs is read in place through broadcast strides; it is only buffered when it shares elements with us.
+     */
+    ndarray &operator=(const ndarray &rhs) {
+        Tracer::Span span("assign");
+        trace(span, {&rhs.shape_}, shape_, (static_cast<long long>(rhs.size()) + size()) * sizeof(T));
+        std::vector<int> strides;
+        if (!broadcast_strides(rhs.shape_, shape_, strides)) {
+            std::ostringstream oss;
+            oss << "could not broadcast input array from shape ";
+            dump_shape(oss, rhs.shape_);
+            oss << " into shape ";
+            dump_shape(oss, shape_);
+            throw Error<ValueError>(oss.str());
+        }
+
+        if (may_alias(rhs)) {
+            auto values = rhs.values();
+            assign_strided([&values] (int offset) -> const T & { return values[offset]; }, strides);
+        } else {
+            const Data &rdata = rhs.data_;
+            assign_strided([&rdata] (int offset) -> const T & { return *rdata[offset]; }, strides);
+        }
+
+        return *this;
+    }
+
+    ndarray &operator=(ndarray &&rhs) {
+        return (*this) = rhs;
+    }
+
+    template<class U>
+    ndarray &operator=(const U &rhs) {
+        Tracer::Span span("fill");
+        trace(span, {}, shape_, static_cast<long long>(size()) * sizeof(T));
+        const T value = static_cast<T>(rhs);
+        for (auto &element : data_) {
+            *element = value;
+        }
+        return *this;
+    }
+
+    const std::vector<int> &shape() const {
+        return shape_;
+    }
+
+    int ndim() const {
+        return shape_.size();
+    }
+
+    int size() const {
+        return data_.size();
+    }
+
+    int len() const {
+        if (ndim() == 0) {
+            throw Error<TypeError>("scalar type has no len()");
+        }
+
+        return shape_.front();
+    }
+
+    /**
+     * View with new_shape, reading and placing the elements in row-major (order 'C') or column-major
+     * (order 'F') index order; 'A' means F when this array is F- but not C-contiguous.
+     */
+    template<template<class, class...> class Container, class... Ts>
+    ndarray reshape(const Container<int, Ts...> &new_shape, char order = 'C') const {
+        // TODO negative value for unknown dimension.
+        Tracer::Span span("reshape");
+        if (order == 'K') {
+            throw Error<ValueError>("order 'K' is not permitted for reshaping");
+        }
+        order = resolve_order(order);
+        int size = get_size(shape_);
+        if (size != get_size(new_shape)) {
+            std::ostringstream oss;
+            oss << "cannot reshape array of size " << size << " into shape (";
+            std::copy(new_shape.begin(), new_shape.end(), std::ostream_iterator<int>(oss, ","));
+            oss << ")";
+            throw Error<ValueError>(oss.str());
+        }
+
+        Shape shape(new_shape.begin(), new_shape.end());
+        // Views touch no elements, only copy their handles.
+        trace(span, {&shape_}, shape, static_cast<long long>(size) * sizeof(Value));
+        if (order == 'C') {
+            return ndarray(std::move(shape), data_);
+        }
+
+        // The k-th element in column-major order stays the k-th.
+        std::vector<int> source(size);
+        fortran_offsets(shape_, [&source] (long long i, long long offset) {
+            source[offset] = i;
+        });
+        Data data(size);
+        fortran_offsets(shape, [this, &source, &data] (long long i, long long offset) {
+            data[i] = data_[source[offset]];
+        });
+        return ndarray(std::move(shape), std::move(data));
+    }
+
+    ndarray reshape(std::initializer_list<int> new_shape, char order = 'C') const {
+        ndarray (ndarray::*delegate)(const std::initializer_list<int> &, char) const = &ndarray::reshape;
+        return (this->*delegate)(new_shape, order);
+    }
+
+    /**
+     * Copy into a single allocation laid out in order: 'C', 'F', or 'A' and 'K' for F when this array is
+     * F- but not C-contiguous.
+     */
+    ndarray copy(char order = 'C') const {
+        order = resolve_order(order == 'K' ? 'A' : order);
+        Buffer values(size());
+        T *out = values.data();
+        if (order == 'F') {
+            fortran_offsets(shape_, [this, out] (long long i, long long offset) {
+                out[offset] = *data_[i];
+            });
+        } else {
+            const Value *in = data_.data();
+            parallel_for(size(), 1 << 15, [in, out] (int begin, int end) {
+                for (int i = begin; i < end; ++i) {
+                    out[i] = *in[i];
+                }
+            });
+        }
+        return ndarray(shape_, make_data(std::move(values), shape_, order));
+    }
+
+    /**
+     * Layout of the elements: whether they sit in a single block in row-major (C) or column-major (F) order.
+     * Both hold when at most one axis is longer than 1.
+     */
+    struct Flags {
+        bool c_contiguous;
+        bool f_contiguous;
+    };
+
+    Flags flags() const {
+        const int layout = this->layout();
+        return {(layout & C_CONTIGUOUS) != 0, (layout & F_CONTIGUOUS) != 0};
+    }
+
+    /**
+     * Copy converted to dtype U, into a single allocation; conversions between float and the 16-bit
+     * types run in bulk.
+     */
+    template<class U>
+    ndarray<U> astype() const {
+        Tracer::Span span("astype");
+        trace(span, {&shape_}, shape_, static_cast<long long>(size()) * (sizeof(T) + sizeof(U)));
+        return ndarray<U>(shape_, ndarray<U>::make_data(cast_values<U>(values())));
+    }
+
+    ndarray operator[](int index) const {
+        index = resolve_index(index, true);
+
+        Shape shape(std::next(shape_.begin()), shape_.end());
+        int size = get_size(shape);
+        index *= size;
+        return ndarray(std::move(shape), Data(
+                std::next(data_.begin(), index),
+                std::next(data_.begin(), index + size)));
+    }
+
+    /**
+     * Convert to scalar.
+     */
+    operator T() const {
+        if (size() != 1) {
+            throw Error<TypeError>("only size-1 arrays can be converted to scalars");
+        }
+
+        return *data_.front();
+    }
+
+    /**
+     * Perform Python array slicing.
+     *
+     * Python notation "a[1:2, 3, 4:5]" becomes "a.slice(std::make_pair(1, 2), 3, std::make_pair(4, 5))".
+     */
+    template<class... Args>
+    ndarray slice(Args... args) const {
+        if (sizeof...(args) > ndim()) {
+            throw Error<IndexError>("too many indices for array");
+        }
+
+        Tracer::Span span("slice");
+        ndarray result = slice_impl(std::move(args)...);
+        trace(span, {&shape_}, result.shape_, static_cast<long long>(result.size()) * sizeof(Value));
+        return result;
+    }
+
+    /**
+     * Split into sub-arrays that share elements with this array, cut before each of the given indices along axis.
+     */
+    std::vector<ndarray> split(const std::vector<int> &indices, int axis = 0) const {
+        axis = normalize_axis(axis, ndim());
+        std::vector<int> bounds = {0};
+        for (int index : indices) {
+            index = (index < 0) ? (index + shape_[axis]) : index;
+            bounds.push_back(std::min(std::max(index, bounds.back()), shape_[axis]));
+        }
+        bounds.push_back(shape_[axis]);
+
+        std::vector<ndarray> arrays;
+        for (size_t i = 0; i + 1 < bounds.size(); ++i) {
+            arrays.push_back(take_range(bounds[i], bounds[i + 1], axis));
+        }
+        return arrays;
+    }
+
+    /**
+     * Split into sections equal sub-arrays along axis.
+     */
+    std::vector<ndarray> split(int sections, int axis = 0) const {
+        if ((sections <= 0) || (shape_[normalize_axis(axis, ndim())] % sections != 0)) {
+            throw Error<ValueError>("array split does not result in an equal division");
+        }
+        return array_split(sections, axis);
+    }
+
+    /**
+     * Split into sections sub-arrays along axis, the first (len % sections) of them one longer.
+     */
+    std::vector<ndarray> array_split(int sections, int axis = 0) const {
+        if (sections <= 0) {
+            throw Error<ValueError>("number sections must be larger than 0.");
+        }
+
+        int dim = shape_[normalize_axis(axis, ndim())];
+        std::vector<int> indices;
+        for (int i = 1, index = 0; i < sections; ++i) {
+            index += dim / sections + ((i <= dim % sections) ? 1 : 0);
+            indices.push_back(index);
+        }
+        return split(indices, axis);
+    }
+
+    /**
+     * Every run of window consecutive elements along axis, as a view sharing elements with this array.
+     *
+     * Like np.lib.stride_tricks.sliding_window_view: axis shrinks to len - window + 1 and a new last axis
+     * of length window is appended.
+     */
+    ndarray sliding_window_view(int window, int axis = -1) const {
+        axis = normalize_axis(axis, ndim());
+        check_window(window, axis);
+
+        Shape shape = shape_;
+        shape[axis] = shape_[axis] - window + 1;
+        shape.push_back(window);
+        auto strides = get_strides(shape_);
+        strides.push_back(strides[axis]);
+
+        Data data(get_size(shape));
+        Value *dst = data.data();
+        const Value *src = data_.data();
+        NdIter(shape, {get_strides(shape), strides}).for_each([dst, src] (
+                const long long *offsets, const int *steps, int count) {
+            Value *d = dst + offsets[0];
+            const Value *s = src + offsets[1];
+            for (int i = 0; i < count; ++i, d += steps[0], s += steps[1]) {
+                *d = *s;
+            }
+        });
+        return ndarray(std::move(shape), std::move(data));
+    }
+
+    /**
+     * Sum of every window along axis, which shrinks to len - window + 1.
+     *
+     * The rolling aggregates make one pass along axis whatever the window: sums and moments are updated
+     * as elements enter and leave the window, minima and maxima come from a monotonic deque.
+     */
+    ndarray rolling_sum(int window, int axis = -1) const {
+        return rolling_impl<T>(window, axis, rolling_sum_kernel(window));
+    }
+
+    ndarray<double> rolling_mean(int window, int axis = -1) const {
+        return rolling_impl<double>(window, axis, rolling_mean_kernel(window));
+    }
+
+    /**
+     * The rolling aggregates with out=: out must have the windowed shape and is written in place.
+     */
+    ndarray &rolling_sum(int window, int axis, ndarray &out) const {
+        rolling_impl<T>(window, axis, rolling_sum_kernel(window), &out);
+        return out;
+    }
+
+    ndarray<double> &rolling_mean(int window, int axis, ndarray<double> &out) const {
+        rolling_impl<double>(window, axis, rolling_mean_kernel(window), &out);
+        return out;
+    }
+
+    ndarray &rolling_min(int window, int axis, ndarray &out) const {
+        rolling_impl<T>(window, axis, rolling_extreme_kernel(window, std::less<T>()), &out);
+        return out;
+    }
+
+    ndarray &rolling_max(int window, int axis, ndarray &out) const {
+        rolling_impl<T>(window, axis, rolling_extreme_kernel(window, std::greater<T>()), &out);
+        return out;
+    }
+
+    /**
+     * Population (ddof=0) standard deviation of every window along axis.
+     */
+    ndarray<double> rolling_std(int window, int axis = -1) const {
+        return rolling_impl<double>(window, axis, [window] (const T *in, double *out, int n, int stride, int lanes) {
+            // Welford's update, extended to drop the element leaving the window.
+            std::vector<double> mean(lanes, 0.), m2(lanes, 0.);
+            for (int k = 0; k < n; ++k) {
+                const T *add = in + static_cast<long long>(k) * stride;
+                if (k < window) {
+                    for (int j = 0; j < lanes; ++j) {
+                        const double x = static_cast<double>(add[j]), delta = x - mean[j];
+                        mean[j] += delta / (k + 1);
+                        m2[j] += delta * (x - mean[j]);
+                    }
+                } else {
+                    const T *drop = add - static_cast<long long>(window) * stride;
+                    for (int j = 0; j < lanes; ++j) {
+                        const double x = static_cast<double>(add[j]), y = static_cast<double>(drop[j]), old = mean[j];
+                        mean[j] += (x - y) / window;
+                        m2[j] += (x - y) * (x - mean[j] + y - old);
+                    }
+                }
+                if (k >= window - 1) {
+                    double *o = out + static_cast<long long>(k - window + 1) * stride;
+                    for (int j = 0; j < lanes; ++j) {
+                        o[j] = std::sqrt(std::max(0., m2[j]) / window);
+                    }
+                }
+            }
+        });
+    }
+
+    ndarray rolling_min(int window, int axis = -1) const {
+        return rolling_impl<T>(window, axis, rolling_extreme_kernel(window, std::less<T>()));
+    }
+
+    ndarray rolling_max(int window, int axis = -1) const {
+        return rolling_impl<T>(window, axis, rolling_extreme_kernel(window, std::greater<T>()));
+    }
+
+    /**
+     * Sum along axis treating NaNs as zero; without an axis, the sum of every element as a 0-d array.
+     *
+     * The nan reductions blend NaNs out by substituting the reduction's identity instead of branching, so
+     * their lane loops vectorize. An all-NaN line sums to 0, while its mean, min and max are NaN.
+     */
+    ndarray nansum() const {
+        return nan_reduce<SumReducer>(ALL_AXES);
+    }
+
+    ndarray nansum(int axis) const {
+        return nan_reduce<SumReducer>(axis);
+    }
+
+    ndarray<double> nanmean() const {
+        return nan_reduce<MeanReducer>(ALL_AXES);
+    }
+
+    ndarray<double> nanmean(int axis) const {
+        return nan_reduce<MeanReducer>(axis);
+    }
+
+    ndarray nanmin() const {
+        check_identity(ALL_AXES, "fmin");
+        return nan_reduce<ExtremeReducer<std::less<Accumulator>>>(ALL_AXES);
+    }
+
+    ndarray nanmin(int axis) const {
+        check_identity(axis, "fmin");
+        return nan_reduce<ExtremeReducer<std::less<Accumulator>>>(axis);
+    }
+
+    ndarray nanmax() const {
+        check_identity(ALL_AXES, "fmax");
+        return nan_reduce<ExtremeReducer<std::greater<Accumulator>>>(ALL_AXES);
+    }
+
+    ndarray nanmax(int axis) const {
+        check_identity(axis, "fmax");
+        return nan_reduce<ExtremeReducer<std::greater<Accumulator>>>(axis);
+    }
+
+    /**
+     * The nan reductions with out=: out must have the reduced shape and is written in place; it may be a
+     * view of this array.
+     */
+    ndarray &nansum(int axis, ndarray &out) const {
+        nan_reduce<SumReducer>(axis, &out);
+        return out;
+    }
+
+    ndarray<double> &nanmean(int axis, ndarray<double> &out) const {
+        nan_reduce<MeanReducer>(axis, &out);
+        return out;
+    }
+
+    ndarray &nanmin(int axis, ndarray &out) const {
+        check_identity(axis, "fmin");
+        nan_reduce<ExtremeReducer<std::less<Accumulator>>>(axis, &out);
+        return out;
+    }
+
+    ndarray &nanmax(int axis, ndarray &out) const {
+        check_identity(axis, "fmax");
+        nan_reduce<ExtremeReducer<std::greater<Accumulator>>>(axis, &out);
+        return out;
+    }
+
+    ndarray operator-() const {
+        return operator_impl(ndarray::scalar(-1), OP_MUL);
+    }
+
+private:
+    typedef std::vector<int> Shape;
+    typedef std::shared_ptr<dtype> Value;
+    typedef std::vector<Value, HandleAllocator<Value, T>> Data;
+    // Element values whose pages are left for the kernel filling them to touch first.
+    typedef std::vector<T, PageAllocator<T>> Buffer;
+
+    enum Operator {
+        OP_ADD, OP_SUB, OP_MUL, OP_DIV
+    };
+
+    template<class U>
+    friend class ndarray;
+
+    template<class U>
+    friend class coo_matrix;
+
+    template<class U, bool ByRow>
+    friend class compressed_matrix;
+
+    template<class... Us>
+    friend class record_array;
+
+    template<class U>
+    friend class masked_array;
+
+    friend std::ostream &operator<<(std::ostream &os, const ndarray &ary) {
+        if (ary.ndim() == 0) { // scalar, not array
+            if (ary.size() == 1) {
+                os << static_cast<T>(ary);
+            } else {
+                std::cerr << "ndarray: scalar, data size should be 1 but get " << ary.size() << std::endl;
+            }
+            return os;
+        }
+
+        os << "array(";
+
+        std::vector<int> s;
+        size_t i = 0;
+        do {
+            for (; s.size() < ary.ndim(); s.push_back(ary.shape_[s.size()])) {
+                os << "[";
+            }
+            for (; s.back() > 0; --s.back()) {
+                os << *(ary.data_[i]) << ',';
+                ++i;
+            }
+            for (; s.back() == 0; --s.back()) {
+                os << "],";
+                s.pop_back();
+                if (s.empty()) {
+                    // assert(i == ary.data_.size());
+                    break;
+                }
+            }
+        } while (!s.empty());
+
+        os << ")";
+        return os;
+    }
+
+    template<class U>
+    friend ndarray operator+(const U &lhs, const ndarray &rhs) {
+        return ndarray::scalar(static_cast<T>(lhs)).operator_impl(rhs, ndarray::OP_ADD);
+    }
+
+    template<class U>
+    friend ndarray operator+(const ndarray &lhs, const U &rhs) {
+        return lhs.operator_impl(ndarray::scalar(static_cast<T>(rhs)), ndarray::OP_ADD);
+    }
+
+    friend ndarray operator+(const ndarray &lhs, const ndarray &rhs) {
+        return lhs.operator_impl(rhs, ndarray::OP_ADD);
+    }
+
+    template<class U>
+    friend ndarray operator-(const U &lhs, const ndarray &rhs) {
+        return ndarray::scalar(static_cast<T>(lhs)).operator_impl(rhs, ndarray::OP_SUB);
+    }
+
+    template<class U>
+    friend ndarray operator-(const ndarray &lhs, const U &rhs) {
+        return lhs.operator_impl(ndarray::scalar(static_cast<T>(rhs)), ndarray::OP_SUB);
+    }
+
+    friend ndarray operator-(const ndarray &lhs, const ndarray &rhs) {
+        return lhs.operator_impl(rhs, ndarray::OP_SUB);
+    }
+
+    template<class U>
+    friend ndarray operator*(const U &lhs, const ndarray &rhs) {
+        return ndarray::scalar(static_cast<T>(lhs)).operator_impl(rhs, ndarray::OP_MUL);
+    }
+
+    template<class U>
+    friend ndarray operator*(const ndarray &lhs, const U &rhs) {
+        return lhs.operator_impl(ndarray::scalar(static_cast<T>(rhs)), ndarray::OP_MUL);
+    }
+
+    friend ndarray operator*(const ndarray &lhs, const ndarray &rhs) {
+        return lhs.operator_impl(rhs, ndarray::OP_MUL);
+    }
+
+    template<class U>
+    friend ndarray operator/(const U &lhs, const ndarray &rhs) {
+        return ndarray::scalar(static_cast<T>(lhs)).operator_impl(rhs, ndarray::OP_DIV);
+    }
+
+    template<class U>
+    friend ndarray operator/(const ndarray &lhs, const U &rhs) {
+        return lhs.divide_scalar(static_cast<T>(rhs), std::is_integral<T>());
+    }
+
+    friend ndarray operator/(const ndarray &lhs, const ndarray &rhs) {
+        return lhs.operator_impl(rhs, ndarray::OP_DIV);
+    }
+
+    template<template<class, class...> class Container, class... Ts>
+    static Shape get_shape(const Container<ndarray, Ts...> &ary) {
+        if (ary.size() == 0) {
+            return {};
+        }
+
+        auto shape = ary.begin()->shape();
+
+        auto not_same_shape = [&shape] (const ndarray &subary) -> bool {
+            return subary.shape() != shape;
+        };
+
+        if (std::any_of(ary.begin(), ary.end(), not_same_shape)) {
+            // TODO dtype=object
+            std::cerr << "ndarray::get_shape: shape not match" << std::endl;
+            return {};
+        }
+
+        shape.insert(shape.begin(), ary.size());
+        return shape;
+    }
+
+    template<template<class, class...> class Container, class... Ts>
+    static int get_size(const Container<int, Ts...> &shape) {
+        return std::accumulate(shape.begin(), shape.end(), 1, std::multiplies<int>());
+    }
+
+    template<template<class, class...> class Container, class... Ts>
+    static Data flatten_data(const Container<ndarray, Ts...> &ary) {
+        return join_data<Data>(ary, 0, [] (const Value &arg) -> const Value & { return arg; });
+    }
+
+    /**
+     * Interleave the data of arrays that agree on shape[:axis], one chunk of shape[axis:] per array
+     * and outer index, into a single preallocated buffer filled in parallel.
+     */
+    template<class Values, template<class, class...> class Container, class... Ts, class Convert>
+    static Values join_data(const Container<ndarray, Ts...> &arrays, int axis, Convert convert) {
+        std::vector<const ndarray *> parts;
+        std::vector<int> chunks, offsets;
+        int total = 0;
+        for (const auto &ary : arrays) {
+            parts.push_back(&ary);
+            chunks.push_back(get_size(Shape(std::next(ary.shape_.begin(), axis), ary.shape_.end())));
+            offsets.push_back(total);
+            total += chunks.back();
+        }
+        if (parts.empty()) {
+            return {};
+        }
+
+        int outer = get_size(Shape(parts.front()->shape_.begin(), std::next(parts.front()->shape_.begin(), axis)));
+        int num_parts = parts.size();
+        Values out(static_cast<size_t>(outer) * total);
+        int grain = std::max(1, (1 << 14) / std::max(1, total / num_parts));
+        parallel_for(outer * num_parts, grain, [&] (int begin, int end) {
+            for (int t = begin; t < end; ++t) {
+                int o = t / num_parts, k = t % num_parts;
+                auto first = std::next(parts[k]->data_.begin(), static_cast<size_t>(o) * chunks[k]);
+                std::transform(first, std::next(first, chunks[k]),
+                        std::next(out.begin(), static_cast<size_t>(o) * total + offsets[k]), convert);
+            }
+        });
+        return out;
+    }
+
+    /**
+     * Both matmul overloads: returns the product, or writes it into out when given.
+     */
+    static ndarray matmul_impl(const ndarray &a, const ndarray &b, ndarray *out) {
+        Tracer::Span span("matmul");
+        for (int i = 0; i < 2; ++i) {
+            if ((i == 0 ? a : b).ndim() == 0) {
+                std::ostringstream oss;
+                oss << "matmul: Input operand " << i << " does not have enough dimensions";
+                throw Error<ValueError>(oss.str());
+            }
+        }
+
+        Shape lshape = a.shape_, rshape = b.shape_;
+        if (a.ndim() == 1) {
+            lshape.insert(lshape.begin(), 1);
+        }
+        if (b.ndim() == 1) {
+            rshape.push_back(1);
+        }
+        int m = lshape[lshape.size() - 2], k = lshape.back(), n = rshape.back();
+        if (rshape[rshape.size() - 2] != k) {
+            std::ostringstream oss;
+            oss << "matmul: Input operand 1 has a mismatch in its core dimension 0, with gufunc signature "
+                << "(n?,k),(k,m?)->(n?,m?) (size " << rshape[rshape.size() - 2] << " is different from " << k << ")";
+            throw Error<ValueError>(oss.str());
+        }
+
+        Shape lbatch(lshape.begin(), std::prev(lshape.end(), 2)), rbatch(rshape.begin(), std::prev(rshape.end(), 2));
+        Shape batch(std::max(lbatch.size(), rbatch.size()));
+        for (int i = static_cast<int>(batch.size()) - 1, j = lbatch.size() - 1, l = rbatch.size() - 1; i >= 0; --i, --j, --l) {
+            int ldim = (j >= 0) ? lbatch[j] : 1, rdim = (l >= 0) ? rbatch[l] : 1;
+            if ((ldim != rdim) && (ldim != 1) && (rdim != 1)) {
+                std::ostringstream oss;
+                oss << "operands could not be broadcast together with shapes ";
+                dump_shape(oss, a.shape_);
+                oss << " ";
+                dump_shape(oss, b.shape_);
+                throw Error<ValueError>(oss.str());
+            }
+            batch[i] = std::max(ldim, rdim);
+        }
+
+        // Offsets, in matrices, of the operands of every output batch.
+        std::vector<int> lstrides, rstrides;
+        broadcast_strides(lbatch, batch, lstrides);
+        broadcast_strides(rbatch, batch, rstrides);
+        int num_batches = get_size(batch);
+        std::vector<int> loffsets(num_batches), roffsets(num_batches);
+        std::vector<int> index(batch.size(), 0);
+        for (int t = 0, loffset = 0, roffset = 0; t < num_batches; ++t) {
+            loffsets[t] = loffset;
+            roffsets[t] = roffset;
+            for (int axis = static_cast<int>(batch.size()) - 1; axis >= 0; --axis) {
+                loffset += lstrides[axis];
+                roffset += rstrides[axis];
+                if (++index[axis] < batch[axis]) {
+                    break;
+                }
+                loffset -= lstrides[axis] * batch[axis];
+                roffset -= rstrides[axis] * batch[axis];
+                index[axis] = 0;
+            }
+        }
+
+        Shape shape = batch;
+        if (a.ndim() > 1) {
+            shape.push_back(m);
+        }
+        if (b.ndim() > 1) {
+            shape.push_back(n);
+        }
+        // Unlike elementwise ufuncs, a gufunc's loop dimensions must match out exactly: no broadcasting into out.
+        if (out != nullptr) {
+            check_exact_out(out->shape_, shape);
+        }
+        trace(span, {&a.shape_, &b.shape_}, shape, (static_cast<long long>(a.size()) + b.size() + get_size(shape)) * sizeof(T));
+
+        // 16-bit types are multiplied and accumulated in float; out's storage is only written directly without such a widening.
+        typedef typename accumulator_traits<T>::type Acc;
+        auto lvalues = cast_values<Acc>(a.values()), rvalues = cast_values<Acc>(b.values());
+        std::vector<Acc> values;
+        Acc *pc = (std::is_same<Acc, T>::value && (out != nullptr) && !out->may_alias(a) && !out->may_alias(b))
+                ? reinterpret_cast<Acc *>(out->contiguous_data()) : nullptr;
+        if (pc != nullptr) {
+            std::fill(pc, pc + out->size(), Acc());
+        } else {
+            values.assign(static_cast<size_t>(num_batches) * m * n, Acc());
+            pc = values.data();
+        }
+        const Acc *pa = lvalues.data(), *pb = rvalues.data();
+        long long flops = static_cast<long long>(m) * n * k;
+        int num_threads = std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+        if ((num_batches >= num_threads) || (flops < (1LL << 18))) {
+            int grain = static_cast<int>(std::max(1LL, (1LL << 18) / std::max(1LL, flops)));
+            parallel_for(num_batches, grain, [=, &loffsets, &roffsets] (int begin, int end) {
+                for (int t = begin; t < end; ++t) {
+                    ndarray<Acc>::gemm_rows(0, m, n, k,
+                            pa + static_cast<long long>(loffsets[t]) * m * k, k,
+                            pb + static_cast<long long>(roffsets[t]) * k * n, n,
+                            pc + static_cast<long long>(t) * m * n, n);
+                }
+            });
+        } else {
+            for (int t = 0; t < num_batches; ++t) {
+                ndarray<Acc>::gemm(m, n, k,
+                        pa + static_cast<long long>(loffsets[t]) * m * k, k,
+                        pb + static_cast<long long>(roffsets[t]) * k * n, n,
+                        pc + static_cast<long long>(t) * m * n, n);
+            }
+        }
+
+        if (out == nullptr) {
+            return ndarray(std::move(shape), make_data(ndarray<Acc>::template cast_values<T>(std::move(values))));
+        }
+        if (!values.empty()) {
+            *out = ndarray(std::move(shape), make_data(ndarray<Acc>::template cast_values<T>(std::move(values))));
+        }
+        return {};
+    }
+
+    /**
+     * Run kernel(plan, line, out) on every line along axis; lines hold in_len values of In (zero-padded
+     * or cropped) and the output has out_len values of Out along axis. The plan is for plan_len points,
+     * halved for rfft's even-length packing.
+     */
+    template<class In, class Out, class Kernel>
+    static ndarray<Out> fft_impl(const ndarray &a, int in_len, int axis, int plan_len, bool is_rfft, Kernel kernel) {
+        if (a.ndim() == 0) {
+            throw Error<IndexError>("tuple index out of range");
+        }
+        axis = normalize_axis(axis, a.ndim());
+        int len = a.shape_[axis];
+        if (in_len == -1) {
+            in_len = len;
+        }
+        if (plan_len == -1) {
+            plan_len = len;
+        }
+        if ((in_len < 1) || (plan_len < 1)) {
+            std::ostringstream oss;
+            oss << "Invalid number of FFT data points (" << plan_len << ") specified.";
+            throw Error<ValueError>(oss.str());
+        }
+
+        int out_len = is_rfft ? (plan_len / 2 + 1) : plan_len;
+        auto plan = FftPlan<real_type>::get((is_rfft && (plan_len % 2 == 0)) ? plan_len / 2 : plan_len);
+        int inner = get_size(Shape(std::next(a.shape_.begin(), axis + 1), a.shape_.end()));
+        int outer = get_size(Shape(a.shape_.begin(), std::next(a.shape_.begin(), axis)));
+
+        auto values = a.values();
+        std::vector<Out> result(static_cast<size_t>(outer) * out_len * inner);
+        parallel_for(outer * inner, std::max(1, (1 << 14) / plan_len), [&] (int begin, int end) {
+            std::vector<In> line(in_len);
+            std::vector<Out> out(out_len);
+            for (int t = begin; t < end; ++t) {
+                int o = t / inner, i = t % inner;
+                for (int k = 0; k < in_len; ++k) {
+                    line[k] = (k < len) ? In(values[(static_cast<size_t>(o) * len + k) * inner + i]) : In();
+                }
+                kernel(*plan, line, out.data());
+                for (int k = 0; k < out_len; ++k) {
+                    result[(static_cast<size_t>(o) * out_len + k) * inner + i] = out[k];
+                }
+            }
+        });
+
+        Shape shape = a.shape_;
+        shape[axis] = out_len;
+        return ndarray<Out>(std::move(shape), ndarray<Out>::make_data(std::move(result)));
+    }
+
+    template<class Count, class Weight>
+    static std::vector<Count> bincount_impl(const ndarray &x, int minlength, Weight weight) {
+        static_assert(std::is_integral<T>::value, "Cannot cast array data according to the rule 'safe'");
+        if (x.ndim() != 1) {
+            throw Error<ValueError>("object too deep for desired array");
+        }
+        if (minlength < 0) {
+            throw Error<ValueError>("'minlength' must not be negative");
+        }
+
+        auto values = x.values();
+        int length = minlength;
+        for (const auto &value : values) {
+            if (value < 0) {
+                throw Error<ValueError>("'list' argument must have no negative elements");
+            }
+            length = std::max(length, static_cast<int>(value) + 1);
+        }
+
+        int num_values = values.size();
+        int num_chunks = std::max(1, std::min(static_cast<int>(std::thread::hardware_concurrency()), num_values / (1 << 14)));
+        std::vector<std::vector<Count>> partial(num_chunks, std::vector<Count>(length, Count()));
+        parallel_for(num_chunks, 1, [&] (int begin, int end) {
+            for (int c = begin; c < end; ++c) {
+                auto &counts = partial[c];
+                int first = static_cast<long long>(num_values) * c / num_chunks;
+                int last = static_cast<long long>(num_values) * (c + 1) / num_chunks;
+                for (int i = first; i < last; ++i) {
+                    counts[values[i]] += weight(i);
+                }
+            }
+        });
+
+        for (int c = 1; c < num_chunks; ++c) {
+            std::transform(partial[0].begin(), partial[0].end(), partial[c].begin(), partial[0].begin(), std::plus<Count>());
+        }
+        return std::move(partial[0]);
+    }
+
+    /**
+     * LSD radix sort one byte per pass, skipping passes where every key has the same byte.
+     */
+    static void radix_sort(std::vector<T> &values) {
+        typedef typename std::make_unsigned<T>::type Key;
+        const Key sign = std::is_signed<T>::value ? (Key(1) << (sizeof(Key) * 8 - 1)) : Key(0);
+
+        std::vector<T> buffer(values.size());
+        for (size_t shift = 0; shift < sizeof(Key) * 8; shift += 8) {
+            size_t counts[257] = {0};
+            for (const auto &value : values) {
+                ++counts[((static_cast<Key>(value) ^ sign) >> shift & 0xff) + 1];
+            }
+            if (std::any_of(std::begin(counts), std::end(counts), [&values] (size_t count) -> bool {
+                    return count == values.size();
+                })) {
+                continue;
+            }
+            std::partial_sum(std::begin(counts), std::end(counts), std::begin(counts));
+            for (const auto &value : values) {
+                buffer[counts[(static_cast<Key>(value) ^ sign) >> shift & 0xff]++] = value;
+            }
+            values.swap(buffer);
+        }
+    }
+
+    static void count_distinct(std::vector<T> &values, std::vector<T> &keys, std::vector<int> &counts, std::true_type) {
+        radix_sort(values);
+        for (const auto &value : values) {
+            if (keys.empty() || (keys.back() != value)) {
+                keys.push_back(value);
+                counts.push_back(0);
+            }
+            ++counts.back();
+        }
+    }
+
+    static void count_distinct(std::vector<T> &values, std::vector<T> &keys, std::vector<int> &counts, std::false_type) {
+        hash_count(values, keys, counts);
+    }
+
+    /**
+     * Count distinct values with linear probing, then sort the distinct keys. -0.0 counts as 0.0
+     * and all NaNs are merged into one trailing entry.
+     *
+     * Slots are picked from the value's bits rather than std::hash, which float16 and bfloat16 lack; once
+     * -0.0 and NaNs are out of the way, equal values have equal bits.
+     */
+    static void hash_count(const std::vector<T> &values, std::vector<T> &keys, std::vector<int> &counts) {
+        size_t capacity = 16;
+        while (capacity < 2 * values.size()) {
+            capacity *= 2;
+        }
+        std::vector<T> table(capacity);
+        std::vector<int> table_counts(capacity, 0);
+        int nans = 0;
+        T nan = T();
+        for (T value : values) {
+            if (value != value) {
+                nan = value;
+                ++nans;
+                continue;
+            }
+            if (value == T()) {
+                value = T();
+            }
+            uint64_t bits = 0;
+            std::memcpy(&bits, &value, std::min(sizeof(T), sizeof(bits)));
+            size_t slot = (bits ^ (bits >> 29)) * 0x9e3779b97f4a7c15ULL >> 7 & (capacity - 1);
+            while ((table_counts[slot] != 0) && (table[slot] != value)) {
+                slot = (slot + 1) & (capacity - 1);
+            }
+            table[slot] = value;
+            ++table_counts[slot];
+        }
+
+        std::vector<std::pair<T, int>> entries;
+        for (size_t slot = 0; slot < capacity; ++slot) {
+            if (table_counts[slot] != 0) {
+                entries.emplace_back(table[slot], table_counts[slot]);
+            }
+        }
+        std::sort(entries.begin(), entries.end());
+        for (const auto &entry : entries) {
+            keys.push_back(entry.first);
+            counts.push_back(entry.second);
+        }
+        if (nans > 0) {
+            keys.push_back(nan);
+            counts.push_back(nans);
+        }
+    }
+
+    /**
+     * Fold the rows of values into one Acc row per distinct segment id with combine(acc, value), the first
+     * row of a segment initializing its accumulator. Row counts per segment go to counts when given.
+     */
+    template<class Acc, class Combine>
+    static std::pair<ndarray<int>, ndarray<Acc>> segment_reduce(const ndarray &values, const ndarray<int> &segment_ids,
+            Combine combine, std::vector<int> *counts = nullptr) {
+        if ((values.ndim() == 0) || (segment_ids.ndim() != 1) || (segment_ids.len() != values.len())) {
+            throw Error<ValueError>("segment_ids should be the same size as dimension 0 of input.");
+        }
+
+        auto v = values.values();
+        auto ids = segment_ids.values();
+        const int n = ids.size();
+        const int inner = get_size(Shape(std::next(values.shape_.begin()), values.shape_.end()));
+        auto fold = [&combine, inner] (Acc *acc, const T *row, bool first) {
+            for (int j = 0; j < inner; ++j) {
+                if (first) {
+                    acc[j] = static_cast<Acc>(row[j]);
+                } else {
+                    combine(acc[j], static_cast<Acc>(row[j]));
+                }
+            }
+        };
+
+        std::vector<int> keys, sizes;
+        std::vector<Acc> acc;
+        if (std::is_sorted(ids.begin(), ids.end())) {
+            std::vector<int> starts;
+            for (int i = 0; i < n; ++i) {
+                if ((i == 0) || (ids[i] != ids[i - 1])) {
+                    starts.push_back(i);
+                    keys.push_back(ids[i]);
+                }
+            }
+            starts.push_back(n);
+            const int k = keys.size();
+            acc.resize(static_cast<size_t>(k) * inner);
+            sizes.resize(k);
+            parallel_for(k, std::max(1, (1 << 15) / std::max(1, inner * std::max(1, n / std::max(1, k)))), [&] (int begin, int end) {
+                for (int s = begin; s < end; ++s) {
+                    sizes[s] = starts[s + 1] - starts[s];
+                    for (int i = starts[s]; i < starts[s + 1]; ++i) {
+                        fold(&acc[static_cast<size_t>(s) * inner], &v[static_cast<size_t>(i) * inner], i == starts[s]);
+                    }
+                }
+            });
+        } else {
+            struct Partial {
+                std::vector<int> keys, sizes;
+                std::vector<Acc> acc;
+            };
+            int num_chunks = std::max(1, std::min(static_cast<int>(std::thread::hardware_concurrency()), n * inner / (1 << 14)));
+            std::vector<Partial> partial(num_chunks);
+            parallel_for(num_chunks, 1, [&] (int begin, int end) {
+                for (int c = begin; c < end; ++c) {
+                    auto &part = partial[c];
+                    int first = static_cast<long long>(n) * c / num_chunks;
+                    int last = static_cast<long long>(n) * (c + 1) / num_chunks;
+                    size_t capacity = 16;
+                    while (capacity < 2 * static_cast<size_t>(last - first)) {
+                        capacity *= 2;
+                    }
+                    std::vector<int> table(capacity, -1);
+                    for (int i = first; i < last; ++i) {
+                        size_t slot = std::hash<int>()(ids[i]) * 0x9e3779b97f4a7c15ULL >> 7 & (capacity - 1);
+                        while ((table[slot] != -1) && (part.keys[table[slot]] != ids[i])) {
+                            slot = (slot + 1) & (capacity - 1);
+                        }
+                        bool is_new = (table[slot] == -1);
+                        if (is_new) {
+                            table[slot] = part.keys.size();
+                            part.keys.push_back(ids[i]);
+                            part.sizes.push_back(0);
+                            part.acc.resize(part.acc.size() + inner);
+                        }
+                        ++part.sizes[table[slot]];
+                        fold(&part.acc[static_cast<size_t>(table[slot]) * inner], &v[static_cast<size_t>(i) * inner], is_new);
+                    }
+                }
+            });
+
+            for (const auto &part : partial) {
+                keys.insert(keys.end(), part.keys.begin(), part.keys.end());
+            }
+            std::sort(keys.begin(), keys.end());
+            keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+            acc.resize(keys.size() * inner);
+            sizes.assign(keys.size(), 0);
+            for (const auto &part : partial) {
+                for (size_t p = 0; p < part.keys.size(); ++p) {
+                    size_t s = std::lower_bound(keys.begin(), keys.end(), part.keys[p]) - keys.begin();
+                    Acc *dst = &acc[s * inner];
+                    const Acc *src = &part.acc[p * inner];
+                    for (int j = 0; j < inner; ++j) {
+                        if (sizes[s] == 0) {
+                            dst[j] = src[j];
+                        } else {
+                            combine(dst[j], src[j]);
+                        }
+                    }
+                    sizes[s] += part.sizes[p];
+                }
+            }
+        }
+
+        Shape shape = values.shape_;
+        shape[0] = keys.size();
+        if (counts != nullptr) {
+            *counts = sizes;
+        }
+        const int k = keys.size();
+        return std::make_pair(
+                ndarray<int>({k}, ndarray<int>::make_data(std::move(keys))),
+                ndarray<Acc>(std::move(shape), ndarray<Acc>::make_data(std::move(acc))));
+    }
+
+    struct NdzChunk {
+        uint64_t offset;
+        uint32_t stored_size;
+        uint32_t raw_size;
+        uint32_t crc;
+        uint32_t flags;
+    };
+
+    static constexpr int NDZ_ENTRY_SIZE = 8 + 4 + 4 + 4 + 4;
+
+    struct NdzHeader {
+        Shape shape;
+        int chunk_size;
+        std::vector<NdzChunk> table;
+        std::streampos start;
+    };
+
+    /**
+     * numpy's kind letter, with 'e' for float16 (numpy's type code) and 'E' for bfloat16 so the two 2-byte
+     * floats are told apart; 'V' covers any other dtype.
+     */
+    static char ndz_kind() {
+        if (std::is_same<T, float16>::value) {
+            return 'e';
+        }
+        if (std::is_same<T, bfloat16>::value) {
+            return 'E';
+        }
+        if (std::is_same<T, typename complex_traits<T>::complex_type>::value) {
+            return 'c';
+        }
+        return std::is_floating_point<T>::value ? 'f' : (std::is_signed<T>::value ? 'i' : (std::is_integral<T>::value ? 'u' : 'V'));
+    }
+
+    template<class U>
+    static void write_pod(std::ostream &os, U value) {
+        static_assert(std::is_unsigned<U>::value, "NDZ fields are unsigned integers");
+        char bytes[sizeof(U)];
+        for (size_t i = 0; i < sizeof(U); ++i) {
+            bytes[i] = static_cast<char>((value >> (8 * i)) & 0xff);
+        }
+        os.write(bytes, sizeof(U));
+    }
+
+    template<class U>
+    static U read_pod(std::istream &is) {
+        static_assert(std::is_unsigned<U>::value, "NDZ fields are unsigned integers");
+        unsigned char bytes[sizeof(U)];
+        if (!is.read(reinterpret_cast<char *>(bytes), sizeof(U))) {
+            throw Error<ValueError>("unexpected end of file");
+        }
+        U value = 0;
+        for (size_t i = 0; i < sizeof(U); ++i) {
+            value |= static_cast<U>(bytes[i]) << (8 * i);
+        }
+        return value;
+    }
+
+    /**
+     * Read and validate the header and chunk table, so that load_rows can trust every index and size in it.
+     */
+    static NdzHeader read_ndz_header(std::istream &is) {
+        NdzHeader header;
+        header.start = is.tellg();
+        char magic[6];
+        if (!is.read(magic, 6) || (std::string(magic, 4) != "NDZ1")) {
+            throw Error<ValueError>("not an NDZ1 file");
+        }
+        if ((magic[4] != ndz_kind()) || (magic[5] != static_cast<char>(sizeof(T)))) {
+            std::ostringstream oss;
+            oss << "file holds dtype '" << magic[4] << static_cast<int>(magic[5]) << "', expected '"
+                << ndz_kind() << sizeof(T) << "'";
+            throw Error<ValueError>(oss.str());
+        }
+
+        const uint32_t ndim = read_pod<uint32_t>(is);
+        if (ndim > 64) {
+            throw Error<ValueError>("corrupt NDZ header: too many dimensions");
+        }
+        header.shape.resize(ndim);
+        long long size = 1;
+        for (auto &dim : header.shape) {
+            const uint32_t extent = read_pod<uint32_t>(is);
+            size *= extent;
+            if ((extent > static_cast<uint32_t>(std::numeric_limits<int>::max())) || (size > std::numeric_limits<int>::max())) {
+                throw Error<ValueError>("corrupt NDZ header: array is too big");
+            }
+            dim = extent;
+        }
+
+        const uint32_t chunk_size = read_pod<uint32_t>(is);
+        if ((chunk_size == 0) || (chunk_size > static_cast<uint32_t>(std::numeric_limits<int>::max()))) {
+            throw Error<ValueError>("corrupt NDZ header: invalid chunk size");
+        }
+        header.chunk_size = chunk_size;
+        const uint32_t num_chunks = read_pod<uint32_t>(is);
+        if (num_chunks != (size + chunk_size - 1) / chunk_size) {
+            throw Error<ValueError>("corrupt NDZ header: chunk count does not match shape");
+        }
+
+        header.table.resize(num_chunks);
+        for (uint32_t c = 0; c < num_chunks; ++c) {
+            auto &entry = header.table[c];
+            entry.offset = read_pod<uint64_t>(is);
+            entry.stored_size = read_pod<uint32_t>(is);
+            entry.raw_size = read_pod<uint32_t>(is);
+            entry.crc = read_pod<uint32_t>(is);
+            entry.flags = read_pod<uint32_t>(is);
+
+            // Every chunk but the last is full, so the raw size is known exactly.
+            const long long count = std::min<long long>(chunk_size, size - static_cast<long long>(c) * chunk_size);
+            if ((entry.raw_size != count * sizeof(T)) || (entry.flags > 1)
+                    || ((entry.flags == 0) && (entry.stored_size != entry.raw_size))) {
+                std::ostringstream oss;
+                oss << "corrupt NDZ header: bad table entry for chunk " << c;
+                throw Error<ValueError>(oss.str());
+            }
+        }
+        return header;
+    }
+
+    static ndarray load_rows(std::istream &is, const NdzHeader &header, int begin, int end) {
+        Shape shape = header.shape;
+        int row_size = get_size(Shape(shape.empty() ? shape.begin() : std::next(shape.begin()), shape.end()));
+        if (!shape.empty()) {
+            shape.front() = end - begin;
+        }
+        int first = begin * row_size, last = end * row_size;
+        int first_chunk = first / header.chunk_size;
+        int last_chunk = (static_cast<long long>(last) + header.chunk_size - 1) / header.chunk_size;
+        if ((first < last) && (last_chunk > static_cast<int>(header.table.size()))) {
+            throw Error<ValueError>("corrupt NDZ header: chunk table is too short");
+        }
+        last_chunk = std::max(first_chunk, last_chunk);
+
+        // Reading is sequential, decoding is parallel.
+        std::vector<std::vector<uint8_t>> stored(last_chunk - first_chunk);
+        for (int c = first_chunk; c < last_chunk; ++c) {
+            const auto &entry = header.table[c];
+            auto &chunk = stored[c - first_chunk];
+            chunk.resize(entry.stored_size);
+            is.seekg(header.start + static_cast<std::streamoff>(entry.offset));
+            if (!is.read(reinterpret_cast<char *>(chunk.data()), chunk.size())) {
+                throw Error<ValueError>("unexpected end of file");
+            }
+        }
+
+        // One slot per chunk, so workers never share an error message.
+        std::vector<T> values(last - first);
+        std::vector<std::string> errors(last_chunk - first_chunk);
+        parallel_for(last_chunk - first_chunk, 1, [&] (int b, int e) {
+            std::vector<T> raw;
+            for (int c = first_chunk + b; c < first_chunk + e; ++c) {
+                const auto &entry = header.table[c];
+                const auto &chunk = stored[c - first_chunk];
+                raw.resize(entry.raw_size / sizeof(T));
+                auto bytes = reinterpret_cast<uint8_t *>(raw.data());
+                if (entry.flags & 1) {
+                    try {
+                        ChunkCodec::unshuffle(ChunkCodec::decompress(chunk, entry.raw_size), bytes, sizeof(T));
+                    } catch (const Error<ValueError> &) {
+                        errors[c - first_chunk] = "corrupt compressed data";
+                        continue;
+                    }
+                } else {
+                    std::copy(chunk.begin(), chunk.end(), bytes);
+                }
+                if (ChunkCodec::crc32(bytes, entry.raw_size) != entry.crc) {
+                    errors[c - first_chunk] = "checksum mismatch";
+                    continue;
+                }
+
+                int chunk_first = c * header.chunk_size;
+                int from = std::max(first, chunk_first), to = std::min(last, chunk_first + static_cast<int>(raw.size()));
+                std::copy(std::next(raw.begin(), from - chunk_first), std::next(raw.begin(), std::max(from, to) - chunk_first),
+                        std::next(values.begin(), from - first));
+            }
+        });
+        for (int c = first_chunk; c < last_chunk; ++c) {
+            if (!errors[c - first_chunk].empty()) {
+                std::ostringstream oss;
+                oss << errors[c - first_chunk] << " in chunk " << c;
+                throw Error<ValueError>(oss.str());
+            }
+        }
+
+        return ndarray(std::move(shape), make_data(std::move(values)));
+    }
+
+    static int normalize_axis(int axis, int ndim) {
+        if ((axis < -ndim) || (axis >= ndim)) {
+            std::ostringstream oss;
+            oss << "axis " << axis << " is out of bounds for array of dimension " << ndim;
+            throw Error<IndexError>(oss.str());
+        }
+        return (axis < 0) ? (axis + ndim) : axis;
+    }
+
+    /**
+     * Sub-array [begin, end) along axis, sharing elements with this array.
+     */
+    ndarray take_range(int begin, int end, int axis) const {
+        Shape shape = shape_;
+        shape[axis] = end - begin;
+        int inner = get_size(Shape(std::next(shape_.begin(), axis + 1), shape_.end()));
+        int outer = get_size(Shape(shape_.begin(), std::next(shape_.begin(), axis)));
+
+        Data data;
+        data.reserve(static_cast<size_t>(outer) * (end - begin) * inner);
+        for (int o = 0; o < outer; ++o) {
+            auto first = std::next(data_.begin(), (static_cast<size_t>(o) * shape_[axis] + begin) * inner);
+            data.insert(data.end(), first, std::next(first, (end - begin) * inner));
+        }
+        return ndarray(std::move(shape), std::move(data));
+    }
+
+    void check_window(int window, int axis) const {
+        if (window < 1) {
+            throw Error<ValueError>("window must be at least 1");
+        }
+        if (window > shape_[axis]) {
+            throw Error<ValueError>("window shape cannot be larger than input array shape");
+        }
+    }
+
+    typedef typename accumulator_traits<T>::type Accumulator;
+
+    static constexpr int ALL_AXES = std::numeric_limits<int>::min();
+
+    /**
+     * Reducers of reduce_impl. Invalid elements are added as identity(), which leaves the state unchanged.
+     */
+    struct SumReducer {
+        typedef Accumulator State;
+        typedef T Out;
+
+        static State identity() {
+            return State();
+        }
+
+        static void add(State &state, const State &x) {
+            state += x;
+        }
+
+        static T finish(const State &state, long long) {
+            return static_cast<T>(state);
+        }
+    };
+
+    struct MeanReducer {
+        typedef double State;
+        typedef double Out;
+
+        static State identity() {
+            return 0.;
+        }
+
+        static void add(State &state, const State &x) {
+            state += x;
+        }
+
+        static double finish(const State &state, long long count) {
+            return (count > 0) ? state / count : std::numeric_limits<double>::quiet_NaN();
+        }
+    };
+
+    template<class Compare>
+    struct ExtremeReducer {
+        typedef Accumulator State;
+        typedef T Out;
+
+        // NaN for floating point, else the bound every element compares ahead of.
+        static State identity() {
+            return std::numeric_limits<State>::has_quiet_NaN ? std::numeric_limits<State>::quiet_NaN()
+                    : Compare()(0, 1) ? std::numeric_limits<State>::max() : std::numeric_limits<State>::lowest();
+        }
+
+        static void add(State &state, const State &x) {
+            state = (Compare()(x, state) || (state != state)) ? x : state;
+        }
+
+        static T finish(const State &state, long long) {
+            return static_cast<T>(state);
+        }
+    };
+
+    template<class Reducer>
+    ndarray<typename Reducer::Out> nan_reduce(int axis, ndarray<typename Reducer::Out> *out = nullptr) const {
+        return reduce_impl<Reducer>(axis, [] (long long, const T &x) -> bool { return x == x; }, nullptr, out);
+    }
+
+    void check_identity(int axis, const char *ufunc) const {
+        if ((axis == ALL_AXES) ? (size() == 0) : (shape_[normalize_axis(axis, ndim())] == 0)) {
+            throw Error<ValueError>(std::string("zero-size array to reduction operation ") + ufunc + " which has no identity");
+        }
+    }
+
+    /**
+     * Reduce along axis (over every element for ALL_AXES) the elements for which valid(index, x) holds,
+     * index being the element's row-major position; counts receives the valid elements behind each output.
+     *
+     * Lines along axis are reduced in tiles of adjacent lanes. A line with nothing beside it (inner size 1)
+     * is instead cut into chunks, each spread over LANES interleaved states that are merged at the end;
+     * lines shorter than LANES are reduced directly.
+     *
+     * Given out, the result is written into it (its storage directly when contiguous: every input is read
+     * before the first write, so out may alias this array) and an empty array is returned.
+     */
+    template<class Reducer, class Valid>
+    ndarray<typename Reducer::Out> reduce_impl(int axis, Valid valid, std::vector<long long> *counts = nullptr,
+            ndarray<typename Reducer::Out> *out = nullptr) const {
+        typedef typename Reducer::State State;
+        typedef typename Reducer::Out Out;
+
+        Shape shape;
+        int outer = 1, n = size(), inner = 1;
+        if (axis != ALL_AXES) {
+            axis = normalize_axis(axis, ndim());
+            n = shape_[axis];
+            inner = get_size(Shape(std::next(shape_.begin(), axis + 1), shape_.end()));
+            outer = get_size(Shape(shape_.begin(), std::next(shape_.begin(), axis)));
+            shape = shape_;
+            shape.erase(std::next(shape.begin(), axis));
+        }
+        Out *dst = (out != nullptr) ? reduction_out(*out, shape) : nullptr;
+
+        constexpr int LANES = 256;
+        std::vector<T> scratch;
+        const T *in = row_major_values(scratch);
+        std::vector<State> states(static_cast<size_t>(outer) * inner, Reducer::identity());
+        std::vector<long long> valid_counts(states.size(), 0);
+        auto accumulate = [&in, &valid] (long long index, State &state, long long &count) {
+            const T &x = in[index];
+            const bool ok = valid(index, x);
+            Reducer::add(state, ok ? static_cast<State>(x) : Reducer::identity());
+            count += ok;
+        };
+
+        if ((inner == 1) && (n < LANES)) {
+            // Rows too short to fill the lanes are reduced directly, a tile of rows per task.
+            int grain = std::max(1, (1 << 15) / std::max(1, n));
+            parallel_for(outer, grain, [&] (int begin, int end) {
+                for (int o = begin; o < end; ++o) {
+                    for (int k = 0; k < n; ++k) {
+                        accumulate(static_cast<long long>(o) * n + k, states[o], valid_counts[o]);
+                    }
+                }
+            });
+        } else if (inner == 1) {
+            constexpr int CHUNK = 1 << 14;
+            const int num_chunks = (n + CHUNK - 1) / CHUNK;
+            std::vector<State> partial;
+            std::vector<long long> partial_counts;
+            if (num_chunks > 1) {
+                partial.assign(static_cast<size_t>(outer) * num_chunks, Reducer::identity());
+                partial_counts.assign(partial.size(), 0);
+            }
+            State *partial_state = (num_chunks > 1) ? partial.data() : states.data();
+            long long *partial_count = (num_chunks > 1) ? partial_counts.data() : valid_counts.data();
+            int grain = std::max(1, (1 << 15) / std::min(n, CHUNK));
+            parallel_for(outer * num_chunks, grain, [&] (int begin, int end) {
+                std::vector<State> state(LANES);
+                std::vector<long long> count(LANES);
+                for (int t = begin; t < end; ++t) {
+                    const long long base = static_cast<long long>(t / num_chunks) * n;
+                    const int first = t % num_chunks * CHUNK, last = std::min(n, first + CHUNK);
+                    std::fill(state.begin(), state.end(), Reducer::identity());
+                    std::fill(count.begin(), count.end(), 0);
+                    int k = first;
+                    for (; k + LANES <= last; k += LANES) {
+                        for (int j = 0; j < LANES; ++j) {
+                            accumulate(base + k + j, state[j], count[j]);
+                        }
+                    }
+                    for (int j = 0; k < last; ++k, ++j) {
+                        accumulate(base + k, state[j], count[j]);
+                    }
+                    for (int j = 0; j < LANES; ++j) {
+                        Reducer::add(partial_state[t], state[j]);
+                        partial_count[t] += count[j];
+                    }
+                }
+            });
+            for (size_t t = 0; t < partial.size(); ++t) {
+                Reducer::add(states[t / num_chunks], partial[t]);
+                valid_counts[t / num_chunks] += partial_counts[t];
+            }
+        } else {
+            const int num_tiles = (inner + LANES - 1) / LANES;
+            int grain = std::max(1, (1 << 15) / std::max(1, n * std::min(inner, LANES)));
+            parallel_for(outer * num_tiles, grain, [&] (int begin, int end) {
+                for (int t = begin; t < end; ++t) {
+                    const int o = t / num_tiles, lane = t % num_tiles * LANES, lanes = std::min(LANES, inner - lane);
+                    State *state = &states[static_cast<size_t>(o) * inner + lane];
+                    long long *count = &valid_counts[static_cast<size_t>(o) * inner + lane];
+                    for (int k = 0; k < n; ++k) {
+                        const long long row = (static_cast<long long>(o) * n + k) * inner + lane;
+                        for (int j = 0; j < lanes; ++j) {
+                            accumulate(row + j, state[j], count[j]);
+                        }
+                    }
+                }
+            });
+        }
+
+        std::vector<Out> result((dst != nullptr) ? 0 : states.size());
+        Out *finished = (dst != nullptr) ? dst : result.data();
+        for (size_t i = 0; i < states.size(); ++i) {
+            finished[i] = Reducer::finish(states[i], valid_counts[i]);
+        }
+        if (counts != nullptr) {
+            *counts = std::move(valid_counts);
+        }
+        if (out == nullptr) {
+            return ndarray<Out>(std::move(shape), ndarray<Out>::make_data(std::move(result)));
+        }
+        if (dst == nullptr) {
+            *out = ndarray<Out>(std::move(shape), ndarray<Out>::make_data(std::move(result)));
+        }
+        return ndarray<Out>();
+    }
+
+    /**
+     * Shared driver of the rolling aggregates: kernel(in, out, n, stride, lanes) walks the n elements of
+     * lanes adjacent lines along axis, consecutive elements of a line stride apart in both in and out.
+     *
+     * Lines are handed out in tiles of adjacent inner positions so the kernels' lane loops vectorize.
+     * Given out, the windows are written into it, straight into its storage unless that is not contiguous
+     * or overlaps this array; an empty array is then returned.
+     */
+    template<class Out, class Kernel>
+    ndarray<Out> rolling_impl(int window, int axis, Kernel kernel, ndarray<Out> *out = nullptr) const {
+        axis = normalize_axis(axis, ndim());
+        check_window(window, axis);
+
+        const int n = shape_[axis], count = n - window + 1;
+        const int inner = get_size(Shape(std::next(shape_.begin(), axis + 1), shape_.end()));
+        const int outer = get_size(Shape(shape_.begin(), std::next(shape_.begin(), axis)));
+        Shape shape = shape_;
+        shape[axis] = count;
+
+        Out *dst = (out != nullptr) ? reduction_out(*out, shape) : nullptr;
+        if ((dst != nullptr) && overlaps(dst, dst + out->size())) {
+            dst = nullptr;
+        }
+
+        constexpr int LANES = 256;
+        const int num_tiles = (inner + LANES - 1) / LANES;
+        std::vector<T> scratch;
+        std::vector<Out> result((dst != nullptr) ? 0 : get_size(shape));
+        const T *in = row_major_values(scratch);
+        Out *windows = (dst != nullptr) ? dst : result.data();
+        int grain = std::max(1, (1 << 15) / std::max(1, n * std::min(inner, LANES)));
+        parallel_for(outer * num_tiles, grain, [=] (int begin, int end) {
+            for (int t = begin; t < end; ++t) {
+                const int o = t / num_tiles, lane = t % num_tiles * LANES;
+                kernel(in + static_cast<long long>(o) * n * inner + lane, windows + static_cast<long long>(o) * count * inner + lane,
+                        n, inner, std::min(LANES, inner - lane));
+            }
+        });
+        if (out == nullptr) {
+            return ndarray<Out>(std::move(shape), ndarray<Out>::make_data(std::move(result)));
+        }
+        if (dst == nullptr) {
+            *out = ndarray<Out>(std::move(shape), ndarray<Out>::make_data(std::move(result)));
+        }
+        return ndarray<Out>();
+    }
+
+    static std::function<void (const T *, T *, int, int, int)> rolling_sum_kernel(int window) {
+        return rolling_moment_kernel<T>(window, [] (const T &sum) -> T {
+            return sum;
+        });
+    }
+
+    static std::function<void (const T *, double *, int, int, int)> rolling_mean_kernel(int window) {
+        return rolling_moment_kernel<double>(window, [window] (double sum) -> double {
+            return sum / window;
+        });
+    }
+
+    /**
+     * Running-sum kernel accumulating in Acc, each window's sum passed through finish.
+     */
+    template<class Acc, class Finish>
+    static std::function<void (const T *, Acc *, int, int, int)> rolling_moment_kernel(int window, Finish finish) {
+        return [window, finish] (const T *in, Acc *out, int n, int stride, int lanes) {
+            std::vector<Acc> sum(lanes, Acc());
+            for (int k = 0; k < n; ++k) {
+                const T *add = in + static_cast<long long>(k) * stride;
+                for (int j = 0; j < lanes; ++j) {
+                    sum[j] += static_cast<Acc>(add[j]);
+                }
+                if (k >= window) {
+                    const T *drop = add - static_cast<long long>(window) * stride;
+                    for (int j = 0; j < lanes; ++j) {
+                        sum[j] -= static_cast<Acc>(drop[j]);
+                    }
+                }
+                if (k >= window - 1) {
+                    Acc *o = out + static_cast<long long>(k - window + 1) * stride;
+                    for (int j = 0; j < lanes; ++j) {
+                        o[j] = finish(sum[j]);
+                    }
+                }
+            }
+        };
+    }
+
+    /**
+     * Monotonic-deque kernel: the deque holds the positions of the window whose values are strictly
+     * ordered by compare, so its front is the window's extreme and every element is pushed and popped once.
+     */
+    template<class Compare>
+    static std::function<void (const T *, T *, int, int, int)> rolling_extreme_kernel(int window, Compare compare) {
+        return [window, compare] (const T *in, T *out, int n, int stride, int lanes) {
+            std::vector<int> ring(window);
+            for (int j = 0; j < lanes; ++j) {
+                const T *line = in + j;
+                int head = 0, size = 0;
+                for (int k = 0; k < n; ++k) {
+                    if ((size > 0) && (ring[head] == k - window)) {
+                        head = (head + 1) % window;
+                        --size;
+                    }
+                    const T &x = line[static_cast<long long>(k) * stride];
+                    while ((size > 0) && !compare(line[static_cast<long long>(ring[(head + size - 1) % window]) * stride], x)) {
+                        --size;
+                    }
+                    ring[(head + size) % window] = k;
+                    ++size;
+                    if (k >= window - 1) {
+                        out[static_cast<long long>(k - window + 1) * stride + j] = line[static_cast<long long>(ring[head]) * stride];
+                    }
+                }
+            }
+        };
+    }
+
+    template<template<class, class...> class Container, class... Ts>
+    static Data transform_data(const Container<T, Ts...> &ary) {
+        return make_data(std::vector<T>(ary.begin(), ary.end()));
+    }
+
+    static std::ostream &dump_shape(std::ostream &os, const Shape &shape) {
+        os << '(';
+        std::copy(shape.begin(), shape.end(), std::ostream_iterator<int>(os, ","));
+        os << ')';
+        return os;
+    }
+
+    /**
+     * Strides for reading an array of shape from as if it were broadcast to shape to, 0 along broadcast axes.
+     */
+    static bool broadcast_strides(const Shape &from, const Shape &to, std::vector<int> &strides) {
+        auto from_strides = get_strides(from);
+        strides.assign(to.size(), 0);
+        for (int i = static_cast<int>(from.size()) - 1, j = static_cast<int>(to.size()) - 1; i >= 0; --i, --j) {
+            if ((j >= 0) && (from[i] == to[j])) {
+                strides[j] = from_strides[i];
+            } else if (from[i] != 1) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    /**
+     * Whether other shares any element with this array, e.g. two overlapping views of the same array.
+     */
+    bool may_alias(const ndarray &other) const {
+        if (data_.empty() || other.data_.empty()) {
+            return false;
+        }
+
+        // Contiguous blocks overlap exactly when their address ranges do.
+        std::less<const T *> less;
+        if ((layout() != 0) && (other.layout() != 0)) {
+            const T *lbegin = data_.front().get(), *rbegin = other.data_.front().get();
+            return less(lbegin, rbegin + other.data_.size()) && less(rbegin, lbegin + data_.size());
+        }
+
+        auto bounds = [] (const Data &data) -> std::pair<const T *, const T *> {
+            auto less = [] (const Value &lhs, const Value &rhs) -> bool {
+                return std::less<const T *>()(lhs.get(), rhs.get());
+            };
+            auto minmax = std::minmax_element(data.begin(), data.end(), less);
+            return {minmax.first->get(), minmax.second->get()};
+        };
+        auto lbounds = bounds(data_), rbounds = bounds(other.data_);
+        if (less(lbounds.second, rbounds.first) || less(rbounds.second, lbounds.first)) {
+            return false;
+        }
+
+        std::vector<const T *> elements(data_.size());
+        std::transform(data_.begin(), data_.end(), elements.begin(), [] (const Value &arg) -> const T * {
+            return arg.get();
+        });
+        std::sort(elements.begin(), elements.end(), less);
+        return std::any_of(other.data_.begin(), other.data_.end(), [&elements, &less] (const Value &arg) -> bool {
+            return std::binary_search(elements.begin(), elements.end(), arg.get(), less);
+        });
+    }
+
+    /**
+     * Strided copy kernel: every element of this array receives source(offset), offset walking strides over our shape.
+     */
+    template<class Source>
+    void assign_strided(Source source, const std::vector<int> &strides) {
+        Value *dst = data_.data();
+        NdIter(shape_, {get_strides(shape_), strides}).for_each([dst, &source] (
+                const long long *offsets, const int *steps, int count) {
+            Value *d = dst + offsets[0];
+            long long offset = offsets[1];
+            for (int i = 0; i < count; ++i, d += steps[0], offset += steps[1]) {
+                **d = source(offset);
+            }
+        });
+    }
+
+    /**
+     * Shape of the result of broadcasting lshape against rshape.
+     */
+    static bool broadcast_shapes(const Shape &lshape, const Shape &rshape, Shape &shape) {
+        shape.assign(std::max(lshape.size(), rshape.size()), 1);
+        for (int i = static_cast<int>(shape.size()) - 1, j = lshape.size() - 1, k = rshape.size() - 1; i >= 0; --i, --j, --k) {
+            int ldim = (j >= 0) ? lshape[j] : 1, rdim = (k >= 0) ? rshape[k] : 1;
+            if ((ldim != rdim) && (ldim != 1) && (rdim != 1)) {
+                return false;
+            }
+            shape[i] = (ldim == 1) ? rdim : ldim;
+        }
+        return true;
+    }
+
+    ndarray(Shape shape, Data data)
+            : shape_(std::move(shape)),
+              data_(std::move(data)) {
+    }
+
+    enum Layout {
+        C_CONTIGUOUS = 1, F_CONTIGUOUS = 2, UNKNOWN_LAYOUT = -1
+    };
+
+    /**
+     * Layout flags, found on first use and kept: the handles of an array never change.
+     */
+    int layout() const {
+        int flags = flags_.load(std::memory_order_relaxed);
+        if (flags == UNKNOWN_LAYOUT) {
+            flags = detect_layout();
+            flags_.store(flags, std::memory_order_relaxed);
+        }
+        return flags;
+    }
+
+    int detect_layout() const {
+        const int long_axes = std::count_if(shape_.begin(), shape_.end(), [] (int dim) -> bool { return dim > 1; });
+        if (data_.size() <= 1) {
+            return C_CONTIGUOUS | F_CONTIGUOUS;
+        }
+        const T *base = data_.front().get();
+        bool contiguous = true;
+        for (size_t i = 1; contiguous && (i < data_.size()); ++i) {
+            contiguous = (data_[i].get() == base + i);
+        }
+        if (contiguous) {
+            return (long_axes <= 1) ? (C_CONTIGUOUS | F_CONTIGUOUS) : C_CONTIGUOUS;
+        }
+        if (long_axes <= 1) {
+            return 0;
+        }
+        contiguous = true;
+        fortran_offsets(shape_, [this, base, &contiguous] (long long i, long long offset) {
+            contiguous = contiguous && (data_[i].get() == base + offset);
+        });
+        return contiguous ? F_CONTIGUOUS : 0;
+    }
+
+    /**
+     * 'C' or 'F' for order, resolving 'A' to F when this array is F- but not C-contiguous.
+     */
+    char resolve_order(char order) const {
+        if (order == 'A') {
+            return (layout() == F_CONTIGUOUS) ? 'F' : 'C';
+        }
+        if ((order != 'C') && (order != 'F')) {
+            std::ostringstream oss;
+            oss << "order must be one of 'C', 'F', 'A', or 'K' (got '" << order << "')";
+            throw Error<ValueError>(oss.str());
+        }
+        return order;
+    }
+
+    /**
+     * Call f(i, offset) for every row-major index i of shape, offset being the same element's index in
+     * column-major order.
+     */
+    template<class F>
+    static void fortran_offsets(const Shape &shape, F f) {
+        const int ndim = shape.size();
+        std::vector<long long> strides(ndim, 1);
+        for (int k = 1; k < ndim; ++k) {
+            strides[k] = strides[k - 1] * shape[k - 1];
+        }
+        std::vector<int> index(ndim, 0);
+        const long long size = get_size(shape);
+        long long offset = 0;
+        for (long long i = 0; i < size; ++i) {
+            f(i, offset);
+            for (int k = ndim - 1; k >= 0; --k) {
+                offset += strides[k];
+                if (++index[k] < shape[k]) {
+                    break;
+                }
+                offset -= strides[k] * shape[k];
+                index[k] = 0;
+            }
+        }
+    }
+
+    int resolve_index(int index, bool verify) const {
+        if (ndim() == 0) {
+            throw Error<IndexError>("invalid index to scalar variable");
+        }
+
+        int dim = len();
+
+        if (verify && ((index < -dim) || (index >= dim))) {
+            std::ostringstream oss;
+            oss << "index " << index << " is out of bounds for axis 0 with size " << dim;
+            throw Error<IndexError>(oss.str());
+        }
+
+        return (index < 0) ? (index + dim) : index;
+    }
+
+    template<class... Args>
+    ndarray slice_impl(int index, Args... args) const {
+        return (*this)[index].slice_impl(std::move(args)...);
+    }
+
+    template<class... Args>
+    ndarray slice_impl(std::pair<int, int> range, Args... args) const {
+        std::vector<ndarray> slices;
+        int begin = std::max(0, resolve_index(range.first, false));
+        int end = std::min(len(), resolve_index(range.second, false));
+        for (; begin < end; ++begin) {
+            slices.push_back(slice_impl(begin, std::move(args)...));
+        }
+
+        auto shape = get_shape(slices);
+        if (shape.empty()) {
+            return {};
+        }
+
+        auto data = flatten_data(slices);
+        if (data.empty()) {
+            return {};
+        }
+
+        return ndarray(std::move(shape), std::move(data));
+    }
+
+    ndarray slice_impl() const {
+        return *this;
+    }
+
+    /**
+     * Integer division by a scalar: the divisor's magic numbers are computed once, then every element costs a
+     * multiply-high and shifts instead of a hardware divide, in a flat loop the compiler can vectorize.
+     */
+    ndarray divide_scalar(const T &divisor, std::true_type) const {
+        if (!IntDivider<T>::supported || (divisor == T())) {
+            return operator_impl(ndarray::scalar(divisor), OP_DIV);
+        }
+
+        Tracer::Span span("divide");
+        trace(span, {&shape_}, shape_, 2LL * size() * sizeof(T));
+        const IntDivider<T> divider(divisor);
+        auto values = this->values();
+        T *p = values.data();
+        parallel_for(values.size(), 1 << 16, [p, &divider] (int begin, int end) {
+            for (int i = begin; i < end; ++i) {
+                p[i] = divider(p[i]);
+            }
+        });
+        return ndarray(shape_, make_data(std::move(values)));
+    }
+
+    ndarray divide_scalar(const T &divisor, std::false_type) const {
+        return operator_impl(ndarray::scalar(divisor), OP_DIV);
+    }
+
+    static const char *operator_name(Operator op) {
+        static const char *const names[] = {"add", "subtract", "multiply", "divide"};
+        return names[op];
+    }
+
+    /**
+     * Attach the operands' and result's shapes and the bytes of elements read and written to span.
+     */
+    static void trace(Tracer::Span &span, std::initializer_list<const Shape *> inputs, const Shape &output, long long bytes) {
+        if (!span) {
+            return;
+        }
+        int i = 0;
+        for (const Shape *input : inputs) {
+            span.shape("in" + std::to_string(i++), *input);
+        }
+        span.shape("out", output).bytes(bytes);
+    }
+
+    ndarray operator_impl(const ndarray &rhs, Operator op) const {
+        Tracer::Span span(operator_name(op));
+        ndarray result = apply_operator(rhs, op);
+        trace(span, {&shape_, &rhs.shape_}, result.shape_, (static_cast<long long>(size()) + rhs.size() + result.size()) * sizeof(T));
+        return result;
+    }
+
+    ndarray apply_operator(const ndarray &rhs, Operator op) const {
+        switch (op) {
+        case OP_ADD:
+            return elementwise(rhs, [] (const T &lhs, const T &rhs) -> T { return lhs + rhs; });
+        case OP_SUB:
+            return elementwise(rhs, [] (const T &lhs, const T &rhs) -> T { return lhs - rhs; });
+        case OP_MUL:
+            return elementwise(rhs, [] (const T &lhs, const T &rhs) -> T { return lhs * rhs; });
+        case OP_DIV:
+            return elementwise(rhs, [] (const T &lhs, const T &rhs) -> T { return lhs / rhs; });
+        default:
+            throw Error<TypeError>("unsupported operator");
+        }
+    }
+
+    void operator_impl(const ndarray &rhs, Operator op, ndarray &out) const {
+        Tracer::Span span(operator_name(op));
+        trace(span, {&shape_, &rhs.shape_}, out.shape_, (static_cast<long long>(size()) + rhs.size() + out.size()) * sizeof(T));
+        switch (op) {
+        case OP_ADD:
+            return elementwise(rhs, [] (const T &lhs, const T &rhs) -> T { return lhs + rhs; }, out);
+        case OP_SUB:
+            return elementwise(rhs, [] (const T &lhs, const T &rhs) -> T { return lhs - rhs; }, out);
+        case OP_MUL:
+            return elementwise(rhs, [] (const T &lhs, const T &rhs) -> T { return lhs * rhs; }, out);
+        case OP_DIV:
+            return divide_into(rhs, out, std::is_integral<T>());
+        default:
+            throw Error<TypeError>("unsupported operator");
+        }
+    }
+
+    void divide_into(const ndarray &rhs, ndarray &out, std::true_type) const {
+        if ((rhs.ndim() != 0) || !IntDivider<T>::supported || (static_cast<T>(rhs) == T())) {
+            return divide_into(rhs, out, std::false_type());
+        }
+        const IntDivider<T> divider(static_cast<T>(rhs));
+        elementwise(rhs, [&divider] (const T &lhs, const T &) -> T { return divider(lhs); }, out);
+    }
+
+    void divide_into(const ndarray &rhs, ndarray &out, std::false_type) const {
+        elementwise(rhs, [] (const T &lhs, const T &rhs) -> T { return lhs / rhs; }, out);
+    }
+
+    /**
+     * Apply f to the broadcast operands, reading both in place through broadcast strides.
+     */
+    template<class F>
+    ndarray elementwise(const ndarray &rhs, F f) const {
+        Shape shape = broadcast_result(rhs);
+
+        // Operands sharing one contiguous layout (or 0-d): a flat loop over memory, the result in that layout.
+        const int both = C_CONTIGUOUS | F_CONTIGUOUS;
+        const int common = ((ndim() == 0) ? both : layout()) & ((rhs.ndim() == 0) ? both : rhs.layout());
+        if ((common != 0) && ((shape_ == rhs.shape_) || (ndim() == 0) || (rhs.ndim() == 0)) && !data_.empty() && !rhs.data_.empty()) {
+            const int n = get_size(shape), lstep = (ndim() == 0) ? 0 : 1, rstep = (rhs.ndim() == 0) ? 0 : 1;
+            const T *l = data_.front().get(), *r = rhs.data_.front().get();
+            Buffer values(n);
+            T *out = values.data();
+            parallel_for(n, 1 << 15, [=] (int begin, int end) {
+                for (int i = begin; i < end; ++i) {
+                    out[i] = f(l[i * lstep], r[i * rstep]);
+                }
+            });
+            Data data = make_data(std::move(values), shape, (common & C_CONTIGUOUS) ? 'C' : 'F');
+            return ndarray(std::move(shape), std::move(data));
+        }
+
+        std::vector<int> lstrides, rstrides;
+        broadcast_strides(shape_, shape, lstrides);
+        broadcast_strides(rhs.shape_, shape, rstrides);
+        NdIter iter(shape, {get_strides(shape), lstrides, rstrides});
+
+        Buffer values(get_size(shape));
+        T *out = values.data();
+        const Value *ldata = data_.data(), *rdata = rhs.data_.data();
+        parallel_for(iter.num_rows(), std::max(1, (1 << 15) / iter.row_size()), [&] (int begin, int end) {
+            iter.for_each(begin, end, [=] (const long long *offsets, const int *steps, int count) {
+                T *o = out + offsets[0];
+                const Value *l = ldata + offsets[1], *r = rdata + offsets[2];
+                for (int i = 0; i < count; ++i, o += steps[0], l += steps[1], r += steps[2]) {
+                    *o = f(**l, **r);
+                }
+            });
+        });
+
+        return ndarray(std::move(shape), make_data(std::move(values)));
+    }
+
+    /**
+     * Same as above, writing into the elements of out through its pointers.
+     *
+     * Operands of out's shape (or 0-d) are walked as flat handle arrays with no allocation at all; only
+     * broadcasting needs the iterator's per-axis bookkeeping. If out overlaps an operand other than element
+     * for element, the result is buffered first.
+     */
+    template<class F>
+    void elementwise(const ndarray &rhs, F f, ndarray &out) const {
+        check_out(out, broadcast_result(rhs));
+        if (!out.may_overwrite(*this) || !out.may_overwrite(rhs)) {
+            out = elementwise(rhs, f);
+            return;
+        }
+
+        if (((shape_ == out.shape_) || (ndim() == 0)) && ((rhs.shape_ == out.shape_) || (rhs.ndim() == 0))) {
+            const int lstep = (shape_ == out.shape_) ? 1 : 0, rstep = (rhs.shape_ == out.shape_) ? 1 : 0;
+            const Value *o = out.data_.data(), *l = data_.data(), *r = rhs.data_.data();
+            parallel_for(out.size(), 1 << 15, [=] (int begin, int end) {
+                for (int i = begin; i < end; ++i) {
+                    *o[i] = f(*l[i * lstep], *r[i * rstep]);
+                }
+            });
+            return;
+        }
+
+        std::vector<int> lstrides, rstrides;
+        broadcast_strides(shape_, out.shape_, lstrides);
+        broadcast_strides(rhs.shape_, out.shape_, rstrides);
+        NdIter iter(out.shape_, {get_strides(out.shape_), lstrides, rstrides});
+
+        const Value *odata = out.data_.data(), *ldata = data_.data(), *rdata = rhs.data_.data();
+        parallel_for(iter.num_rows(), std::max(1, (1 << 15) / iter.row_size()), [&] (int begin, int end) {
+            iter.for_each(begin, end, [=] (const long long *offsets, const int *steps, int count) {
+                const Value *o = odata + offsets[0], *l = ldata + offsets[1], *r = rdata + offsets[2];
+                for (int i = 0; i < count; ++i, o += steps[0], l += steps[1], r += steps[2]) {
+                    **o = f(**l, **r);
+                }
+            });
+        });
+    }
+
+    Shape broadcast_result(const ndarray &rhs) const {
+        Shape shape;
+        if (!broadcast_shapes(shape_, rhs.shape_, shape)) {
+            std::ostringstream oss;
+            oss << "operands could not be broadcast together with shapes ";
+            dump_shape(oss, shape_);
+            oss << " ";
+            dump_shape(oss, rhs.shape_);
+            throw Error<ValueError>(oss.str());
+        }
+        return shape;
+    }
+
+    /**
+     * A result of the given shape may be written to out if it broadcasts to out's shape unchanged,
+     * as in np.add(1, 2, out=np.empty(3)).
+     */
+    static void check_out(const ndarray &out, const Shape &shape) {
+        Shape merged;
+        if (!broadcast_shapes(shape, out.shape_, merged) || (merged != out.shape_)) {
+            std::ostringstream oss;
+            oss << "non-broadcastable output operand with shape ";
+            dump_shape(oss, out.shape_);
+            oss << " doesn't match the broadcast shape ";
+            dump_shape(oss, shape);
+            throw Error<ValueError>(oss.str());
+        }
+    }
+
+    /**
+     * Reductions and gufuncs do not broadcast into out: its shape must be the result's.
+     */
+    static void check_exact_out(const Shape &out_shape, const Shape &shape) {
+        if (out_shape != shape) {
+            std::ostringstream oss;
+            oss << "non-broadcastable output operand with shape ";
+            dump_shape(oss, out_shape);
+            oss << " doesn't match the broadcast shape ";
+            dump_shape(oss, shape);
+            throw Error<ValueError>(oss.str());
+        }
+    }
+
+    /**
+     * Storage a reduction may write its result of the given shape straight into: out's, when contiguous,
+     * else nullptr and the result is assigned through out's elements.
+     */
+    template<class U>
+    static U *reduction_out(ndarray<U> &out, const Shape &shape) {
+        check_exact_out(out.shape_, shape);
+        return out.contiguous_data();
+    }
+
+    /**
+     * Whether any element of this array lies in [begin, end).
+     */
+    template<class U>
+    bool overlaps(const U *begin, const U *end) const {
+        std::less<const void *> less;
+        auto inside = [&] (const T *p) -> bool {
+            return less(static_cast<const void *>(begin), p + 1) && less(static_cast<const void *>(p), end);
+        };
+        if (data_.empty() || (begin == end)) {
+            return false;
+        }
+        if (layout() != 0) {
+            const T *first = data_.front().get();
+            return less(static_cast<const void *>(first), end) && less(static_cast<const void *>(begin), first + data_.size());
+        }
+        return std::any_of(data_.begin(), data_.end(), [&inside] (const Value &value) -> bool {
+            return inside(value.get());
+        });
+    }
+
+    /**
+     * Whether writing the i-th element of this array right after reading the i-th element of operand is safe:
+     * either they share no element or operand is this very array. Contiguous arrays are told apart by
+     * their base pointers and extents alone.
+     */
+    bool may_overwrite(const ndarray &operand) const {
+        const int common = layout() & operand.layout();
+        if ((common != 0) && (operand.shape_ == shape_) && !data_.empty() && (data_.front() == operand.data_.front())) {
+            return true;
+        }
+        if ((layout() != 0) && (operand.layout() != 0)) {
+            return !may_alias(operand);
+        }
+        if (operand.shape_ == shape_) {
+            bool same = true;
+            for (size_t i = 0; same && (i < data_.size()); ++i) {
+                same = (data_[i] == operand.data_[i]);
+            }
+            if (same) {
+                return true;
+            }
+        }
+        return !may_alias(operand);
+    }
+
+    /**
+     * Address of the first element when all elements sit contiguously in row-major order, else nullptr.
+     */
+    T *contiguous_data() const {
+        return (!data_.empty() && (layout() & C_CONTIGUOUS)) ? data_.front().get() : nullptr;
+    }
+
+    /**
+     * Row-major element values, read in place when contiguous, else gathered into scratch.
+     */
+    const T *row_major_values(std::vector<T> &scratch) const {
+        if (const T *base = contiguous_data()) {
+            return base;
+        }
+        scratch = values();
+        return scratch.data();
+    }
+
+    std::vector<T> values() const {
+        std::vector<T> values(data_.size());
+        std::transform(data_.begin(), data_.end(), values.begin(), [] (const Value &arg) -> T {
+            return *arg;
+        });
+        return values;
+    }
+
+    /**
+     * values converted to dtype U, handed through untouched when U is T.
+     */
+    template<class U>
+    static std::vector<U> cast_values(std::vector<T> values) {
+        return cast_values<U>(std::move(values), std::is_same<U, T>());
+    }
+
+    template<class U>
+    static std::vector<U> cast_values(std::vector<T> values, std::true_type) {
+        return values;
+    }
+
+    template<class U>
+    static std::vector<U> cast_values(std::vector<T> values, std::false_type) {
+        std::vector<U> converted(values.size());
+        convert_values(values.data(), converted.data(), values.size());
+        return converted;
+    }
+
+    /**
+     * Wrap values into Data backed by a single allocation, every element aliasing into the same block.
+     */
+    static Data make_data(std::vector<T> values) {
+        return make_data<std::allocator<T>>(std::move(values));
+    }
+
+    template<class Allocator>
+    static Data make_data(std::vector<T, Allocator> values) {
+        auto block = std::make_shared<Block<std::vector<T, Allocator>>>(std::move(values));
+        Data data(block->values.size());
+        for (size_t i = 0; i < data.size(); ++i) {
+            data[i] = Value(block, block->values.data() + i);
+        }
+        return data;
+    }
+
+    /**
+     * Wrap values laid out over shape in row-major (order 'C') or column-major (order 'F') order.
+     */
+    static Data make_data(Buffer values, const Shape &shape, char order) {
+        if (order != 'F') {
+            return make_data(std::move(values));
+        }
+        auto block = std::make_shared<Block<Buffer>>(std::move(values));
+        Data data(block->values.size());
+        T *base = block->values.data();
+        fortran_offsets(shape, [&data, &block, base] (long long i, long long offset) {
+            data[i] = Value(block, base + offset);
+        });
+        return data;
+    }
+
+    /**
+     * Element storage shared by the elements of make_data, charged to T's data in MemoryStats.
+     */
+    template<class Values>
+    struct Block {
+        explicit Block(Values init)
+                : values(std::move(init)),
+                  tag(MemoryStats::acquire(dtype_traits<T>::name(), false, values.capacity() * sizeof(T))) {
+        }
+
+        ~Block() {
+            MemoryStats::release(dtype_traits<T>::name(), false, values.capacity() * sizeof(T), tag);
+        }
+
+        Values values;
+        int tag;
+    };
+
+    static std::vector<int> get_strides(const Shape &shape) {
+        std::vector<int> strides(shape.size(), 1);
+        for (int i = static_cast<int>(shape.size()) - 2; i >= 0; --i) {
+            strides[i] = strides[i + 1] * shape[i + 1];
+        }
+        return strides;
+    }
+
+    /**
+     * Gather src into a new row-major buffer of the given shape, where axis i steps strides[i] elements in src.
+     */
+    static std::vector<T> gather_values(const std::vector<T> &src, const Shape &shape, const std::vector<int> &strides) {
+        std::vector<T> dst(get_size(shape));
+        T *out = dst.data();
+        const T *in = src.data();
+        NdIter(shape, {get_strides(shape), strides}).for_each([out, in] (
+                const long long *offsets, const int *steps, int count) {
+            T *d = out + offsets[0];
+            const T *s = in + offsets[1];
+            for (int i = 0; i < count; ++i, d += steps[0], s += steps[1]) {
+                *d = *s;
+            }
+        });
+        return dst;
+    }
+
+    /**
+     * Run f(begin, end) over [0, n) in contiguous chunks of at least grain items, at most one chunk per hardware thread.
+     * Inside another parallel region the whole range runs inline on the calling thread.
+     */
+    template<class F>
+    static void parallel_for(int n, int grain, F f) {
+        // Small ranges skip the hardware_concurrency query, which costs microseconds.
+        if ((n <= grain) || ParallelRegion::active()) {
+            if (n > 0) {
+                f(0, n);
+            }
+            return;
+        }
+        int num_threads = std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+        num_threads = std::min(num_threads, (n + grain - 1) / std::max(1, grain));
+        if (num_threads <= 1) {
+            if (n > 0) {
+                f(0, n);
+            }
+            return;
+        }
+
+        int chunk = (n + num_threads - 1) / num_threads;
+        const int scope = MemoryStats::active_scope();
+        std::vector<std::thread> threads;
+        for (int begin = chunk; begin < n; begin += chunk) {
+            threads.emplace_back([f, scope, begin, end = std::min(n, begin + chunk)] () mutable {
+                MemoryStats::Scope stats(scope);
+                ParallelRegion region;
+                f(begin, end);
+            });
+        }
+        {
+            ParallelRegion region;
+            f(0, chunk);
+        }
+        for (auto &thread : threads) {
+            thread.join();
+        }
+    }
+
+    /**
+     * C(m, n) += A(m, k) * B(k, n), all row-major and packed.
+     */
+    static void gemm(int m, int n, int k, const T *a, const T *b, T *c) {
+        gemm(m, n, k, a, k, b, n, c, n);
+    }
+
+    /**
+     * C(m, n) += A(m, k) * B(k, n), all row-major with leading dimensions lda, ldb and ldc.
+     *
+     * Row blocks of C are distributed across threads.
+     */
+    static void gemm(int m, int n, int k, const T *a, int lda, const T *b, int ldb, T *c, int ldc) {
+        constexpr int MC = 64;
+        int num_blocks = (m + MC - 1) / MC;
+        long long flops_per_block = static_cast<long long>(MC) * n * k;
+        int grain = static_cast<int>(std::max(1LL, (1LL << 18) / std::max(1LL, flops_per_block)));
+        parallel_for(num_blocks, grain, [=] (int begin, int end) {
+            gemm_rows(begin * MC, std::min(m, end * MC), n, k, a, lda, b, ldb, c, ldc);
+        });
+    }
+
+    /**
+     * Rows [row_begin, row_end) of gemm on the calling thread.
+     *
+     * Blocked over k and n so a panel of B stays in cache while rows of C accumulate.
+     */
+    static void gemm_rows(int row_begin, int row_end, int n, int k,
+            const T *a, int lda, const T *b, int ldb, T *c, int ldc) {
+        constexpr int MC = 64, KC = 256, NC = 512;
+        for (int ib = row_begin; ib < row_end; ib += MC) {
+            int iend = std::min(row_end, ib + MC);
+            for (int kb = 0; kb < k; kb += KC) {
+                int kend = std::min(k, kb + KC);
+                for (int jb = 0; jb < n; jb += NC) {
+                    int jend = std::min(n, jb + NC);
+                    for (int i = ib; i < iend; ++i) {
+                        T *crow = c + static_cast<long long>(i) * ldc;
+                        for (int p = kb; p < kend; ++p) {
+                            const T aip = a[static_cast<long long>(i) * lda + p];
+                            const T *brow = b + static_cast<long long>(p) * ldb;
+                            for (int j = jb; j < jend; ++j) {
+                                crow[j] += aip * brow[j];
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    struct EinsumTerm {
+        std::string labels;
+        Shape shape;
+        std::vector<T> values;
+    };
+
+    static int einsum_size(const EinsumTerm &term, const std::string &labels) {
+        int size = 1;
+        for (char label : labels) {
+            size *= term.shape[term.labels.find(label)];
+        }
+        return size;
+    }
+
+    /**
+     * Collapse repeated labels of a term onto their diagonal, e.g. "ii" -> "i".
+     */
+    static EinsumTerm einsum_diagonal(EinsumTerm term) {
+        EinsumTerm result;
+        std::vector<int> strides, old_strides = get_strides(term.shape);
+        for (size_t i = 0; i < term.labels.size(); ++i) {
+            auto j = result.labels.find(term.labels[i]);
+            if (j == std::string::npos) {
+                result.labels.push_back(term.labels[i]);
+                result.shape.push_back(term.shape[i]);
+                strides.push_back(old_strides[i]);
+            } else if (result.shape[j] != term.shape[i]) {
+                std::ostringstream oss;
+                oss << "dimensions in operand for collapsing index '" << term.labels[i] << "' don't match ("
+                    << result.shape[j] << " != " << term.shape[i] << ")";
+                throw Error<ValueError>(oss.str());
+            } else {
+                strides[j] += old_strides[i];
+            }
+        }
+        if (result.labels.size() == term.labels.size()) {
+            return term;
+        }
+        result.values = gather_values(term.values, result.shape, strides);
+        return result;
+    }
+
+    /**
+     * Sum out every label of the term that is not in keep.
+     */
+    static EinsumTerm einsum_reduce(EinsumTerm term, const std::string &keep) {
+        EinsumTerm result;
+        for (size_t i = 0; i < term.labels.size(); ++i) {
+            if (keep.find(term.labels[i]) != std::string::npos) {
+                result.labels.push_back(term.labels[i]);
+                result.shape.push_back(term.shape[i]);
+            }
+        }
+        if (result.labels.size() == term.labels.size()) {
+            return term;
+        }
+
+        auto strides = get_strides(result.shape);
+        std::vector<int> dst_strides(term.labels.size(), 0);
+        for (size_t i = 0, j = 0; i < term.labels.size(); ++i) {
+            if (keep.find(term.labels[i]) != std::string::npos) {
+                dst_strides[i] = strides[j++];
+            }
+        }
+
+        result.values.assign(get_size(result.shape), T());
+        T *out = result.values.data();
+        const T *in = term.values.data();
+        NdIter(term.shape, {dst_strides, get_strides(term.shape)}).for_each([out, in] (
+                const long long *offsets, const int *steps, int count) {
+            T *d = out + offsets[0];
+            const T *s = in + offsets[1];
+            for (int i = 0; i < count; ++i, d += steps[0], s += steps[1]) {
+                *d += *s;
+            }
+        });
+        return result;
+    }
+
+    /**
+     * Transpose the term so that its labels come in the given order.
+     */
+    static EinsumTerm einsum_permute(EinsumTerm term, const std::string &labels) {
+        if (term.labels == labels) {
+            return term;
+        }
+
+        EinsumTerm result;
+        result.labels = labels;
+        auto old_strides = get_strides(term.shape);
+        std::vector<int> strides;
+        for (char label : labels) {
+            auto i = term.labels.find(label);
+            result.shape.push_back(term.shape[i]);
+            strides.push_back(old_strides[i]);
+        }
+        result.values = gather_values(term.values, result.shape, strides);
+        return result;
+    }
+
+    /**
+     * Contract two terms, keeping the labels in needed.
+     *
+     * Both terms are transposed to (batch, free, contracted) and (batch, contracted, free)
+     * and every batch becomes one GEMM, or a fused multiply-reduce loop for a single output element.
+     */
+    static EinsumTerm einsum_contract(EinsumTerm a, EinsumTerm b, const std::string &needed) {
+        a = einsum_reduce(std::move(a), b.labels + needed);
+        b = einsum_reduce(std::move(b), a.labels + needed);
+
+        std::string batch, contracted, left, right;
+        for (char label : a.labels) {
+            if (b.labels.find(label) == std::string::npos) {
+                left.push_back(label);
+            } else if (needed.find(label) == std::string::npos) {
+                contracted.push_back(label);
+            } else {
+                batch.push_back(label);
+            }
+        }
+        for (char label : b.labels) {
+            if (a.labels.find(label) == std::string::npos) {
+                right.push_back(label);
+            }
+        }
+
+        int nb = einsum_size(a, batch), m = einsum_size(a, left), k = einsum_size(a, contracted);
+        int n = einsum_size(b, right);
+        a = einsum_permute(std::move(a), batch + left + contracted);
+        b = einsum_permute(std::move(b), batch + contracted + right);
+
+        EinsumTerm result;
+        result.labels = batch + left + right;
+        for (char label : batch + left) {
+            result.shape.push_back(a.shape[a.labels.find(label)]);
+        }
+        for (char label : right) {
+            result.shape.push_back(b.shape[b.labels.find(label)]);
+        }
+        result.values.assign(static_cast<size_t>(nb) * m * n, T());
+
+        const T *pa = a.values.data(), *pb = b.values.data();
+        T *pc = result.values.data();
+        if ((m == 1) && (n == 1)) {
+            parallel_for(nb, std::max(1, (1 << 16) / std::max(1, k)), [=] (int begin, int end) {
+                for (int i = begin; i < end; ++i) {
+                    T sum = T();
+                    for (int p = 0; p < k; ++p) {
+                        sum += pa[static_cast<long long>(i) * k + p] * pb[static_cast<long long>(i) * k + p];
+                    }
+                    pc[i] = sum;
+                }
+            });
+        } else {
+            for (int i = 0; i < nb; ++i) {
+                gemm(m, n, k,
+                        pa + static_cast<long long>(i) * m * k,
+                        pb + static_cast<long long>(i) * k * n,
+                        pc + static_cast<long long>(i) * m * n);
+            }
+        }
+        return result;
+    }
+
+    static ndarray einsum_impl(const std::string &subscripts, const std::vector<ndarray> &operands) {
+        std::string spec;
+        std::copy_if(subscripts.begin(), subscripts.end(), std::back_inserter(spec), [] (char c) -> bool {
+            return c != ' ';
+        });
+
+        auto arrow = spec.find("->");
+        std::string inputs = spec.substr(0, arrow);
+        std::vector<std::string> labels(1);
+        for (char c : inputs) {
+            if (c == ',') {
+                labels.emplace_back();
+            } else if (std::isalpha(static_cast<unsigned char>(c))) {
+                labels.back().push_back(c);
+            } else {
+                std::ostringstream oss;
+                oss << "invalid subscript '" << c << "' in einstein sum subscripts string, subscripts must be letters";
+                throw Error<ValueError>(oss.str());
+            }
+        }
+        if (labels.size() != operands.size()) {
+            throw Error<ValueError>(labels.size() > operands.size()
+                    ? "fewer operands provided to einstein sum function than specified in the subscripts string"
+                    : "more operands provided to einstein sum function than specified in the subscripts string");
+        }
+
+        std::vector<EinsumTerm> terms;
+        int dims[128];
+        std::fill(std::begin(dims), std::end(dims), -1);
+        for (size_t i = 0; i < operands.size(); ++i) {
+            if (static_cast<int>(labels[i].size()) != operands[i].ndim()) {
+                std::ostringstream oss;
+                oss << "einstein sum subscripts string contains " << labels[i].size() << " subscripts for operand "
+                    << i << " with " << operands[i].ndim() << " dimensions";
+                throw Error<ValueError>(oss.str());
+            }
+            for (size_t j = 0; j < labels[i].size(); ++j) {
+                int &dim = dims[static_cast<int>(labels[i][j])];
+                if ((dim != -1) && (dim != operands[i].shape_[j])) {
+                    std::ostringstream oss;
+                    oss << "size of label '" << labels[i][j] << "' for operand " << i << " ("
+                        << operands[i].shape_[j] << ") does not match previous terms (" << dim << ")";
+                    throw Error<ValueError>(oss.str());
+                }
+                dim = operands[i].shape_[j];
+            }
+            terms.push_back({labels[i], operands[i].shape_, operands[i].values()});
+        }
+
+        std::string output;
+        if (arrow == std::string::npos) {
+            for (char c = 'A'; c <= 'z'; ++c) {
+                if (std::count(inputs.begin(), inputs.end(), c) == 1) {
+                    output.push_back(c);
+                }
+            }
+        } else {
+            output = spec.substr(arrow + 2);
+            for (size_t i = 0; i < output.size(); ++i) {
+                if (output.find(output[i], i + 1) != std::string::npos) {
+                    std::ostringstream oss;
+                    oss << "einstein sum subscripts string includes output subscript '" << output[i] << "' multiple times";
+                    throw Error<ValueError>(oss.str());
+                }
+                if (!std::isalpha(static_cast<unsigned char>(output[i])) || (inputs.find(output[i]) == std::string::npos)) {
+                    std::ostringstream oss;
+                    oss << "einstein sum subscripts string included output subscript '" << output[i]
+                        << "' which never appeared in an input";
+                    throw Error<ValueError>(oss.str());
+                }
+            }
+        }
+
+        auto needed_by_others = [&terms, &output] (size_t i, size_t j) -> std::string {
+            std::string needed = output;
+            for (size_t k = 0; k < terms.size(); ++k) {
+                if ((k != i) && (k != j)) {
+                    needed += terms[k].labels;
+                }
+            }
+            return needed;
+        };
+
+        for (size_t i = 0; i < terms.size(); ++i) {
+            terms[i] = einsum_reduce(einsum_diagonal(std::move(terms[i])), needed_by_others(i, i));
+        }
+
+        // Greedy ordering: contract the pair whose iteration space is smallest, then the one with smallest result.
+        while (terms.size() > 1) {
+            size_t best_i = 0, best_j = 1;
+            double best_cost = -1, best_size = -1;
+            for (size_t i = 0; i < terms.size(); ++i) {
+                for (size_t j = i + 1; j < terms.size(); ++j) {
+                    auto needed = needed_by_others(i, j);
+                    double cost = 1, size = 1;
+                    for (char c = 'A'; c <= 'z'; ++c) {
+                        bool in_i = terms[i].labels.find(c) != std::string::npos;
+                        bool in_j = terms[j].labels.find(c) != std::string::npos;
+                        if (in_i || in_j) {
+                            cost *= dims[static_cast<int>(c)];
+                            if (needed.find(c) != std::string::npos) {
+                                size *= dims[static_cast<int>(c)];
+                            }
+                        }
+                    }
+                    if ((best_cost < 0) || (cost < best_cost) || ((cost == best_cost) && (size < best_size))) {
+                        best_i = i;
+                        best_j = j;
+                        best_cost = cost;
+                        best_size = size;
+                    }
+                }
+            }
+
+            auto needed = needed_by_others(best_i, best_j);
+            auto term = einsum_contract(std::move(terms[best_i]), std::move(terms[best_j]), needed);
+            terms.erase(std::next(terms.begin(), best_j));
+            terms[best_i] = std::move(term);
+        }
+
+        auto term = einsum_permute(einsum_reduce(std::move(terms.front()), output), output);
+        return ndarray(std::move(term.shape), make_data(std::move(term.values)));
+    }
+
+    Shape shape_;
+    Data data_;
+    mutable std::atomic<int> flags_{UNKNOWN_LAYOUT};
+};
+
+template<class T>
+struct ndarray<T>::linalg {
+    /**
+     * LU decomposition with partial pivoting, a = p @ l @ u (scipy.linalg.lu).
+     */
+    static std::tuple<ndarray, ndarray, ndarray> lu(const ndarray &a) {
+        int n = check_square(a);
+        auto values = a.values();
+        std::vector<T> p(values.size(), T()), l(values.size(), T()), u(values.size(), T());
+        for_each_matrix(a, [&] (size_t offset) {
+            std::vector<int> piv(n);
+            getrf(n, values.data() + offset, piv.data());
+            auto perm = permutation(n, piv.data());
+            for (int i = 0; i < n; ++i) {
+                p[offset + static_cast<size_t>(perm[i]) * n + i] = T(1);
+                for (int j = 0; j < n; ++j) {
+                    const T &value = values[offset + static_cast<size_t>(i) * n + j];
+                    if (j < i) {
+                        l[offset + static_cast<size_t>(i) * n + j] = value;
+                    } else {
+                        u[offset + static_cast<size_t>(i) * n + j] = value;
+                    }
+                }
+                l[offset + static_cast<size_t>(i) * n + i] = T(1);
+            }
+        });
+        return std::make_tuple(
+                ndarray(a.shape_, make_data(std::move(p))),
+                ndarray(a.shape_, make_data(std::move(l))),
+                ndarray(a.shape_, make_data(std::move(u))));
+    }
+
+    /**
+     * Lower triangular l with a = l @ l.T, for symmetric positive definite a.
+     */
+    static ndarray cholesky(const ndarray &a) {
+        int n = check_square(a);
+        auto values = a.values();
+        std::atomic<bool> failed(false);
+        for_each_matrix(a, [&] (size_t offset) {
+            if (!potrf(n, values.data() + offset)) {
+                failed = true;
+            }
+        });
+        if (failed) {
+            throw Error<LinAlgError>("Matrix is not positive definite");
+        }
+        return ndarray(a.shape_, make_data(std::move(values)));
+    }
+
+    /**
+     * Solve a @ x = b, where b is (..., M) or (..., M, K) with the same leading dimensions as a.
+     */
+    static ndarray solve(const ndarray &a, const ndarray &b) {
+        int n = check_square(a);
+        bool is_vector = (b.ndim() == a.ndim() - 1);
+        Shape batch(a.shape_.begin(), std::prev(a.shape_.end(), 2));
+        Shape expected = batch;
+        expected.push_back(n);
+        if (!is_vector) {
+            expected.push_back(b.ndim() > 0 ? b.shape_.back() : 0);
+        }
+        if (b.shape_ != expected) {
+            std::ostringstream oss;
+            oss << "solve: input operand 1 has a mismatch in its core dimension 0, with shape ";
+            dump_shape(oss, b.shape_);
+            oss << " (size " << n << " is different from " << (b.ndim() > 0 ? b.shape_[b.ndim() - (is_vector ? 1 : 2)] : 0) << ")";
+            throw Error<ValueError>(oss.str());
+        }
+
+        int k = is_vector ? 1 : b.shape_.back();
+        auto lu_values = a.values(), x = b.values();
+        std::atomic<bool> singular(false);
+        for_each_matrix(a, [&] (size_t offset) {
+            std::vector<int> piv(n);
+            if (getrf(n, lu_values.data() + offset, piv.data()) != -1) {
+                singular = true;
+                return;
+            }
+            getrs(n, k, lu_values.data() + offset, piv.data(), x.data() + offset / n * k);
+        });
+        if (singular) {
+            throw Error<LinAlgError>("Singular matrix");
+        }
+        return ndarray(b.shape_, make_data(std::move(x)));
+    }
+
+    static ndarray inv(const ndarray &a) {
+        int n = check_square(a);
+        std::vector<T> eye(a.size(), T());
+        for (size_t offset = 0; offset < eye.size(); offset += static_cast<size_t>(n) * n) {
+            for (int i = 0; i < n; ++i) {
+                eye[offset + static_cast<size_t>(i) * n + i] = T(1);
+            }
+        }
+        return solve(a, ndarray(a.shape_, make_data(std::move(eye))));
+    }
+
+    /**
+     * Determinant from the LU diagonal, one value per matrix of the batch.
+     */
+    static ndarray det(const ndarray &a) {
+        int n = check_square(a);
+        auto values = a.values();
+        Shape batch(a.shape_.begin(), std::prev(a.shape_.end(), 2));
+        std::vector<T> dets(get_size(batch));
+        for_each_matrix(a, [&] (size_t offset) {
+            std::vector<int> piv(n);
+            T det = T(1);
+            if (getrf(n, values.data() + offset, piv.data()) != -1) {
+                det = T();
+            } else {
+                for (int i = 0; i < n; ++i) {
+                    det *= values[offset + static_cast<size_t>(i) * n + i] * ((piv[i] != i) ? T(-1) : T(1));
+                }
+            }
+            dets[offset / (static_cast<size_t>(n) * n)] = det;
+        });
+        return ndarray(std::move(batch), make_data(std::move(dets)));
+    }
+
+private:
+    static_assert(std::is_floating_point<T>::value, "linalg requires a floating point dtype");
+
+    // Panel width of the blocked factorizations.
+    static constexpr int NB = 64;
+
+    static int check_square(const ndarray &a) {
+        if (a.ndim() < 2) {
+            std::ostringstream oss;
+            oss << a.ndim() << "-dimensional array given. Array must be at least two-dimensional";
+            throw Error<LinAlgError>(oss.str());
+        }
+        int n = a.shape_.back();
+        if (a.shape_[a.ndim() - 2] != n) {
+            throw Error<LinAlgError>("Last 2 dimensions of the array must be square");
+        }
+        return n;
+    }
+
+    /**
+     * Call f(offset) for every matrix of the batch; small matrices are spread over threads,
+     * large ones parallelize inside their own kernels instead.
+     */
+    template<class F>
+    static void for_each_matrix(const ndarray &a, F f) {
+        int n = a.shape_.back();
+        size_t matrix_size = static_cast<size_t>(n) * n;
+        int count = (matrix_size == 0) ? 0 : a.size() / matrix_size;
+        int grain = (n > NB) ? count : std::max(1, (NB * NB) / std::max(1, n * n));
+        parallel_for(count, grain, [&] (int begin, int end) {
+            for (int i = begin; i < end; ++i) {
+                f(i * matrix_size);
+            }
+        });
+    }
+
+    /**
+     * Row permutation recorded by getrf: original row perm[i] ends up at row i.
+     */
+    static std::vector<int> permutation(int n, const int *piv) {
+        std::vector<int> perm(n);
+        std::iota(perm.begin(), perm.end(), 0);
+        for (int i = 0; i < n; ++i) {
+            std::swap(perm[i], perm[piv[i]]);
+        }
+        return perm;
+    }
+
+    /**
+     * Blocked right-looking LU with partial pivoting, in place, LAPACK getrf style.
+     *
+     * Row i was swapped with row piv[i]. Returns the index of the first zero pivot, or -1.
+     */
+    static int getrf(int n, T *a, int *piv) {
+        int info = -1;
+        for (int k0 = 0; k0 < n; k0 += NB) {
+            int k1 = std::min(n, k0 + NB), kb = k1 - k0;
+
+            // Unblocked factorization of the panel a[k0:, k0:k1], swapping whole rows.
+            for (int j = k0; j < k1; ++j) {
+                int p = j;
+                for (int i = j + 1; i < n; ++i) {
+                    if (std::abs(a[static_cast<size_t>(i) * n + j]) > std::abs(a[static_cast<size_t>(p) * n + j])) {
+                        p = i;
+                    }
+                }
+                piv[j] = p;
+                if (p != j) {
+                    std::swap_ranges(a + static_cast<size_t>(j) * n, a + static_cast<size_t>(j + 1) * n,
+                            a + static_cast<size_t>(p) * n);
+                }
+                const T pivot = a[static_cast<size_t>(j) * n + j];
+                if (pivot == T()) {
+                    info = (info == -1) ? j : info;
+                    continue;
+                }
+                for (int i = j + 1; i < n; ++i) {
+                    T *row = a + static_cast<size_t>(i) * n;
+                    row[j] /= pivot;
+                    for (int c = j + 1; c < k1; ++c) {
+                        row[c] -= row[j] * a[static_cast<size_t>(j) * n + c];
+                    }
+                }
+            }
+            if (k1 == n) {
+                break;
+            }
+
+            // a[k0:k1, k1:] = inv(l11) @ a[k0:k1, k1:], columns split across threads.
+            parallel_for(n - k1, std::max(1, (1 << 16) / (kb * kb)), [=] (int begin, int end) {
+                for (int j = k0; j < k1; ++j) {
+                    for (int i = j + 1; i < k1; ++i) {
+                        const T lij = a[static_cast<size_t>(i) * n + j];
+                        T *row = a + static_cast<size_t>(i) * n + k1;
+                        const T *pivot_row = a + static_cast<size_t>(j) * n + k1;
+                        for (int c = begin; c < end; ++c) {
+                            row[c] -= lij * pivot_row[c];
+                        }
+                    }
+                }
+            });
+
+            // a[k1:, k1:] -= a[k1:, k0:k1] @ a[k0:k1, k1:]
+            int m = n - k1;
+            std::vector<T> l21(static_cast<size_t>(m) * kb);
+            for (int i = 0; i < m; ++i) {
+                for (int j = 0; j < kb; ++j) {
+                    l21[static_cast<size_t>(i) * kb + j] = -a[static_cast<size_t>(k1 + i) * n + k0 + j];
+                }
+            }
+            gemm(m, m, kb, l21.data(), kb, a + static_cast<size_t>(k0) * n + k1, n,
+                    a + static_cast<size_t>(k1) * n + k1, n);
+        }
+        return info;
+    }
+
+    /**
+     * Solve with the getrf factorization, b is (n, k) row-major and overwritten with x.
+     */
+    static void getrs(int n, int k, const T *lu, const int *piv, T *b) {
+        for (int i = 0; i < n; ++i) {
+            if (piv[i] != i) {
+                std::swap_ranges(b + static_cast<size_t>(i) * k, b + static_cast<size_t>(i + 1) * k,
+                        b + static_cast<size_t>(piv[i]) * k);
+            }
+        }
+        for (int i = 0; i < n; ++i) {
+            T *row = b + static_cast<size_t>(i) * k;
+            for (int j = 0; j < i; ++j) {
+                const T lij = lu[static_cast<size_t>(i) * n + j];
+                const T *other = b + static_cast<size_t>(j) * k;
+                for (int c = 0; c < k; ++c) {
+                    row[c] -= lij * other[c];
+                }
+            }
+        }
+        for (int i = n - 1; i >= 0; --i) {
+            T *row = b + static_cast<size_t>(i) * k;
+            for (int j = i + 1; j < n; ++j) {
+                const T uij = lu[static_cast<size_t>(i) * n + j];
+                const T *other = b + static_cast<size_t>(j) * k;
+                for (int c = 0; c < k; ++c) {
+                    row[c] -= uij * other[c];
+                }
+            }
+            const T uii = lu[static_cast<size_t>(i) * n + i];
+            for (int c = 0; c < k; ++c) {
+                row[c] /= uii;
+            }
+        }
+    }
+
+    /**
+     * Blocked right-looking Cholesky, in place, leaving l in the lower triangle and zeros above.
+     *
+     * Returns false when a is not positive definite.
+     */
+    static bool potrf(int n, T *a) {
+        for (int k0 = 0; k0 < n; k0 += NB) {
+            int k1 = std::min(n, k0 + NB), kb = k1 - k0;
+
+            for (int j = k0; j < k1; ++j) {
+                T *row_j = a + static_cast<size_t>(j) * n;
+                T d = row_j[j];
+                for (int p = k0; p < j; ++p) {
+                    d -= row_j[p] * row_j[p];
+                }
+                if (!(d > T())) {
+                    return false;
+                }
+                row_j[j] = std::sqrt(d);
+                for (int i = j + 1; i < k1; ++i) {
+                    T *row_i = a + static_cast<size_t>(i) * n;
+                    T sum = row_i[j];
+                    for (int p = k0; p < j; ++p) {
+                        sum -= row_i[p] * row_j[p];
+                    }
+                    row_i[j] = sum / row_j[j];
+                }
+            }
+            if (k1 == n) {
+                break;
+            }
+
+            // l21 = a21 @ inv(l11).T, rows split across threads.
+            int m = n - k1;
+            parallel_for(m, std::max(1, (1 << 16) / (kb * kb)), [=] (int begin, int end) {
+                for (int i = k1 + begin; i < k1 + end; ++i) {
+                    T *row_i = a + static_cast<size_t>(i) * n;
+                    for (int j = k0; j < k1; ++j) {
+                        const T *row_j = a + static_cast<size_t>(j) * n;
+                        T sum = row_i[j];
+                        for (int p = k0; p < j; ++p) {
+                            sum -= row_i[p] * row_j[p];
+                        }
+                        row_i[j] = sum / row_j[j];
+                    }
+                }
+            });
+
+            // a22 -= l21 @ l21.T
+            std::vector<T> l21(static_cast<size_t>(m) * kb), l21t(static_cast<size_t>(kb) * m);
+            for (int i = 0; i < m; ++i) {
+                for (int j = 0; j < kb; ++j) {
+                    const T value = a[static_cast<size_t>(k1 + i) * n + k0 + j];
+                    l21[static_cast<size_t>(i) * kb + j] = -value;
+                    l21t[static_cast<size_t>(j) * m + i] = value;
+                }
+            }
+            gemm(m, m, kb, l21.data(), kb, l21t.data(), m, a + static_cast<size_t>(k1) * n + k1, n);
+        }
+
+        for (int i = 0; i < n; ++i) {
+            std::fill(a + static_cast<size_t>(i) * n + i + 1, a + static_cast<size_t>(i + 1) * n, T());
+        }
+        return true;
+    }
+};
+
+template<class T>
+struct ndarray<T>::blas {
+    /**
+     * x . y of 1-D x and y (ddot); complex operands are not conjugated.
+     */
+    static T dot(const ndarray &x, const ndarray &y) {
+        check_vector(x);
+        check_vector(y);
+        if (x.size() != y.size()) {
+            throw not_aligned(x.shape_, y.shape_, 0, 0);
+        }
+        std::vector<T> xs, ys;
+        const T *xp = x.row_major_values(xs), *yp = y.row_major_values(ys);
+        return static_cast<T>(reduce_chunks<Acc>(x.size(), [xp, yp] (int begin, int end) -> Acc {
+            return dot_kernel(xp + begin, yp + begin, end - begin);
+        }));
+    }
+
+    /**
+     * y += a * x in place (daxpy); y may be a view.
+     */
+    static void axpy(const T &a, const ndarray &x, ndarray &y) {
+        check_vector(x);
+        check_vector(y);
+        if (x.size() != y.size()) {
+            throw not_aligned(x.shape_, y.shape_, 0, 0);
+        }
+        std::vector<T> xs;
+        const T *xp = x.may_alias(y) ? (xs = x.values()).data() : x.row_major_values(xs);
+        const Acc alpha = static_cast<Acc>(a);
+        update(y, [xp, alpha] (int i, const T &yi) -> T {
+            return static_cast<T>(static_cast<Acc>(yi) + alpha * static_cast<Acc>(xp[i]));
+        });
+    }
+
+    /**
+     * x *= a in place (dscal); x may be a view.
+     */
+    static void scal(const T &a, ndarray &x) {
+        check_vector(x);
+        const Acc alpha = static_cast<Acc>(a);
+        update(x, [alpha] (int, const T &xi) -> T {
+            return static_cast<T>(alpha * static_cast<Acc>(xi));
+        });
+    }
+
+    /**
+     * Euclidean norm of 1-D x (dnrm2), rescaled by max |x| when the plain sum of squares overflows or
+     * underflows.
+     */
+    static real_type nrm2(const ndarray &x) {
+        check_vector(x);
+        std::vector<T> xs;
+        const T *xp = x.row_major_values(xs);
+        const int n = x.size();
+        Real sum = reduce_chunks<Real>(n, [xp] (int begin, int end) -> Real {
+            return sumsq_kernel(xp + begin, end - begin, Real(1));
+        });
+        if (std::isfinite(sum) && (sum >= std::numeric_limits<Real>::min())) {
+            return static_cast<real_type>(std::sqrt(sum));
+        }
+
+        Real scale = 0;
+        for (int i = 0; i < n; ++i) {
+            scale = std::max(scale, static_cast<Real>(std::abs(static_cast<Acc>(xp[i]))));
+        }
+        if ((scale == 0) || !std::isfinite(scale)) {
+            return static_cast<real_type>(scale);
+        }
+        sum = reduce_chunks<Real>(n, [xp, scale] (int begin, int end) -> Real {
+            return sumsq_kernel(xp + begin, end - begin, 1 / scale);
+        });
+        return static_cast<real_type>(scale * std::sqrt(sum));
+    }
+
+    /**
+     * Sum of |x| over 1-D x (dasum); |re| + |im| for complex elements, as in BLAS.
+     */
+    static real_type asum(const ndarray &x) {
+        check_vector(x);
+        std::vector<T> xs;
+        const T *xp = x.row_major_values(xs);
+        return static_cast<real_type>(reduce_chunks<Real>(x.size(), [xp] (int begin, int end) -> Real {
+            Real s[LANES] = {};
+            int i = begin;
+            for (; i + LANES <= end; i += LANES) {
+                for (int j = 0; j < LANES; ++j) {
+                    s[j] += abs1(static_cast<Acc>(xp[i + j]));
+                }
+            }
+            for (int j = 0; i < end; ++i, ++j) {
+                s[j] += abs1(static_cast<Acc>(xp[i]));
+            }
+            return combine(s);
+        }));
+    }
+
+    /**
+     * alpha * a @ x, or alpha * a.T @ x with trans (dgemv), for 2-D a and 1-D x.
+     */
+    static ndarray gemv(const T &alpha, const ndarray &a, const ndarray &x, bool trans = false) {
+        return gemv_impl(alpha, a, x, T(), nullptr, trans);
+    }
+
+    /**
+     * alpha * op(a) @ x + beta * y; y is not read when beta is 0.
+     */
+    static ndarray gemv(const T &alpha, const ndarray &a, const ndarray &x, const T &beta, const ndarray &y, bool trans = false) {
+        return gemv_impl(alpha, a, x, beta, &y, trans);
+    }
+
+private:
+    typedef typename accumulator_traits<T>::type Acc;
+    typedef typename complex_traits<Acc>::real_type Real;
+
+    // Independent accumulators per kernel, enough to cover the FMA latency.
+    static constexpr int LANES = 8;
+    // Elements per task when splitting long vectors across threads.
+    static constexpr int GRAIN = 1 << 16;
+
+    static void check_vector(const ndarray &x) {
+        if (x.ndim() != 1) {
+            throw Error<ValueError>("expected a 1-D array");
+        }
+    }
+
+    static Error<ValueError> not_aligned(const Shape &lhs, const Shape &rhs, int ldim, int rdim) {
+        std::ostringstream oss;
+        oss << "shapes ";
+        dump_shape(oss, lhs);
+        oss << " and ";
+        dump_shape(oss, rhs);
+        oss << " not aligned: " << lhs[ldim] << " (dim " << ldim << ") != " << rhs[rdim] << " (dim " << rdim << ")";
+        return Error<ValueError>(oss.str());
+    }
+
+    /**
+     * Sum of f(begin, end) over chunks of GRAIN elements, the chunks spread across threads.
+     */
+    template<class R, class F>
+    static R reduce_chunks(int n, F f) {
+        const int num_chunks = std::max(1, (n + GRAIN - 1) / GRAIN);
+        std::vector<R> partial(num_chunks, R());
+        parallel_for(num_chunks, 1, [&partial, &f, n] (int begin, int end) {
+            for (int c = begin; c < end; ++c) {
+                partial[c] = f(c * GRAIN, std::min(n, (c + 1) * GRAIN));
+            }
+        });
+        R total = R();
+        for (const R &value : partial) {
+            total += value;
+        }
+        return total;
+    }
+
+    /**
+     * x[i] = f(i, x[i]), in place when x is contiguous, else through its element pointers.
+     */
+    template<class F>
+    static void update(ndarray &x, F f) {
+        T *flat = x.contiguous_data();
+        const Value *handles = x.data_.data();
+        parallel_for(x.size(), GRAIN, [flat, handles, &f] (int begin, int end) {
+            if (flat != nullptr) {
+                for (int i = begin; i < end; ++i) {
+                    flat[i] = f(i, flat[i]);
+                }
+            } else {
+                for (int i = begin; i < end; ++i) {
+                    *handles[i] = f(i, *handles[i]);
+                }
+            }
+        });
+    }
+
+    template<class U>
+    static U combine(const U (&s)[LANES]) {
+        return ((s[0] + s[1]) + (s[2] + s[3])) + ((s[4] + s[5]) + (s[6] + s[7]));
+    }
+
+    template<class U>
+    static Real abs1(const U &x) {
+        return std::abs(x);
+    }
+
+    template<class R>
+    static Real abs1(const std::complex<R> &x) {
+        return std::abs(x.real()) + std::abs(x.imag());
+    }
+
+    template<class U>
+    static Acc dot_kernel(const U *x, const U *y, int n) {
+        Acc s[LANES] = {};
+        int i = 0;
+        for (; i + LANES <= n; i += LANES) {
+            for (int j = 0; j < LANES; ++j) {
+                s[j] += static_cast<Acc>(x[i + j]) * static_cast<Acc>(y[i + j]);
+            }
+        }
+        for (int j = 0; i < n; ++i, ++j) {
+            s[j] += static_cast<Acc>(x[i]) * static_cast<Acc>(y[i]);
+        }
+        return combine(s);
+    }
+
+#if defined(__FMA__) && defined(__AVX__)
+    static double dot_kernel(const double *x, const double *y, int n) {
+        __m256d s[4] = {_mm256_setzero_pd(), _mm256_setzero_pd(), _mm256_setzero_pd(), _mm256_setzero_pd()};
+        int i = 0;
+        for (; i + 16 <= n; i += 16) {
+            for (int j = 0; j < 4; ++j) {
+                s[j] = _mm256_fmadd_pd(_mm256_loadu_pd(x + i + 4 * j), _mm256_loadu_pd(y + i + 4 * j), s[j]);
+            }
+        }
+        alignas(32) double lanes[4];
+        _mm256_store_pd(lanes, _mm256_add_pd(_mm256_add_pd(s[0], s[1]), _mm256_add_pd(s[2], s[3])));
+        double sum = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+        for (; i < n; ++i) {
+            sum = std::fma(x[i], y[i], sum);
+        }
+        return sum;
+    }
+
+    static float dot_kernel(const float *x, const float *y, int n) {
+        __m256 s[4] = {_mm256_setzero_ps(), _mm256_setzero_ps(), _mm256_setzero_ps(), _mm256_setzero_ps()};
+        int i = 0;
+        for (; i + 32 <= n; i += 32) {
+            for (int j = 0; j < 4; ++j) {
+                s[j] = _mm256_fmadd_ps(_mm256_loadu_ps(x + i + 8 * j), _mm256_loadu_ps(y + i + 8 * j), s[j]);
+            }
+        }
+        alignas(32) float lanes[8];
+        _mm256_store_ps(lanes, _mm256_add_ps(_mm256_add_ps(s[0], s[1]), _mm256_add_ps(s[2], s[3])));
+        float sum = ((lanes[0] + lanes[1]) + (lanes[2] + lanes[3])) + ((lanes[4] + lanes[5]) + (lanes[6] + lanes[7]));
+        for (; i < n; ++i) {
+            sum = std::fma(x[i], y[i], sum);
+        }
+        return sum;
+    }
+#endif
+
+    static Real sumsq_kernel(const T *x, int n, Real scale) {
+        Real s[LANES] = {};
+        int i = 0;
+        for (; i + LANES <= n; i += LANES) {
+            for (int j = 0; j < LANES; ++j) {
+                s[j] += std::norm(static_cast<Acc>(x[i + j]) * scale);
+            }
+        }
+        for (int j = 0; i < n; ++i, ++j) {
+            s[j] += std::norm(static_cast<Acc>(x[i]) * scale);
+        }
+        return combine(s);
+    }
+
+    static ndarray gemv_impl(const T &alpha, const ndarray &a, const ndarray &x, const T &beta, const ndarray *y, bool trans) {
+        if (a.ndim() != 2) {
+            throw Error<ValueError>("expected a 2-D array");
+        }
+        check_vector(x);
+        const int rows = a.shape_[0], cols = a.shape_[1];
+        if ((trans ? rows : cols) != x.size()) {
+            throw not_aligned(a.shape_, x.shape_, trans ? 0 : 1, 0);
+        }
+        const int m = trans ? cols : rows;
+        const bool accumulate = (y != nullptr) && (beta != T());
+        if (accumulate && (y->shape_ != Shape{m})) {
+            std::ostringstream oss;
+            oss << "y has shape ";
+            dump_shape(oss, y->shape_);
+            oss << ", expected (" << m << ",)";
+            throw Error<ValueError>(oss.str());
+        }
+
+        std::vector<T> as, xs, ys;
+        const T *ap = a.row_major_values(as), *xp = x.row_major_values(xs);
+        const T *yp = accumulate ? y->row_major_values(ys) : nullptr;
+        const Acc scale = static_cast<Acc>(alpha), shift = static_cast<Acc>(beta);
+        Buffer values(m);
+        T *out = values.data();
+        auto finish = [=] (int i, const Acc &sum) -> T {
+            return static_cast<T>(accumulate ? scale * sum + shift * static_cast<Acc>(yp[i]) : scale * sum);
+        };
+
+        if (!trans) {
+            // One dot product per row.
+            parallel_for(m, std::max(1, GRAIN / std::max(1, cols)), [=] (int begin, int end) {
+                for (int i = begin; i < end; ++i) {
+                    out[i] = finish(i, dot_kernel(ap + static_cast<long long>(i) * cols, xp, cols));
+                }
+            });
+        } else {
+            // Blocks of output columns, each accumulating x[i] * a[i, block] row after row.
+            constexpr int BLOCK = 512;
+            const int num_blocks = (m + BLOCK - 1) / BLOCK;
+            parallel_for(num_blocks, std::max(1, GRAIN / std::max(1, rows * BLOCK)), [=] (int begin, int end) {
+                std::vector<Acc> sum(BLOCK);
+                for (int b = begin; b < end; ++b) {
+                    const int first = b * BLOCK, count = std::min(BLOCK, m - first);
+                    std::fill(sum.begin(), sum.end(), Acc());
+                    for (int i = 0; i < rows; ++i) {
+                        const Acc xi = static_cast<Acc>(xp[i]);
+                        const T *row = ap + static_cast<long long>(i) * cols + first;
+                        for (int j = 0; j < count; ++j) {
+                            sum[j] += static_cast<Acc>(row[j]) * xi;
+                        }
+                    }
+                    for (int j = 0; j < count; ++j) {
+                        out[first + j] = finish(first + j, sum[j]);
+                    }
+                }
+            });
+        }
+        return ndarray({m}, make_data(std::move(values)));
+    }
+};
+
+template<class T>
+class ndarray<T>::random {
+public:
+    explicit random(uint64_t seed = 0) : philox_(seed) {
+    }
+
+    /**
+     * Samples of U[low, high) (np.random.default_rng(seed).uniform(low, high, shape)).
+     *
+     * float takes 24 bits per draw and double 53, from one or two 32-bit words.
+     */
+    ndarray uniform(const std::vector<int> &shape, T low = T(0), T high = T(1)) {
+        static_assert(std::is_floating_point<T>::value, "uniform requires a floating point dtype");
+        constexpr int PER_BLOCK = (sizeof(T) <= 4) ? 4 : 2;
+        return fill(shape, PER_BLOCK, [low, high] (const Philox::Block &block, T *out, int count) {
+            for (int i = 0; i < count; ++i) {
+                out[i] = low + (high - low) * static_cast<T>(unit(block, i, PER_BLOCK));
+            }
+        });
+    }
+
+    /**
+     * Samples of N(loc, scale^2) by the Box-Muller transform, one pair of normals per block.
+     *
+     * Uniforms are drawn for a batch of blocks first so the transcendental loop runs branch-free. Box-Muller
+     * consumes exactly one block per pair, keeping the counter of every element fixed; a ziggurat's
+     * rejections would not.
+     */
+    ndarray normal(const std::vector<int> &shape, T loc = T(0), T scale = T(1)) {
+        static_assert(std::is_floating_point<T>::value, "normal requires a floating point dtype");
+        const Philox philox = philox_;
+        const uint64_t stream = stream_++;
+        std::vector<T> values(get_size(shape));
+        T *out = values.data();
+        const int size = values.size();
+        const int num_pairs = (size + 1) / 2;
+        constexpr int BATCH = 64;
+        parallel_for((num_pairs + BATCH - 1) / BATCH, std::max(1, (1 << 12) / BATCH), [=] (int begin, int end) {
+            double u1[BATCH], u2[BATCH], z0[BATCH], z1[BATCH];
+            for (int b = begin; b < end; ++b) {
+                const int first = b * BATCH, count = std::min(BATCH, num_pairs - first);
+                for (int i = 0; i < count; ++i) {
+                    auto block = philox(first + i, stream);
+                    u1[i] = 1. - unit(block, 0, 2);
+                    u2[i] = unit(block, 1, 2);
+                }
+                for (int i = 0; i < count; ++i) {
+                    const double r = std::sqrt(-2. * std::log(u1[i])), theta = 2. * M_PI * u2[i];
+                    z0[i] = r * std::cos(theta);
+                    z1[i] = r * std::sin(theta);
+                }
+                for (int i = 0; i < count; ++i) {
+                    const int k = 2 * (first + i);
+                    out[k] = loc + scale * static_cast<T>(z0[i]);
+                    if (k + 1 < size) {
+                        out[k + 1] = loc + scale * static_cast<T>(z1[i]);
+                    }
+                }
+            }
+        });
+        return ndarray(shape, make_data(std::move(values)));
+    }
+
+    /**
+     * Integers in [low, high) (np.random.default_rng(seed).integers(low, high, shape)).
+     *
+     * A 64-bit draw is scaled to the range by a multiply-high rather than rejected, so every element still
+     * costs exactly half a block; the bias is at most (high - low) / 2^64.
+     */
+    ndarray integers(const std::vector<int> &shape, T low, T high) {
+        static_assert(std::is_integral<T>::value, "integers requires an integral dtype");
+        if (!(low < high)) {
+            throw Error<ValueError>("high <= low");
+        }
+        const uint64_t range = static_cast<uint64_t>(high) - static_cast<uint64_t>(low);
+        return fill(shape, 2, [low, range] (const Philox::Block &block, T *out, int count) {
+            for (int i = 0; i < count; ++i) {
+                const uint64_t bits = (static_cast<uint64_t>(block.words[2 * i]) << 32) | block.words[2 * i + 1];
+#ifdef __SIZEOF_INT128__
+                const uint64_t offset = static_cast<uint64_t>((static_cast<unsigned __int128>(bits) * range) >> 64);
+#else
+                const uint64_t offset = bits % range;
+#endif
+                out[i] = static_cast<T>(static_cast<uint64_t>(low) + offset);
+            }
+        });
+    }
+
+    /**
+     * A random permutation of arange(n).
+     *
+     * Every index gets a 64-bit key from its own counter and the indices are sorted by key, which needs no
+     * sequential Fisher-Yates pass.
+     */
+    ndarray permutation(int n) {
+        auto order = shuffled_order(n);
+        return ndarray({n}, make_data(std::vector<T>(order.begin(), order.end())));
+    }
+
+    /**
+     * a with its rows (entries along axis 0) in random order.
+     */
+    ndarray permutation(const ndarray &a) {
+        if (a.ndim() == 0) {
+            throw Error<ValueError>("x must be an integer or at least 1-dimensional");
+        }
+        const int n = a.len();
+        const int inner = n ? a.size() / n : 0;
+        auto order = shuffled_order(n);
+        auto values = a.values();
+        std::vector<T> result(values.size());
+        parallel_for(n, std::max(1, (1 << 15) / std::max(1, inner)), [&] (int begin, int end) {
+            for (int i = begin; i < end; ++i) {
+                std::copy(std::next(values.begin(), static_cast<size_t>(order[i]) * inner),
+                        std::next(values.begin(), static_cast<size_t>(order[i] + 1) * inner),
+                        std::next(result.begin(), static_cast<size_t>(i) * inner));
+            }
+        });
+        return ndarray(a.shape_, make_data(std::move(result)));
+    }
+
+private:
+    /**
+     * Uniform double in [0, 1) from the i-th of the per_block draws of block.
+     */
+    static double unit(const Philox::Block &block, int i, int per_block) {
+        if (per_block == 4) {
+            return (block.words[i] >> 8) * (1. / (1 << 24));
+        }
+        const uint64_t bits = (static_cast<uint64_t>(block.words[2 * i]) << 32) | block.words[2 * i + 1];
+        return (bits >> 11) * (1. / (1ULL << 53));
+    }
+
+    /**
+     * Generate an array of shape on a fresh stream, element i coming from block i / per_block:
+     * kernel(block, out, count) writes the count <= per_block elements of one block.
+     */
+    template<class Kernel>
+    ndarray fill(const std::vector<int> &shape, int per_block, Kernel kernel) {
+        const Philox philox = philox_;
+        const uint64_t stream = stream_++;
+        std::vector<T> values(get_size(shape));
+        T *out = values.data();
+        const int size = values.size();
+        parallel_for((size + per_block - 1) / per_block, 1 << 12, [=] (int begin, int end) {
+            for (int b = begin; b < end; ++b) {
+                const int first = b * per_block;
+                kernel(philox(b, stream), out + first, std::min(per_block, size - first));
+            }
+        });
+        return ndarray(shape, make_data(std::move(values)));
+    }
+
+    std::vector<int> shuffled_order(int n) {
+        if (n < 0) {
+            throw Error<ValueError>("negative dimensions are not allowed");
+        }
+        const Philox philox = philox_;
+        const uint64_t stream = stream_++;
+        std::vector<std::pair<uint64_t, int>> keys(n);
+        parallel_for((n + 1) / 2, 1 << 12, [&] (int begin, int end) {
+            for (int b = begin; b < end; ++b) {
+                auto block = philox(b, stream);
+                for (int i = 0; (i < 2) && (2 * b + i < n); ++i) {
+                    keys[2 * b + i] = std::make_pair((static_cast<uint64_t>(block.words[2 * i]) << 32) | block.words[2 * i + 1], 2 * b + i);
+                }
+            }
+        });
+        std::sort(keys.begin(), keys.end());
+        std::vector<int> order(n);
+        std::transform(keys.begin(), keys.end(), order.begin(), [] (const std::pair<uint64_t, int> &key) -> int {
+            return key.second;
+        });
+        return order;
+    }
+
+    Philox philox_;
+    // Every call draws from its own stream, i.e. the upper half of the counter.
+    uint64_t stream_ = 0;
+};
+
+template<class T>
+class ndarray<T>::lazy {
+public:
+    lazy(ndarray value) : node_(leaf(std::move(value))) {
+    }
+
+    const std::vector<int> &shape() const {
+        return node_->shape;
+    }
+
+    friend lazy operator+(const lazy &lhs, const lazy &rhs) {
+        return binary(lhs, rhs, OP_ADD);
+    }
+
+    friend lazy operator-(const lazy &lhs, const lazy &rhs) {
+        return binary(lhs, rhs, OP_SUB);
+    }
+
+    friend lazy operator*(const lazy &lhs, const lazy &rhs) {
+        return binary(lhs, rhs, OP_MUL);
+    }
+
+    friend lazy operator/(const lazy &lhs, const lazy &rhs) {
+        return binary(lhs, rhs, OP_DIV);
+    }
+
+    template<class U, class = typename std::enable_if<std::is_arithmetic<U>::value>::type>
+    friend lazy operator+(const lazy &lhs, const U &rhs) {
+        return binary(lhs, ndarray::scalar(static_cast<T>(rhs)), OP_ADD);
+    }
+
+    template<class U, class = typename std::enable_if<std::is_arithmetic<U>::value>::type>
+    friend lazy operator+(const U &lhs, const lazy &rhs) {
+        return binary(ndarray::scalar(static_cast<T>(lhs)), rhs, OP_ADD);
+    }
+
+    template<class U, class = typename std::enable_if<std::is_arithmetic<U>::value>::type>
+    friend lazy operator-(const lazy &lhs, const U &rhs) {
+        return binary(lhs, ndarray::scalar(static_cast<T>(rhs)), OP_SUB);
+    }
+
+    template<class U, class = typename std::enable_if<std::is_arithmetic<U>::value>::type>
+    friend lazy operator-(const U &lhs, const lazy &rhs) {
+        return binary(ndarray::scalar(static_cast<T>(lhs)), rhs, OP_SUB);
+    }
+
+    template<class U, class = typename std::enable_if<std::is_arithmetic<U>::value>::type>
+    friend lazy operator*(const lazy &lhs, const U &rhs) {
+        return binary(lhs, ndarray::scalar(static_cast<T>(rhs)), OP_MUL);
+    }
+
+    template<class U, class = typename std::enable_if<std::is_arithmetic<U>::value>::type>
+    friend lazy operator*(const U &lhs, const lazy &rhs) {
+        return binary(ndarray::scalar(static_cast<T>(lhs)), rhs, OP_MUL);
+    }
+
+    template<class U, class = typename std::enable_if<std::is_arithmetic<U>::value>::type>
+    friend lazy operator/(const lazy &lhs, const U &rhs) {
+        return binary(lhs, ndarray::scalar(static_cast<T>(rhs)), OP_DIV);
+    }
+
+    template<class U, class = typename std::enable_if<std::is_arithmetic<U>::value>::type>
+    friend lazy operator/(const U &lhs, const lazy &rhs) {
+        return binary(ndarray::scalar(static_cast<T>(lhs)), rhs, OP_DIV);
+    }
+
+    lazy operator-() const {
+        return binary(*this, ndarray::scalar(-1), OP_MUL);
+    }
+
+    static lazy matmul(const lazy &a, const lazy &b) {
+        return lazy(std::make_shared<Node>(MATMUL, OP_ADD, std::vector<std::shared_ptr<const Node>>{a.node_, b.node_},
+                matmul_shape(a.shape(), b.shape())));
+    }
+
+    ndarray eval() const {
+        return eval({*this}).front();
+    }
+
+    /**
+     * Evaluate several outputs of one graph together, sharing their common subexpressions.
+     *
+     * Every elementwise node consumed only by another elementwise node is fused into it; each fused
+     * group then runs as a single pass over its output, tile by tile, so its intermediates never exist
+     * as whole arrays. Groups and matmuls are scheduled on a pool of threads as soon as their inputs are
+     * ready, and a group's result is released as soon as its last consumer has finished. A task that runs
+     * alongside others runs its kernels' parallel_for inline; a task that is the only one runnable keeps it.
+     */
+    static std::vector<ndarray> eval(const std::vector<lazy> &outputs) {
+        Tracer::Span span("eval");
+
+        // Post-order walk, every node after its inputs; iterative so long chains don't exhaust the stack.
+        std::vector<const Node *> nodes;
+        std::map<const Node *, int> index;
+        for (const auto &output : outputs) {
+            std::vector<std::pair<const Node *, size_t>> stack = {{output.node_.get(), 0}};
+            while (!stack.empty()) {
+                auto &top = stack.back();
+                if (index.count(top.first) != 0) {
+                    stack.pop_back();
+                } else if (top.second < top.first->inputs.size()) {
+                    stack.emplace_back(top.first->inputs[top.second++].get(), 0);
+                } else {
+                    index[top.first] = nodes.size();
+                    nodes.push_back(top.first);
+                    stack.pop_back();
+                }
+            }
+        }
+
+        const int num_nodes = nodes.size();
+        std::vector<int> consumers(num_nodes, 0), consumer(num_nodes, -1);
+        std::vector<bool> is_output(num_nodes, false);
+        for (int i = 0; i < num_nodes; ++i) {
+            for (const auto &input : nodes[i]->inputs) {
+                ++consumers[index[input.get()]];
+                consumer[index[input.get()]] = i;
+            }
+        }
+        for (const auto &output : outputs) {
+            is_output[index[output.node_.get()]] = true;
+        }
+        std::vector<bool> fused(num_nodes, false);
+        for (int i = 0; i < num_nodes; ++i) {
+            fused[i] = (nodes[i]->kind == ELEMENTWISE) && (consumers[i] == 1) && !is_output[i]
+                    && (nodes[consumer[i]]->kind == ELEMENTWISE);
+        }
+
+        std::vector<Task> tasks;
+        std::vector<int> task_of(num_nodes, -1);
+        for (int i = 0; i < num_nodes; ++i) {
+            if ((nodes[i]->kind == LEAF) || fused[i]) {
+                continue;
+            }
+            Task task;
+            task.root = i;
+            std::map<int, int> slots;
+            if (nodes[i]->kind == MATMUL) {
+                for (const auto &input : nodes[i]->inputs) {
+                    task.inputs.push_back(index[input.get()]);
+                }
+            } else {
+                compile(nodes[i], index, fused, slots, task);
+            }
+            task_of[i] = tasks.size();
+            tasks.push_back(std::move(task));
+        }
+
+        // reads[i]: tasks still to read the result of node i, plus one if it is an output.
+        std::vector<int> reads(num_nodes, 0);
+        for (int t = 0; t < static_cast<int>(tasks.size()); ++t) {
+            auto distinct = tasks[t].inputs;
+            std::sort(distinct.begin(), distinct.end());
+            distinct.erase(std::unique(distinct.begin(), distinct.end()), distinct.end());
+            for (int input : distinct) {
+                if (task_of[input] != -1) {
+                    ++reads[input];
+                    ++tasks[t].pending;
+                    tasks[task_of[input]].dependents.push_back(t);
+                }
+            }
+            tasks[t].distinct_inputs = std::move(distinct);
+        }
+        for (int i = 0; i < num_nodes; ++i) {
+            reads[i] += is_output[i] ? 1 : 0;
+        }
+
+        // Held by pointer: assigning to an ndarray writes through into its elements.
+        std::vector<std::unique_ptr<ndarray>> results(num_nodes);
+        auto value_of = [&nodes, &results] (int i) -> const ndarray & {
+            return (nodes[i]->kind == LEAF) ? nodes[i]->value : *results[i];
+        };
+        auto run = [&] (const Task &task) {
+            std::vector<const ndarray *> inputs;
+            for (int input : task.inputs) {
+                inputs.push_back(&value_of(input));
+            }
+            const Node *root = nodes[task.root];
+            results[task.root].reset(new ndarray((root->kind == MATMUL)
+                    ? ndarray::matmul(*inputs[0], *inputs[1]) : run_fused(task, inputs, root->shape)));
+        };
+
+        std::mutex mutex;
+        std::condition_variable cv;
+        std::vector<int> ready;
+        for (int t = 0; t < static_cast<int>(tasks.size()); ++t) {
+            if (tasks[t].pending == 0) {
+                ready.push_back(t);
+            }
+        }
+        int remaining = tasks.size(), running = 0;
+        std::exception_ptr error;
+        auto worker = [&] () {
+            std::unique_lock<std::mutex> lock(mutex);
+            while (true) {
+                cv.wait(lock, [&] () -> bool { return !ready.empty() || (remaining == 0) || error; });
+                if ((remaining == 0) || error) {
+                    return;
+                }
+                const int t = ready.back();
+                ready.pop_back();
+                // The only runnable task keeps its kernels' parallel_for; tasks running side by side go serial.
+                const bool alone = ready.empty() && (running == 0);
+                ++running;
+                lock.unlock();
+                try {
+                    if (alone) {
+                        run(tasks[t]);
+                    } else {
+                        ParallelRegion region;
+                        run(tasks[t]);
+                    }
+                } catch (...) {
+                    lock.lock();
+                    error = std::current_exception();
+                    cv.notify_all();
+                    return;
+                }
+                lock.lock();
+                --running;
+                --remaining;
+                for (int d : tasks[t].dependents) {
+                    if (--tasks[d].pending == 0) {
+                        ready.push_back(d);
+                    }
+                }
+                for (int input : tasks[t].distinct_inputs) {
+                    if ((task_of[input] != -1) && (--reads[input] == 0)) {
+                        results[input].reset();
+                    }
+                }
+                cv.notify_all();
+            }
+        };
+
+        // No more workers than tasks sharing a depth in the task graph, so a plain chain runs on one thread.
+        std::vector<int> depth(tasks.size(), 0), width;
+        for (int t = 0; t < static_cast<int>(tasks.size()); ++t) {
+            for (int input : tasks[t].distinct_inputs) {
+                if (task_of[input] != -1) {
+                    depth[t] = std::max(depth[t], depth[task_of[input]] + 1);
+                }
+            }
+            width.resize(std::max<size_t>(width.size(), depth[t] + 1), 0);
+            ++width[depth[t]];
+        }
+        const int max_width = width.empty() ? 0 : *std::max_element(width.begin(), width.end());
+        int num_workers = std::min(max_width, std::max(1, static_cast<int>(std::thread::hardware_concurrency())));
+        const int scope = MemoryStats::active_scope();
+        std::vector<std::thread> threads;
+        for (int w = 1; w < num_workers; ++w) {
+            threads.emplace_back([&worker, scope] () {
+                MemoryStats::Scope stats(scope);
+                worker();
+            });
+        }
+        if (num_workers > 0) {
+            worker();
+        }
+        for (auto &thread : threads) {
+            thread.join();
+        }
+        if (error) {
+            std::rethrow_exception(error);
+        }
+
+        std::vector<ndarray> values;
+        for (const auto &output : outputs) {
+            values.push_back(value_of(index[output.node_.get()]));
+        }
+        return values;
+    }
+
+private:
+    enum Kind {
+        LEAF, ELEMENTWISE, MATMUL
+    };
+
+    struct Node {
+        Node(Kind kind, Operator op, std::vector<std::shared_ptr<const Node>> inputs, Shape shape)
+                : kind(kind), op(op), inputs(std::move(inputs)), shape(std::move(shape)) {
+        }
+
+        explicit Node(ndarray value) : kind(LEAF), op(OP_ADD), shape(value.shape_), value(std::move(value)) {
+        }
+
+        Kind kind;
+        Operator op;
+        std::vector<std::shared_ptr<const Node>> inputs;
+        Shape shape;
+        ndarray value;
+    };
+
+    /**
+     * A fused elementwise group or a matmul. The group's program holds one instruction per fused node,
+     * in post-order; an operand >= 0 names an input slot and ~i the result of instruction i.
+     */
+    struct Instruction {
+        Operator op;
+        int lhs;
+        int rhs;
+    };
+
+    struct Task {
+        int root = -1;
+        std::vector<int> inputs;
+        std::vector<int> distinct_inputs;
+        std::vector<Instruction> program;
+        std::vector<int> dependents;
+        int pending = 0;
+    };
+
+    explicit lazy(std::shared_ptr<const Node> node) : node_(std::move(node)) {
+    }
+
+    static std::shared_ptr<const Node> leaf(ndarray value) {
+        return std::make_shared<Node>(std::move(value));
+    }
+
+    static lazy binary(const lazy &lhs, const lazy &rhs, Operator op) {
+        Shape shape;
+        if (!broadcast_shapes(lhs.shape(), rhs.shape(), shape)) {
+            std::ostringstream oss;
+            oss << "operands could not be broadcast together with shapes ";
+            dump_shape(oss, lhs.shape());
+            oss << " ";
+            dump_shape(oss, rhs.shape());
+            throw Error<ValueError>(oss.str());
+        }
+        return lazy(std::make_shared<Node>(ELEMENTWISE, op, std::vector<std::shared_ptr<const Node>>{lhs.node_, rhs.node_},
+                std::move(shape)));
+    }
+
+    static Shape matmul_shape(const Shape &a, const Shape &b) {
+        if (a.empty() || b.empty()) {
+            std::ostringstream oss;
+            oss << "matmul: Input operand " << (a.empty() ? 0 : 1) << " does not have enough dimensions";
+            throw Error<ValueError>(oss.str());
+        }
+        Shape lshape = a, rshape = b;
+        if (a.size() == 1) {
+            lshape.insert(lshape.begin(), 1);
+        }
+        if (b.size() == 1) {
+            rshape.push_back(1);
+        }
+        Shape batch;
+        if ((rshape[rshape.size() - 2] != lshape.back()) || !broadcast_shapes(
+                Shape(lshape.begin(), std::prev(lshape.end(), 2)), Shape(rshape.begin(), std::prev(rshape.end(), 2)), batch)) {
+            std::ostringstream oss;
+            oss << "matmul: shapes ";
+            dump_shape(oss, a);
+            oss << " and ";
+            dump_shape(oss, b);
+            oss << " not aligned";
+            throw Error<ValueError>(oss.str());
+        }
+        if (a.size() > 1) {
+            batch.push_back(lshape[lshape.size() - 2]);
+        }
+        if (b.size() > 1) {
+            batch.push_back(rshape.back());
+        }
+        return batch;
+    }
+
+    /**
+     * Append node's fused subtree to task's program and return the operand naming its result.
+     */
+    static int compile(const Node *node, std::map<const Node *, int> &index, const std::vector<bool> &fused,
+            std::map<int, int> &slots, Task &task) {
+        int operands[2];
+        for (int k = 0; k < 2; ++k) {
+            const Node *input = node->inputs[k].get();
+            const int i = index[input];
+            if (fused[i]) {
+                operands[k] = compile(input, index, fused, slots, task);
+                continue;
+            }
+            auto it = slots.find(i);
+            if (it == slots.end()) {
+                it = slots.emplace(i, task.inputs.size()).first;
+                task.inputs.push_back(i);
+            }
+            operands[k] = it->second;
+        }
+        task.program.push_back({node->op, operands[0], operands[1]});
+        return ~static_cast<int>(task.program.size() - 1);
+    }
+
+    /**
+     * Run a fused group over shape: per tile, gather the inputs (broadcast to shape) into scratch rows,
+     * then run the program row by row in cache.
+     */
+    static ndarray run_fused(const Task &task, const std::vector<const ndarray *> &inputs, const Shape &shape) {
+        Tracer::Span span("fused");
+        std::vector<std::vector<int>> strides = {get_strides(shape)};
+        std::vector<const Value *> sources;
+        for (const ndarray *input : inputs) {
+            strides.emplace_back();
+            broadcast_strides(input->shape_, shape, strides.back());
+            sources.push_back(input->data_.data());
+        }
+        NdIter iter(shape, strides);
+
+        Buffer values(get_size(shape));
+        if (span) {
+            span.shape("out", shape).bytes(static_cast<long long>(values.size()) * (inputs.size() + 1) * sizeof(T));
+        }
+        T *out = values.data();
+        const int tile = iter.row_size(), num_inputs = inputs.size(), num_steps = task.program.size();
+        parallel_for(iter.num_rows(), std::max(1, (1 << 15) / tile), [&] (int begin, int end) {
+            std::vector<T> scratch(static_cast<size_t>(num_inputs + num_steps) * tile);
+            auto row = [&scratch, tile, num_inputs] (int operand) -> T * {
+                return scratch.data() + static_cast<size_t>((operand >= 0) ? operand : (num_inputs + ~operand)) * tile;
+            };
+            iter.for_each(begin, end, [&] (const long long *offsets, const int *steps, int count) {
+                for (int j = 0; j < num_inputs; ++j) {
+                    T *dst = row(j);
+                    const Value *src = sources[j] + offsets[j + 1];
+                    for (int i = 0; i < count; ++i, src += steps[j + 1]) {
+                        dst[i] = **src;
+                    }
+                }
+                for (int s = 0; s < num_steps; ++s) {
+                    const Instruction &step = task.program[s];
+                    apply(step.op, row(step.lhs), row(step.rhs), row(~s), count);
+                }
+                const T *result = row(~(num_steps - 1));
+                T *o = out + offsets[0];
+                for (int i = 0; i < count; ++i, o += steps[0]) {
+                    *o = result[i];
+                }
+            });
+        });
+        return ndarray(shape, make_data(std::move(values)));
+    }
+
+    static void apply(Operator op, const T *lhs, const T *rhs, T *out, int count) {
+        switch (op) {
+        case OP_ADD:
+            for (int i = 0; i < count; ++i) {
+                out[i] = lhs[i] + rhs[i];
+            }
+            break;
+        case OP_SUB:
+            for (int i = 0; i < count; ++i) {
+                out[i] = lhs[i] - rhs[i];
+            }
+            break;
+        case OP_MUL:
+            for (int i = 0; i < count; ++i) {
+                out[i] = lhs[i] * rhs[i];
+            }
+            break;
+        case OP_DIV:
+            for (int i = 0; i < count; ++i) {
+                out[i] = lhs[i] / rhs[i];
+            }
+            break;
+        }
+    }
+
+    std::shared_ptr<const Node> node_;
+};
+
+template<class T, bool ByRow>
+class compressed_matrix;
+
+/**
+ * Sparse matrix in coordinate format, meant for incremental construction.
+ *
+ * Duplicate entries are summed when converting to CSR/CSC.
+ */
+template<class T>
+class coo_matrix {
+public:
+    coo_matrix(int rows, int cols) : shape_({rows, cols}) {
+    }
+
+    static coo_matrix fromdense(const ndarray<T> &dense) {
+        if (dense.ndim() != 2) {
+            throw Error<ValueError>("expected dimension <= 2 array or matrix");
+        }
+
+        coo_matrix coo(dense.shape_[0], dense.shape_[1]);
+        for (int i = 0; i < dense.size(); ++i) {
+            const T &value = *dense.data_[i];
+            if (value != T()) {
+                coo.push_back(i / coo.shape_[1], i % coo.shape_[1], value);
+            }
+        }
+        return coo;
+    }
+
+    void push_back(int row, int col, const T &value) {
+        if ((row < 0) || (row >= shape_[0]) || (col < 0) || (col >= shape_[1])) {
+            throw Error<IndexError>("index out of bounds");
+        }
+
+        row_.push_back(row);
+        col_.push_back(col);
+        data_.push_back(value);
+    }
+
+    const std::vector<int> &shape() const {
+        return shape_;
+    }
+
+    int nnz() const {
+        return data_.size();
+    }
+
+    compressed_matrix<T, true> tocsr() const {
+        return compress<true>();
+    }
+
+    compressed_matrix<T, false> tocsc() const {
+        return compress<false>();
+    }
+
+    ndarray<T> todense() const {
+        return tocsr().todense();
+    }
+
+private:
+    template<class U, bool ByRow>
+    friend class compressed_matrix;
+
+    /**
+     * Counting sort by major index, then sort and merge each major slice by minor index.
+     */
+    template<bool ByRow>
+    compressed_matrix<T, ByRow> compress() const {
+        const std::vector<int> &major = ByRow ? row_ : col_, &minor = ByRow ? col_ : row_;
+        int num_major = ByRow ? shape_[0] : shape_[1];
+        std::vector<int> indptr(num_major + 1, 0);
+        for (int i : major) {
+            ++indptr[i + 1];
+        }
+        std::partial_sum(indptr.begin(), indptr.end(), indptr.begin());
+
+        std::vector<int> order(major.size()), next(indptr.begin(), std::prev(indptr.end()));
+        for (size_t i = 0; i < major.size(); ++i) {
+            order[next[major[i]]++] = i;
+        }
+
+        std::vector<int> indices(major.size());
+        std::vector<T> data(major.size());
+        std::vector<int> counts(num_major, 0);
+        ndarray<T>::parallel_for(num_major, 256, [&] (int begin, int end) {
+            for (int i = begin; i < end; ++i) {
+                auto first = std::next(order.begin(), indptr[i]), last = std::next(order.begin(), indptr[i + 1]);
+                std::stable_sort(first, last, [&minor] (int lhs, int rhs) -> bool {
+                    return minor[lhs] < minor[rhs];
+                });
+                int out = indptr[i];
+                for (auto it = first; it != last; ++it) {
+                    if ((out > indptr[i]) && (indices[out - 1] == minor[*it])) {
+                        data[out - 1] += data_[*it];
+                    } else {
+                        indices[out] = minor[*it];
+                        data[out] = data_[*it];
+                        ++out;
+                    }
+                }
+                counts[i] = out - indptr[i];
+            }
+        });
+
+        // Squeeze out the slots freed by merged duplicates.
+        int out = 0;
+        for (int i = 0; i < num_major; ++i) {
+            int begin = indptr[i];
+            indptr[i] = out;
+            for (int j = begin; j < begin + counts[i]; ++j, ++out) {
+                indices[out] = indices[j];
+                data[out] = data[j];
+            }
+        }
+        indptr[num_major] = out;
+        indices.resize(out);
+        data.resize(out);
+
+        return compressed_matrix<T, ByRow>(shape_, std::move(indptr), std::move(indices), std::move(data));
+    }
+
+    std::vector<int> shape_;
+    std::vector<int> row_;
+    std::vector<int> col_;
+    std::vector<T> data_;
+};
+
+/**
+ * Compressed sparse matrix, by row (CSR) or by column (CSC).
+ *
+ * indptr_[i]..indptr_[i + 1] delimit the major slice i, with minor indices sorted and unique.
+ */
+template<class T, bool ByRow>
+class compressed_matrix {
+public:
+    compressed_matrix(std::vector<int> shape, std::vector<int> indptr, std::vector<int> indices, std::vector<T> data)
+            : shape_(std::move(shape)),
+              indptr_(std::move(indptr)),
+              indices_(std::move(indices)),
+              data_(std::move(data)) {
+    }
+
+    static compressed_matrix fromdense(const ndarray<T> &dense) {
+        return coo_matrix<T>::fromdense(dense).template compress<ByRow>();
+    }
+
+    const std::vector<int> &shape() const {
+        return shape_;
+    }
+
+    int nnz() const {
+        return data_.size();
+    }
+
+    /**
+     * Reinterpret as the other compressed format of the transposed matrix: nothing is re-sorted, but the
+     * three arrays are copied (O(nnz)) unless the matrix is an rvalue, whose arrays are moved.
+     */
+    compressed_matrix<T, !ByRow> transpose() const & {
+        return compressed_matrix<T, !ByRow>({shape_[1], shape_[0]}, indptr_, indices_, data_);
+    }
+
+    compressed_matrix<T, !ByRow> transpose() && {
+        return compressed_matrix<T, !ByRow>({shape_[1], shape_[0]}, std::move(indptr_), std::move(indices_), std::move(data_));
+    }
+
+    compressed_matrix<T, true> tocsr() const {
+        return tocoo().tocsr();
+    }
+
+    compressed_matrix<T, false> tocsc() const {
+        return tocoo().tocsc();
+    }
+
+    coo_matrix<T> tocoo() const {
+        coo_matrix<T> coo(shape_[0], shape_[1]);
+        for (int i = 0; i + 1 < static_cast<int>(indptr_.size()); ++i) {
+            for (int j = indptr_[i]; j < indptr_[i + 1]; ++j) {
+                if (ByRow) {
+                    coo.push_back(i, indices_[j], data_[j]);
+                } else {
+                    coo.push_back(indices_[j], i, data_[j]);
+                }
+            }
+        }
+        return coo;
+    }
+
+    ndarray<T> todense() const {
+        std::vector<T> values(static_cast<size_t>(shape_[0]) * shape_[1], T());
+        int num_major = indptr_.size() - 1;
+        int major_stride = ByRow ? shape_[1] : 1, minor_stride = ByRow ? 1 : shape_[1];
+        ndarray<T>::parallel_for(num_major, 256, [&] (int begin, int end) {
+            for (int i = begin; i < end; ++i) {
+                for (int j = indptr_[i]; j < indptr_[i + 1]; ++j) {
+                    values[static_cast<size_t>(i) * major_stride + static_cast<size_t>(indices_[j]) * minor_stride] = data_[j];
+                }
+            }
+        });
+        return ndarray<T>(shape_, ndarray<T>::make_data(std::move(values)));
+    }
+
+    /**
+     * Sparse-dense product: SpMV for a 1-D operand, SpMM for a 2-D one.
+     *
+     * CSR rows are partitioned across threads; each output row is written by exactly one thread.
+     */
+    ndarray<T> dot(const ndarray<T> &dense) const {
+        if (!ByRow) {
+            return tocsr().dot(dense);
+        }
+
+        if (((dense.ndim() != 1) && (dense.ndim() != 2)) || (dense.shape_[0] != shape_[1])) {
+            throw Error<ValueError>("dimension mismatch");
+        }
+
+        int k = (dense.ndim() == 2) ? dense.shape_[1] : 1;
+        auto rhs = dense.values();
+        std::vector<T> values(static_cast<size_t>(shape_[0]) * k, T());
+        int grain = std::max(1, (1 << 14) / std::max(1, k * (nnz() / std::max(1, shape_[0]) + 1)));
+        ndarray<T>::parallel_for(shape_[0], grain, [&] (int begin, int end) {
+            for (int i = begin; i < end; ++i) {
+                T *out = values.data() + static_cast<size_t>(i) * k;
+                for (int j = indptr_[i]; j < indptr_[i + 1]; ++j) {
+                    const T value = data_[j];
+                    const T *in = rhs.data() + static_cast<size_t>(indices_[j]) * k;
+                    for (int p = 0; p < k; ++p) {
+                        out[p] += value * in[p];
+                    }
+                }
+            }
+        });
+
+        std::vector<int> shape = {shape_[0]};
+        if (dense.ndim() == 2) {
+            shape.push_back(k);
+        }
+        return ndarray<T>(std::move(shape), ndarray<T>::make_data(std::move(values)));
+    }
+
+    template<class U>
+    friend compressed_matrix operator*(const compressed_matrix &lhs, const U &rhs) {
+        auto result = lhs;
+        for (auto &value : result.data_) {
+            value *= static_cast<T>(rhs);
+        }
+        return result;
+    }
+
+    template<class U>
+    friend compressed_matrix operator*(const U &lhs, const compressed_matrix &rhs) {
+        return rhs * lhs;
+    }
+
+    template<class U>
+    friend compressed_matrix operator/(const compressed_matrix &lhs, const U &rhs) {
+        auto result = lhs;
+        for (auto &value : result.data_) {
+            value /= static_cast<T>(rhs);
+        }
+        return result;
+    }
+
+    friend compressed_matrix operator+(const compressed_matrix &lhs, const compressed_matrix &rhs) {
+        return lhs.merge(rhs, true, true, [] (const T &a, const T &b) -> T { return a + b; });
+    }
+
+    friend compressed_matrix operator-(const compressed_matrix &lhs, const compressed_matrix &rhs) {
+        return lhs.merge(rhs, true, true, [] (const T &a, const T &b) -> T { return a - b; });
+    }
+
+    /**
+     * Elementwise (Hadamard) product, only touching entries present in both operands.
+     */
+    compressed_matrix multiply(const compressed_matrix &rhs) const {
+        return merge(rhs, false, false, [] (const T &a, const T &b) -> T { return a * b; });
+    }
+
+private:
+    template<class U, bool B>
+    friend class compressed_matrix;
+
+    /**
+     * Merge two matrices slice by slice in two passes, counting then filling,
+     * so that every slice is written by one thread into its final place.
+     * keep_lhs/keep_rhs tell whether entries present in only one operand survive (combined with zero).
+     */
+    template<class F>
+    compressed_matrix merge(const compressed_matrix &rhs, bool keep_lhs, bool keep_rhs, F f) const {
+        if (shape_ != rhs.shape_) {
+            throw Error<ValueError>("inconsistent shapes");
+        }
+
+        int num_major = indptr_.size() - 1;
+        auto visit = [&] (int i, auto emit) {
+            int a = indptr_[i], b = rhs.indptr_[i];
+            int a_end = indptr_[i + 1], b_end = rhs.indptr_[i + 1];
+            while ((a < a_end) || (b < b_end)) {
+                if ((b == b_end) || ((a < a_end) && (indices_[a] < rhs.indices_[b]))) {
+                    if (keep_lhs) {
+                        emit(indices_[a], f(data_[a], T()));
+                    }
+                    ++a;
+                } else if ((a == a_end) || (rhs.indices_[b] < indices_[a])) {
+                    if (keep_rhs) {
+                        emit(rhs.indices_[b], f(T(), rhs.data_[b]));
+                    }
+                    ++b;
+                } else {
+                    emit(indices_[a], f(data_[a], rhs.data_[b]));
+                    ++a;
+                    ++b;
+                }
+            }
+        };
+
+        std::vector<int> indptr(num_major + 1, 0);
+        ndarray<T>::parallel_for(num_major, 256, [&] (int begin, int end) {
+            for (int i = begin; i < end; ++i) {
+                visit(i, [&indptr, i] (int, const T &) {
+                    ++indptr[i + 1];
+                });
+            }
+        });
+        std::partial_sum(indptr.begin(), indptr.end(), indptr.begin());
+
+        std::vector<int> indices(indptr.back());
+        std::vector<T> data(indptr.back());
+        ndarray<T>::parallel_for(num_major, 256, [&] (int begin, int end) {
+            for (int i = begin; i < end; ++i) {
+                int out = indptr[i];
+                visit(i, [&indices, &data, &out] (int index, const T &value) {
+                    indices[out] = index;
+                    data[out] = value;
+                    ++out;
+                });
+            }
+        });
+
+        return compressed_matrix(shape_, std::move(indptr), std::move(indices), std::move(data));
+    }
+
+    std::vector<int> shape_;
+    std::vector<int> indptr_;
+    std::vector<int> indices_;
+    std::vector<T> data_;
+};
+
+template<class T>
+using csr_matrix = compressed_matrix<T, true>;
+
+template<class T>
+using csc_matrix = compressed_matrix<T, false>;
+
+/**
+ * Array of records with fields of types Ts..., stored as one contiguous column per field.
+ *
+ * Python notation "np.zeros(n, dtype=[('t', 'i8'), ('v', 'f8')])" becomes
+ * "record_array<long long, double>({n}, {"t", "v"})", and "a['v']" becomes "a.field<double>("v")" or
+ * "a.field<1>()": a view of the column, so ndarray kernels run over a field at full bandwidth and
+ * assignments to it write into the records. Records are read and written as std::tuple<Ts...>,
+ * indexed in row-major order.
+ */
+template<class... Ts>
+class record_array {
+public:
+    typedef std::tuple<Ts...> record_type;
+    typedef std::array<std::string, sizeof...(Ts)> Names;
 
-        Shape shape(std::next(shape_.begin()), shape_.end());
-        int size = get_size(shape);
-        index *= size;
-        return ndarray(std::move(shape), Data(
-                std::next(data_.begin(), index),
-                std::next(data_.begin(), index + size)));
+    record_array(const std::vector<int> &shape, Names names)
+            : record_array(std::move(names), std::make_tuple(ndarray<Ts>::full(shape, Ts())...)) {
     }
 
     /**
-     * Convert to scalar.
+     * np.rec.fromarrays(columns, names=names); the columns are copied.
      */
-    operator T() const {
-        if (size() != 1) {
-            throw Error<TypeError>("only size-1 arrays can be converted to scalars");
+    static record_array fromarrays(Names names, const ndarray<Ts> &... columns) {
+        const std::vector<int> *shapes[] = {&columns.shape_...};
+        for (size_t k = 1; k < sizeof...(Ts); ++k) {
+            if (*shapes[k] != *shapes[0]) {
+                std::ostringstream oss;
+                oss << "array-shape mismatch in array " << k;
+                throw Error<ValueError>(oss.str());
+            }
         }
-
-        return *data_.front();
+        return record_array(std::move(names), std::make_tuple(
+                ndarray<Ts>(columns.shape_, ndarray<Ts>::make_data(columns.values()))...));
     }
 
     /**
-     * Perform Python array slicing.
-     *
-     * Python notation "a[1:2, 3, 4:5]" becomes "a.slice(std::make_pair(1, 2), 3, std::make_pair(4, 5))".
+     * np.rec.fromrecords(records, names=names) for a 1-D array, transposing the records into columns.
      */
-    template<class... Args>
-    ndarray slice(Args... args) const {
-        if (sizeof...(args) > ndim()) {
-            throw Error<IndexError>("too many indices for array");
-        }
+    static record_array fromrecords(const std::vector<record_type> &records, Names names) {
+        return fromrecords(records, std::move(names), std::index_sequence_for<Ts...>());
+    }
 
-        return slice_impl(std::move(args)...);
+    const std::vector<int> &shape() const {
+        return std::get<0>(columns_).shape_;
     }
 
-    ndarray operator-() const {
-        return operator_impl(ndarray::scalar(-1), OP_MUL);
+    int size() const {
+        return std::get<0>(columns_).size();
     }
 
-private:
-    typedef std::vector<int> Shape;
-    typedef std::shared_ptr<dtype> Value;
-    typedef std::vector<Value> Data;
+    const Names &names() const {
+        return names_;
+    }
 
-    enum Operator {
-        OP_ADD, OP_SUB, OP_MUL, OP_DIV
-    };
+    template<size_t I>
+    ndarray<typename std::tuple_element<I, record_type>::type> field() const {
+        return std::get<I>(columns_);
+    }
 
     template<class U>
-    friend class ndarray;
+    ndarray<U> field(const std::string &name) const {
+        auto it = std::find(names_.begin(), names_.end(), name);
+        if (it == names_.end()) {
+            throw Error<ValueError>("no field of name " + name);
+        }
+        std::vector<ndarray<U>> found;
+        find_field(static_cast<int>(it - names_.begin()), found, std::index_sequence_for<Ts...>());
+        if (found.empty()) {
+            throw Error<TypeError>("field " + name + " is not of type " + dtype_traits<U>::name());
+        }
+        return found.front();
+    }
 
-    friend std::ostream &operator<<(std::ostream &os, const ndarray &ary) {
-        if (ary.ndim() == 0) { // scalar, not array
-            if (ary.size() == 1) {
-                os << static_cast<T>(ary);
-            } else {
-                std::cerr << "ndarray: scalar, data size should be 1 but get " << ary.size() << std::endl;
+    record_type record(int index) const {
+        check_index(index);
+        return record(index, std::index_sequence_for<Ts...>());
+    }
+
+    void set_record(int index, const record_type &value) {
+        check_index(index);
+        set_record(index, value, std::index_sequence_for<Ts...>());
+    }
+
+private:
+    record_array(Names names, std::tuple<ndarray<Ts>...> columns)
+            : names_(std::move(names)), columns_(std::move(columns)) {
+        static_assert(sizeof...(Ts) > 0, "a record needs at least one field");
+        for (size_t i = 0; i < names_.size(); ++i) {
+            if (std::find(names_.begin(), names_.begin() + i, names_[i]) != names_.begin() + i) {
+                throw Error<ValueError>("field '" + names_[i] + "' occurs more than once");
             }
-            return os;
         }
+    }
 
-        os << "array(";
+    template<size_t... Is>
+    static record_array fromrecords(const std::vector<record_type> &records, Names names, std::index_sequence<Is...>) {
+        const int n = records.size();
+        return record_array(std::move(names), std::make_tuple(column<Is>(records, n)...));
+    }
 
-        std::vector<int> s;
-        size_t i = 0;
-        do {
-            for (; s.size() < ary.ndim(); s.push_back(ary.shape_[s.size()])) {
-                os << "[";
-            }
-            for (; s.back() > 0; --s.back()) {
-                os << *(ary.data_[i]) << ',';
-                ++i;
-            }
-            for (; s.back() == 0; --s.back()) {
-                os << "],";
-                s.pop_back();
-                if (s.empty()) {
-                    // assert(i == ary.data_.size());
-                    break;
-                }
+    template<size_t I>
+    static ndarray<typename std::tuple_element<I, record_type>::type> column(const std::vector<record_type> &records, int n) {
+        typedef typename std::tuple_element<I, record_type>::type U;
+        typename ndarray<U>::Buffer values(n);
+        U *out = values.data();
+        ndarray<U>::parallel_for(n, 1 << 15, [out, &records] (int begin, int end) {
+            for (int i = begin; i < end; ++i) {
+                out[i] = std::get<I>(records[i]);
             }
-        } while (!s.empty());
+        });
+        return ndarray<U>({n}, ndarray<U>::make_data(std::move(values)));
+    }
 
-        os << ")";
-        return os;
+    template<class U, size_t... Is>
+    void find_field(int index, std::vector<ndarray<U>> &found, std::index_sequence<Is...>) const {
+        int expand[] = {0, (match_field<U, Is>(index, found), 0)...};
+        (void) expand;
     }
 
-    template<class U>
-    friend ndarray operator+(const U &lhs, const ndarray &rhs) {
-        return ndarray::scalar(static_cast<T>(lhs)).operator_impl(rhs, ndarray::OP_ADD);
+    template<class U, size_t I>
+    void match_field(int index, std::vector<ndarray<U>> &found) const {
+        match_field(index, found, std::get<I>(columns_), I);
     }
 
     template<class U>
-    friend ndarray operator+(const ndarray &lhs, const U &rhs) {
-        return lhs.operator_impl(ndarray::scalar(static_cast<T>(rhs)), ndarray::OP_ADD);
+    static void match_field(int index, std::vector<ndarray<U>> &found, const ndarray<U> &column, size_t i) {
+        if (static_cast<int>(i) == index) {
+            found.push_back(column);
+        }
     }
 
-    friend ndarray operator+(const ndarray &lhs, const ndarray &rhs) {
-        return lhs.operator_impl(rhs, ndarray::OP_ADD);
+    template<class U, class V>
+    static void match_field(int, std::vector<ndarray<U>> &, const ndarray<V> &, size_t) {
     }
 
-    template<class U>
-    friend ndarray operator-(const U &lhs, const ndarray &rhs) {
-        return ndarray::scalar(static_cast<T>(lhs)).operator_impl(rhs, ndarray::OP_SUB);
+    void check_index(int index) const {
+        if ((index < 0) || (index >= size())) {
+            std::ostringstream oss;
+            oss << "index " << index << " is out of bounds for size " << size();
+            throw Error<IndexError>(oss.str());
+        }
     }
 
-    template<class U>
-    friend ndarray operator-(const ndarray &lhs, const U &rhs) {
-        return lhs.operator_impl(ndarray::scalar(static_cast<T>(rhs)), ndarray::OP_SUB);
+    template<size_t... Is>
+    record_type record(int index, std::index_sequence<Is...>) const {
+        return record_type(*std::get<Is>(columns_).data_[index]...);
     }
 
-    friend ndarray operator-(const ndarray &lhs, const ndarray &rhs) {
-        return lhs.operator_impl(rhs, ndarray::OP_SUB);
+    template<size_t... Is>
+    void set_record(int index, const record_type &value, std::index_sequence<Is...>) {
+        int expand[] = {0, (*std::get<Is>(columns_).data_[index] = std::get<Is>(value), 0)...};
+        (void) expand;
     }
 
-    template<class U>
-    friend ndarray operator*(const U &lhs, const ndarray &rhs) {
-        return ndarray::scalar(static_cast<T>(lhs)).operator_impl(rhs, ndarray::OP_MUL);
-    }
+    Names names_;
+    std::tuple<ndarray<Ts>...> columns_;
+};
 
-    template<class U>
-    friend ndarray operator*(const ndarray &lhs, const U &rhs) {
-        return lhs.operator_impl(ndarray::scalar(static_cast<T>(rhs)), ndarray::OP_MUL);
+/**
+ * Array with a packed validity bitmap beside its data, one bit per element in row-major order.
+ *
+ * As in numpy.ma, mask is nonzero for the masked (invalid) elements; it is a uint8 array since ndarray
+ * cannot hold bool. Reductions skip masked elements by blending in the reduction's identity, and an
+ * output with no valid element behind it is masked.
+ */
+template<class T>
+class masked_array {
+public:
+    explicit masked_array(ndarray<T> data) : data_(std::move(data)), valid_(words(data_.size()), ~uint64_t(0)) {
+        // Bits past the last element stay clear, so whole-word reads such as count() need no tail mask.
+        if (data_.size() % 64 != 0) {
+            valid_.back() = (uint64_t(1) << (data_.size() % 64)) - 1;
+        }
     }
 
-    friend ndarray operator*(const ndarray &lhs, const ndarray &rhs) {
-        return lhs.operator_impl(rhs, ndarray::OP_MUL);
+    masked_array(ndarray<T> data, const ndarray<uint8_t> &mask) : data_(std::move(data)), valid_(words(data_.size()), 0) {
+        if (mask.size() != data_.size()) {
+            std::ostringstream oss;
+            oss << "Mask and data not compatible: data size is " << data_.size() << ", mask size is " << mask.size() << ".";
+            throw Error<ValueError>(oss.str());
+        }
+        auto masked = mask.values();
+        for (size_t i = 0; i < masked.size(); ++i) {
+            valid_[i >> 6] |= static_cast<uint64_t>(masked[i] == 0) << (i & 63);
+        }
     }
 
-    template<class U>
-    friend ndarray operator/(const U &lhs, const ndarray &rhs) {
-        return ndarray::scalar(static_cast<T>(lhs)).operator_impl(rhs, ndarray::OP_DIV);
+    /**
+     * np.ma.masked_invalid(a): mask NaNs and infinities.
+     */
+    static masked_array masked_invalid(const ndarray<T> &a) {
+        auto values = a.values();
+        std::vector<uint64_t> valid(words(values.size()), 0);
+        for (size_t i = 0; i < values.size(); ++i) {
+            const T &x = values[i];
+            valid[i >> 6] |= static_cast<uint64_t>((x == x) && (x - x == x - x)) << (i & 63);
+        }
+        return masked_array(a, std::move(valid));
     }
 
-    template<class U>
-    friend ndarray operator/(const ndarray &lhs, const U &rhs) {
-        return lhs.operator_impl(ndarray::scalar(static_cast<T>(rhs)), ndarray::OP_DIV);
+    const ndarray<T> &data() const {
+        return data_;
     }
 
-    friend ndarray operator/(const ndarray &lhs, const ndarray &rhs) {
-        return lhs.operator_impl(rhs, ndarray::OP_DIV);
+    ndarray<uint8_t> mask() const {
+        std::vector<uint8_t> masked(data_.size());
+        for (size_t i = 0; i < masked.size(); ++i) {
+            masked[i] = !is_valid(i);
+        }
+        return ndarray<uint8_t>(data_.shape_, ndarray<uint8_t>::make_data(std::move(masked)));
     }
 
-    template<template<class, class...> class Container, class... Ts>
-    static Shape get_shape(const Container<ndarray, Ts...> &ary) {
-        if (ary.size() == 0) {
-            return {};
+    /**
+     * Number of valid elements.
+     */
+    int count() const {
+        long long total = 0;
+        for (uint64_t word : valid_) {
+            total += popcount(word);
         }
+        return total;
+    }
 
-        auto shape = ary.begin()->shape();
+    ndarray<T> filled(const T &fill_value) const {
+        auto values = data_.values();
+        for (size_t i = 0; i < values.size(); ++i) {
+            values[i] = is_valid(i) ? values[i] : fill_value;
+        }
+        return ndarray<T>(data_.shape_, ndarray<T>::make_data(std::move(values)));
+    }
 
-        auto not_same_shape = [&shape] (const ndarray &subary) -> bool {
-            return subary.shape() != shape;
-        };
+    masked_array sum() const {
+        return reduce<typename ndarray<T>::SumReducer>(ndarray<T>::ALL_AXES);
+    }
 
-        if (std::any_of(ary.begin(), ary.end(), not_same_shape)) {
-            // TODO dtype=object
-            std::cerr << "ndarray::get_shape: shape not match" << std::endl;
-            return {};
-        }
+    masked_array sum(int axis) const {
+        return reduce<typename ndarray<T>::SumReducer>(axis);
+    }
 
-        shape.insert(shape.begin(), ary.size());
-        return shape;
+    masked_array<double> mean() const {
+        return reduce<typename ndarray<T>::MeanReducer>(ndarray<T>::ALL_AXES);
     }
 
-    template<template<class, class...> class Container, class... Ts>
-    static int get_size(const Container<int, Ts...> &shape) {
-        return std::accumulate(shape.begin(), shape.end(), 1, std::multiplies<int>());
+    masked_array<double> mean(int axis) const {
+        return reduce<typename ndarray<T>::MeanReducer>(axis);
     }
 
-    template<template<class, class...> class Container, class... Ts>
-    static Data flatten_data(const Container<ndarray, Ts...> &ary) {
-        auto flatten = [] (auto &&data, const ndarray &subary) -> Data {
-            data.insert(data.end(), subary.data_.begin(), subary.data_.end());
-            return data;
-        };
+    masked_array min() const {
+        return reduce<typename ndarray<T>::template ExtremeReducer<std::less<Accumulator>>>(ndarray<T>::ALL_AXES);
+    }
 
-        return std::accumulate(ary.begin(), ary.end(), Data(), flatten);
+    masked_array min(int axis) const {
+        return reduce<typename ndarray<T>::template ExtremeReducer<std::less<Accumulator>>>(axis);
     }
 
-    template<template<class, class...> class Container, class... Ts>
-    static Data transform_data(const Container<T, Ts...> &ary) {
-        Data data(ary.size());
-        std::transform(ary.begin(), ary.end(), data.begin(), &std::make_shared<T, const T &>);
-        return data;
+    masked_array max() const {
+        return reduce<typename ndarray<T>::template ExtremeReducer<std::greater<Accumulator>>>(ndarray<T>::ALL_AXES);
     }
 
-    static std::ostream &dump_shape(std::ostream &os, const Shape &shape) {
-        os << '(';
-        std::copy(shape.begin(), shape.end(), std::ostream_iterator<int>(os, ","));
-        os << ')';
-        return os;
+    masked_array max(int axis) const {
+        return reduce<typename ndarray<T>::template ExtremeReducer<std::greater<Accumulator>>>(axis);
     }
 
     /**
-     * Repeat data groups of n elements k times.
+     * The reductions with out=: the result's data is written into out's data, which must have the reduced
+     * shape, and out's mask is replaced.
      */
-    static Data expand_data(const Data &old_data, int n, int k) {
-        Data new_data;
-        for (auto begin = old_data.begin(); begin != old_data.end(); std::advance(begin, n)) {
-            auto end = std::next(begin, n);
-            for (int i = 0; i < k; ++i) {
-                new_data.insert(new_data.end(), begin, end);
-            }
-        }
-        return new_data;
+    masked_array &sum(int axis, masked_array &out) const {
+        return reduce<typename ndarray<T>::SumReducer>(axis, &out);
     }
 
-    static bool braodcast(
-            const Shape &lshape,
-            const Shape &rshape,
-            bool is_lhs_mutable,
-            Data &ldata,
-            Data &rdata,
-            Shape &shape) {
-        int lsize = 1, rsize = 1;
-        for (auto i = lshape.rbegin(), j = rshape.rbegin(); (i != lshape.rend()) || (j != rshape.rend());) {
-            int ldim = 1, rdim = 1;
-            if (i != lshape.rend()) {
-                ldim = *i;
-                ++i;
-            }
-            if (j != rshape.rend()) {
-                rdim = *j;
-                ++j;
-            }
-            if (ldim != rdim) {
-                if (rdim == 1) {
-                    rdim = ldim;
-                    rdata = expand_data(rdata, rsize, rdim);
-                } else if (is_lhs_mutable && (ldim == 1)) {
-                    ldim = rdim;
-                    ldata = expand_data(ldata, lsize, ldim);
-                } else {
-                    return false;
-                }
-            }
-            lsize *= ldim;
-            rsize *= rdim;
-            shape.push_back(ldim);
-        }
-        std::reverse(shape.begin(), shape.end());
-        return true;
+    masked_array<double> &mean(int axis, masked_array<double> &out) const {
+        return reduce<typename ndarray<T>::MeanReducer>(axis, &out);
     }
 
-    ndarray(Shape shape, Data data)
-            : shape_(std::move(shape)),
-              data_(std::move(data)) {
+    masked_array &min(int axis, masked_array &out) const {
+        return reduce<typename ndarray<T>::template ExtremeReducer<std::less<Accumulator>>>(axis, &out);
     }
 
-    int resolve_index(int index, bool verify) const {
-        if (ndim() == 0) {
-            throw Error<IndexError>("invalid index to scalar variable");
-        }
+    masked_array &max(int axis, masked_array &out) const {
+        return reduce<typename ndarray<T>::template ExtremeReducer<std::greater<Accumulator>>>(axis, &out);
+    }
 
-        int dim = len();
+private:
+    typedef typename accumulator_traits<T>::type Accumulator;
 
-        if (verify && ((index < -dim) || (index >= dim))) {
-            std::ostringstream oss;
-            oss << "index " << index << " is out of bounds for axis 0 with size " << dim;
-            throw Error<IndexError>(oss.str());
-        }
+    template<class U>
+    friend class masked_array;
 
-        return (index < 0) ? (index + dim) : index;
+    masked_array(ndarray<T> data, std::vector<uint64_t> valid) : data_(std::move(data)), valid_(std::move(valid)) {
     }
 
-    template<class... Args>
-    ndarray slice_impl(int index, Args... args) const {
-        return (*this)[index].slice(std::move(args)...);
+    static size_t words(size_t n) {
+        return (n + 63) / 64;
     }
 
-    template<class... Args>
-    ndarray slice_impl(std::pair<int, int> range, Args... args) const {
-        std::vector<ndarray> slices;
-        int begin = std::max(0, resolve_index(range.first, false));
-        int end = std::min(len(), resolve_index(range.second, false));
-        for (; begin < end; ++begin) {
-            slices.push_back(slice_impl(begin, std::move(args)...));
-        }
-
-        auto shape = get_shape(slices);
-        if (shape.empty()) {
-            return {};
-        }
-
-        auto data = flatten_data(slices);
-        if (data.empty()) {
-            return {};
-        }
-
-        return ndarray(std::move(shape), std::move(data));
+    static int popcount(uint64_t x) {
+        x -= (x >> 1) & 0x5555555555555555ULL;
+        x = (x & 0x3333333333333333ULL) + ((x >> 2) & 0x3333333333333333ULL);
+        x = (x + (x >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+        return static_cast<int>((x * 0x0101010101010101ULL) >> 56);
     }
 
-    ndarray slice_impl() const {
-        return *this;
+    bool is_valid(size_t i) const {
+        return (valid_[i >> 6] >> (i & 63)) & 1;
     }
 
-    ndarray operator_impl(const ndarray &rhs, Operator op) const {
-        const Shape &lshape = shape(), &rshape = rhs.shape();
-        Data ldata = data_, rdata = rhs.data_;
-        Shape shape;
-        auto retval = braodcast(lshape, rshape, true, ldata, rdata, shape);
-        if (!retval) {
-            std::ostringstream oss;
-            oss << "operands could not be broadcast together with shapes ";
-            dump_shape(oss, lshape);
-            oss << " ";
-            dump_shape(oss, rshape);
-            throw Error<ValueError>(oss.str());
-        }
-
-        // assert(ldata.size() == rdata.size())
+    template<class Reducer>
+    masked_array<typename Reducer::Out> reduce(int axis) const {
+        std::vector<uint64_t> nonempty;
+        auto result = reduce_into<Reducer>(axis, nullptr, nonempty);
+        return masked_array<typename Reducer::Out>(std::move(result), std::move(nonempty));
+    }
 
-        std::function<T(const T &, const T &)> f;
-        switch (op) {
-        case OP_ADD:
-            f = [] (const T &lhs, const T &rhs) -> T { return lhs + rhs; };
-            break;
-        case OP_SUB:
-            f = [] (const T &lhs, const T &rhs) -> T { return lhs - rhs; };
-            break;
-        case OP_MUL:
-            f = [] (const T &lhs, const T &rhs) -> T { return lhs * rhs; };
-            break;
-        case OP_DIV:
-            f = [] (const T &lhs, const T &rhs) -> T { return lhs / rhs; };
-            break;
-        default:
-            throw Error<TypeError>("unsupported operator");
-        }
+    template<class Reducer>
+    masked_array<typename Reducer::Out> &reduce(int axis, masked_array<typename Reducer::Out> *out) const {
+        std::vector<uint64_t> nonempty;
+        reduce_into<Reducer>(axis, &out->data_, nonempty);
+        out->valid_ = std::move(nonempty);
+        return *out;
+    }
 
-        Data data(ldata.size());
-        for (size_t i = 0; i < ldata.size(); ++i) {
-            data[i] = std::make_shared<T>(f(*ldata[i], *rdata[i]));
+    /**
+     * Reduce the valid elements into out's storage when given (returning an empty array), else into a
+     * new array; nonempty receives the output's validity bitmap.
+     */
+    template<class Reducer>
+    ndarray<typename Reducer::Out> reduce_into(int axis, ndarray<typename Reducer::Out> *out, std::vector<uint64_t> &nonempty) const {
+        const uint64_t *valid = valid_.data();
+        std::vector<long long> counts;
+        auto result = data_.template reduce_impl<Reducer>(axis, [valid] (long long index, const T &) -> bool {
+            return (valid[index >> 6] >> (index & 63)) & 1;
+        }, &counts, out);
+        nonempty.assign(words(counts.size()), 0);
+        for (size_t i = 0; i < counts.size(); ++i) {
+            nonempty[i >> 6] |= static_cast<uint64_t>(counts[i] > 0) << (i & 63);
         }
-
-        return ndarray(std::move(shape), std::move(data));
+        return result;
     }
 
-    Shape shape_;
-    Data data_;
+    ndarray<T> data_;
+    std::vector<uint64_t> valid_;
 };
 
 int main() {
@@ -566,5 +6950,307 @@ int main() {
     //        [   2,    2,    2],
     //        [   2,    2, 5566]])
 
+    std::cout << ">>> x = np.arange(6).reshape(2, 3)" << std::endl;
+    auto x = ndarray<int>::arange(6).reshape({2, 3});
+    std::cout << ">>> np.einsum('ij,kj->ik', x, x)" << std::endl;
+    std::cout << ndarray<int>::einsum("ij,kj->ik", x, x) << std::endl;
+    // array([[ 5, 14],
+    //        [14, 50]])
+    std::cout << ">>> np.einsum('ij,jk,kl->il', x, x.reshape(3, 2), x)" << std::endl;
+    std::cout << ndarray<int>::einsum("ij,jk,kl->il", x, x.reshape({3, 2}), x) << std::endl;
+    // array([[ 39,  62,  85],
+    //        [120, 188, 256]])
+    std::cout << ">>> np.einsum('ii', np.arange(9).reshape(3, 3))" << std::endl;
+    std::cout << ndarray<int>::einsum("ii", ndarray<int>::arange(9).reshape({3, 3})) << std::endl;
+    // 12
+    std::cout << ">>> s = scipy.sparse.coo_matrix(([2, 3, 4], ([0, 1, 2], [2, 0, 1])), shape=(3, 3)).tocsr()" << std::endl;
+    coo_matrix<int> coo(3, 3);
+    coo.push_back(0, 2, 2);
+    coo.push_back(1, 0, 3);
+    coo.push_back(2, 1, 4);
+    auto s = coo.tocsr();
+    std::cout << ">>> s.dot(x.reshape(3, 2))" << std::endl;
+    std::cout << s.dot(x.reshape({3, 2})) << std::endl;
+    // array([[ 8, 10],
+    //        [ 0,  3],
+    //        [ 8, 12]])
+    std::cout << ">>> (s + s.T).todense()" << std::endl;
+    std::cout << (s + s.transpose().tocsr()).todense() << std::endl;
+    // array([[0, 3, 2],
+    //        [3, 0, 4],
+    //        [2, 4, 0]])
+    std::cout << ">>> c = np.arange(6); c[1:6] = c[0:5]" << std::endl;
+    auto c = ndarray<int>::arange(6);
+    c.slice(std::make_pair(1, 6)) = c.slice(std::make_pair(0, 5));
+    std::cout << ">>> c" << std::endl;
+    std::cout << c << std::endl;
+    // array([0, 0, 1, 2, 3, 4])
+    std::cout << ">>> np.concatenate((x, x), axis=1)" << std::endl;
+    std::cout << ndarray<int>::concatenate({x, x}, 1) << std::endl;
+    // array([[0, 1, 2, 0, 1, 2],
+    //        [3, 4, 5, 3, 4, 5]])
+    std::cout << ">>> np.stack((x[0], x[1]), axis=1)" << std::endl;
+    std::cout << ndarray<int>::stack({x[0], x[1]}, 1) << std::endl;
+    // array([[0, 3],
+    //        [1, 4],
+    //        [2, 5]])
+    std::cout << ">>> l, r = np.array_split(x, 2, axis=1)" << std::endl;
+    auto parts = x.array_split(2, 1);
+    std::cout << ">>> l" << std::endl;
+    std::cout << parts[0] << std::endl;
+    // array([[0, 1],
+    //        [3, 4]])
+    std::cout << ">>> r" << std::endl;
+    std::cout << parts[1] << std::endl;
+    // array([[2],
+    //        [5]])
+    std::cout << ">>> m = np.array([[4., 2.], [2., 3.]])" << std::endl;
+    ndarray<double> m{{4., 2.}, {2., 3.}};
+    std::cout << ">>> np.linalg.cholesky(m)" << std::endl;
+    std::cout << ndarray<double>::linalg::cholesky(m) << std::endl;
+    // array([[2.        , 0.        ],
+    //        [1.        , 1.41421356]])
+    std::cout << ">>> np.linalg.solve(m, np.array([2., 1.]))" << std::endl;
+    std::cout << ndarray<double>::linalg::solve(m, {2., 1.}) << std::endl;
+    // array([0.5, 0. ])
+    std::cout << ">>> np.linalg.det(m)" << std::endl;
+    std::cout << ndarray<double>::linalg::det(m) << std::endl;
+    // 8.0
+    std::cout << ">>> np.fft.rfft(np.array([1., 2., 3., 4.]))" << std::endl;
+    std::cout << ndarray<double>::rfft({1., 2., 3., 4.}) << std::endl;
+    // array([10.+0.j, -2.+2.j, -2.+0.j])
+    std::cout << ">>> np.allclose(np.fft.fft(np.arange(7.), 11), [sum(k * cmath.exp(-2j * cmath.pi * j * k / 11) for k in range(7)) for j in range(11)])" << std::endl;
+    {
+        auto spectrum = ndarray<double>::fft(ndarray<double>::arange(7), 11);
+        bool close = spectrum.size() == 11;
+        for (int j = 0; close && (j < 11); ++j) {
+            std::complex<double> expected;
+            for (int k = 0; k < 7; ++k) {
+                expected += std::polar(static_cast<double>(k), -2 * M_PI * j * k / 11);
+            }
+            close = std::abs(static_cast<std::complex<double>>(spectrum[j]) - expected) < 1e-9;
+        }
+        std::cout << (close ? "True" : "False") << std::endl;
+    }
+    // True
+    std::cout << ">>> np.fft.irfft(np.fft.rfft(np.array([1., 2., 3., 4.])))" << std::endl;
+    std::cout << ndarray<std::complex<double>>::irfft(ndarray<double>::rfft({1., 2., 3., 4.})) << std::endl;
+    // array([1., 2., 3., 4.])
+    std::cout << ">>> np.bincount(np.array([0, 1, 1, 3]))" << std::endl;
+    std::cout << ndarray<int>::bincount({0, 1, 1, 3}) << std::endl;
+    // array([1, 2, 0, 1])
+    std::cout << ">>> np.unique(np.array([3, -1, 3, 2]), return_counts=True)" << std::endl;
+    auto uniques = ndarray<int>::unique_counts({3, -1, 3, 2});
+    std::cout << uniques.first << ", " << uniques.second << std::endl;
+    // (array([-1,  2,  3]), array([1, 1, 2]))
+    std::cout << ">>> np.unique(np.array([1.5, -0., 0., 1.5], dtype=np.float16), return_counts=True)" << std::endl;
+    auto half_uniques = ndarray<float16>::unique_counts(ndarray<float16>({float16(1.5f), float16(-0.f), float16(0.f), float16(1.5f)}));
+    std::cout << half_uniques.first << ", " << half_uniques.second << std::endl;
+    // (array([0. , 1.5], dtype=float16), array([2, 2]))
+    std::cout << ">>> np.histogram(v[~np.isnan(v)], bins=2)  # v = [nan, 1., 2., 3.]" << std::endl;
+    auto hist = ndarray<double>::histogram(ndarray<double>({std::numeric_limits<double>::quiet_NaN(), 1., 2., 3.}), 2);
+    std::cout << hist.first << ", " << hist.second << std::endl;
+    // (array([1, 2]), array([1., 2., 3.]))
+    std::cout << ">>> np.arange(12).reshape(2, 2, 3) @ x.reshape(3, 2)" << std::endl;
+    std::cout << ndarray<int>::matmul(ndarray<int>::arange(12).reshape({2, 2, 3}), x.reshape({3, 2})) << std::endl;
+    // array([[[ 10,  13],
+    //         [ 28,  40]],
+    //
+    //        [[ 46,  67],
+    //         [ 64,  94]]])
+    std::cout << ">>> a.save(f); np.load(f, rows=slice(2, 4))" << std::endl;
+    std::stringstream file;
+    a.save(file, 8);
+    std::cout << ndarray<int>::load(file, 2, 4) << std::endl;
+    // array([[[10, 11,  2,  2,  2]],
+    //        [[15, 16,  2,  2, 5566]]])
+    std::cout << ">>> np.load(f)  # first data byte flipped" << std::endl;
+    const int header_size = 4 + 2 + 4 + 4 * a.ndim() + 4 + 4 + 3 * 24;
+    auto corrupt = file.str();
+    corrupt[header_size + 1] ^= 1;
+    try {
+        std::stringstream bad(corrupt);
+        ndarray<int>::load(bad);
+    } catch (const std::exception &e) {
+        std::cout << e.what() << std::endl;
+    }
+    // ValueError: checksum mismatch in chunk 0
+    std::cout << ">>> np.load(f)  # last compressed byte flipped" << std::endl;
+    corrupt = file.str();
+    corrupt.back() ^= 1;
+    try {
+        std::stringstream bad(corrupt);
+        ndarray<int>::load(bad);
+    } catch (const std::exception &e) {
+        std::cout << e.what() << std::endl;
+    }
+    // ValueError: corrupt compressed data in chunk 2
+    std::cout << ">>> np.load(f)  # chunk size zeroed" << std::endl;
+    corrupt = file.str();
+    std::fill_n(std::next(corrupt.begin(), 4 + 2 + 4 + 4 * a.ndim()), 4, '\0');
+    try {
+        std::stringstream bad(corrupt);
+        ndarray<int>::load(bad);
+    } catch (const std::exception &e) {
+        std::cout << e.what() << std::endl;
+    }
+    // ValueError: corrupt NDZ header: invalid chunk size
+    std::cout << ">>> np.load(f16)  # float16 file read as bfloat16" << std::endl;
+    try {
+        std::stringstream halves;
+        ndarray<float16>({float16(0.5f), float16(1.5f), float16(3.f)}).save(halves);
+        ndarray<bfloat16>::load(halves);
+    } catch (const std::exception &e) {
+        std::cout << e.what() << std::endl;
+    }
+    // ValueError: file holds dtype 'e2', expected 'E2'
+    std::cout << ">>> buf = np.frombuffer(payload, dtype=np.float32)[::2]" << std::endl;
+    auto payload = std::make_shared<std::vector<float>>(std::vector<float>{1.5f, 0.f, 2.5f, 0.f, 3.5f, 0.f});
+    auto buf = ndarray<float>::from_buffer(payload->data(), {3}, {2}, payload);
+    payload.reset();
+    std::cout << ">>> buf" << std::endl;
+    std::cout << buf << std::endl;
+    // array([1.5, 2.5, 3.5], dtype=float32)
+    std::cout << ">>> np.fix(np.arange(-4, 5) / 3).astype(int)" << std::endl;
+    std::cout << ndarray<int>::arange(9, -4) / 3 << std::endl;
+    // array([-1, -1,  0,  0,  0,  0,  0,  1,  1])
+    std::cout << ">>> w = np.lib.stride_tricks.sliding_window_view(x, 2, axis=1)" << std::endl;
+    auto w = x.sliding_window_view(2, 1);
+    std::cout << ">>> w" << std::endl;
+    std::cout << w << std::endl;
+    // array([[[0, 1],
+    //         [1, 2]],
+    //
+    //        [[3, 4],
+    //         [4, 5]]])
+    std::cout << ">>> w.max(axis=-1)" << std::endl;
+    std::cout << x.rolling_max(2, 1) << std::endl;
+    // array([[1, 2],
+    //        [4, 5]])
+    std::cout << ">>> w.sum(axis=-1)" << std::endl;
+    std::cout << x.rolling_sum(2, 1) << std::endl;
+    // array([[1, 3],
+    //        [7, 9]])
+    std::cout << ">>> pd.Series([5, 1, 4, 2]).groupby([7, 3, 7, 3]).sum()" << std::endl;
+    auto groups = ndarray<int>::segment_sum({5, 1, 4, 2}, {7, 3, 7, 3});
+    std::cout << groups.first << ", " << groups.second << std::endl;
+    // (array([3, 7]), array([3, 9]))
+    std::cout << ">>> np.add.reduceat(np.arange(8), [0, 4, 1, 5])" << std::endl;
+    std::cout << ndarray<int>::reduceat(ndarray<int>::arange(8), {0, 4, 1, 5}) << std::endl;
+    // array([ 6,  4, 10, 18])
+    std::cout << ">>> acc = np.zeros((2, 3)); np.add(acc, x, out=acc); np.multiply(acc, 2, out=acc)" << std::endl;
+    auto acc = ndarray<int>::full({2, 3}, 0);
+    ndarray<int>::add(acc, x, acc);
+    ndarray<int>::multiply(acc, ndarray<int>::scalar(2), acc);
+    std::cout << ">>> acc" << std::endl;
+    std::cout << acc << std::endl;
+    // array([[ 0,  2,  4],
+    //        [ 6,  8, 10]])
+    std::cout << ">>> np.matmul(x, x.reshape(3, 2), out=np.empty((4, 2, 2), dtype=int))" << std::endl;
+    try {
+        auto batched = ndarray<int>::full({4, 2, 2}, -1);
+        ndarray<int>::matmul(x, x.reshape({3, 2}), batched);
+    } catch (const std::exception &e) {
+        std::cout << e.what() << std::endl;
+    }
+    // ValueError: non-broadcastable output operand with shape (4,2,2) doesn't match the broadcast shape (2,2)
+    std::cout << ">>> s = np.arange(6); np.add(s[1:], s[:-1], out=s[1:])" << std::endl;
+    auto shifted = ndarray<int>::arange(6);
+    auto tail = shifted.slice(std::make_pair(1, 6));
+    ndarray<int>::add(tail, shifted.slice(std::make_pair(0, 5)), tail);
+    std::cout << ">>> s" << std::endl;
+    std::cout << shifted << std::endl;
+    // array([0, 1, 3, 5, 7, 9])
+    std::cout << ">>> rng = np.random.default_rng(42); rng.permutation(6), rng.integers(0, 10, 6)" << std::endl;
+    ndarray<int>::random rng(42);
+    auto perm = rng.permutation(6);
+    std::cout << perm << ", " << rng.integers({6}, 0, 10) << std::endl;
+    std::cout << ">>> np.sort(perm)" << std::endl;
+    std::cout << ndarray<int>::unique(perm) << std::endl;
+    // array([0, 1, 2, 3, 4, 5])
+    std::cout << ">>> h = np.array([0.5, 1.5, 65504.], dtype=np.float16)" << std::endl;
+    auto h = ndarray<float>{0.5f, 1.5f, 65504.f}.astype<float16>();
+    std::cout << ">>> h * 2" << std::endl;
+    std::cout << h * 2 << std::endl;
+    // array([1., 3., inf], dtype=float16)
+    std::cout << ">>> np.array([1., 1.00390625, 3.14159], dtype=ml_dtypes.bfloat16)" << std::endl;
+    std::cout << ndarray<float>{1.f, 1.00390625f, 3.14159f}.astype<bfloat16>() << std::endl;
+    // array([1, 1, 3.14062], dtype=bfloat16)
+    std::cout << ">>> tracemalloc-style accounting of a scoped temporary chain" << std::endl;
+    {
+        MemoryStats::Scope scope("chain");
+        auto t = ndarray<double>::full({1000}, 1.) * 2. + 1.;
+        std::cout << MemoryStats::scope("chain").live_bytes << std::endl;
+        // 24000
+    }
+    std::cout << MemoryStats::scope("chain").peak_bytes << ", " << MemoryStats::scope("chain").live_bytes << std::endl;
+    // 72024, 0
+    std::cout << ">>> with torch.profiler.profile() as prof: x + x; prof.export_chrome_trace(f)" << std::endl;
+    Tracer::enable();
+    x + x;
+    Tracer::disable();
+    std::cout << std::boolalpha << (Tracer::to_chrome_json().find("\"name\": \"add\"") != std::string::npos) << std::endl;
+    // True
+    std::cout << ">>> y = da.from_array(x) @ da.from_array(x.reshape(3, 2)); ((y + 1) * y - y // 2).compute()" << std::endl;
+    auto ly = ndarray<int>::lazy::matmul(x, x.reshape({3, 2}));
+    std::cout << ((ly + 1) * ly - ly / 2).eval() << std::endl;
+    // array([[ 105,  176],
+    //        [ 798, 1620]])
+
+    std::cout << ">>> numactl --interleave=all python -c 'print((np.arange(1 << 20) / 2)[1:3])'" << std::endl;
+    MemoryPolicy::set_placement(MemoryPolicy::INTERLEAVE, ~0ul);
+    MemoryPolicy::set_huge_pages(true);
+    std::cout << (ndarray<double>::arange(1 << 20) / 2.0).slice(std::make_pair(1, 3)) << std::endl;
+    // array([0.5, 1. ])
+    MemoryPolicy::set_placement(MemoryPolicy::FIRST_TOUCH);
+    MemoryPolicy::set_huge_pages(false);
+
+    std::cout << ">>> r = np.zeros(3, dtype=[('timestamp', 'i8'), ('id', 'i4'), ('value', 'f8')]); r['value'] = [0.5, 1.5, 2.5]" << std::endl;
+    record_array<long long, int, double> r({3}, {"timestamp", "id", "value"});
+    r.field<double>("value") = ndarray<double>({0.5, 1.5, 2.5});
+    std::cout << ">>> r[1] = (1700000000, 7, r[1]['value'] * 2); r['value'], r[1]['id']" << std::endl;
+    r.set_record(1, std::make_tuple(1700000000LL, 7, std::get<2>(r.record(1)) * 2));
+    std::cout << r.field<2>() << ", " << std::get<1>(r.record(1)) << std::endl;
+    // (array([0.5, 3. , 2.5]), 7)
+
+    std::cout << ">>> g = np.array([[1., np.nan, 3.], [np.nan, np.nan, 6.]]); np.nansum(g, axis=1), np.nanmean(g), np.nanmax(g, axis=0)" << std::endl;
+    const double nan = std::numeric_limits<double>::quiet_NaN();
+    ndarray<double> g({{1., nan, 3.}, {nan, nan, 6.}});
+    std::cout << g.nansum(1) << ", " << g.nanmean() << ", " << g.nanmax(0) << std::endl;
+    // (array([4., 6.]), 3.3333333333333335, array([ 1., nan,  6.]))
+    std::cout << ">>> np.nanmax(np.arange(6.).reshape(3, 2), axis=1), np.nansum(np.arange(600.).reshape(2, 300), axis=1)" << std::endl;
+    std::cout << ndarray<double>::arange(6).reshape({3, 2}).nanmax(1) << ", "
+              << ndarray<double>::arange(600).reshape({2, 300}).nansum(1) << std::endl;
+    // (array([1., 3., 5.]), array([ 44850., 134850.]))
+    std::cout << ">>> sums = np.empty(2); np.nansum(g, axis=1, out=sums); runs = x.copy(); np.add.reduceat(runs, [0, 2], axis=1, out=runs[:, :2])" << std::endl;
+    auto sums = ndarray<double>::full({2}, 0.);
+    g.nansum(1, sums);
+    auto runs = x.copy();
+    auto runs_head = runs.slice(std::make_pair(0, 2), std::make_pair(0, 2));
+    ndarray<int>::reduceat(runs, {0, 2}, 1, runs_head);
+    std::cout << sums << ", " << runs << std::endl;
+    // (array([4., 6.]), array([[1, 2, 2],
+    //                          [7, 5, 5]]))
+    std::cout << ">>> np.ma.masked_invalid(g).sum(axis=0).filled(-1)" << std::endl;
+    std::cout << masked_array<double>::masked_invalid(g).sum(0).filled(-1) << std::endl;
+    // array([ 1., -1.,  9.])
+    std::cout << ">>> np.ma.masked_array(np.arange(70)).count(), np.ma.masked_array(np.arange(3), mask=[0, 1, 0]).count()" << std::endl;
+    std::cout << masked_array<int>(ndarray<int>::arange(70)).count() << ", "
+              << masked_array<int>(ndarray<int>::arange(3), ndarray<uint8_t>({0, 1, 0})).count() << std::endl;
+    // (70, 2)
+
+    std::cout << ">>> f = x.copy(order='F'); f.flags.f_contiguous, (f + f).flags.f_contiguous, f.reshape(3, 2, order='F')" << std::endl;
+    auto f = x.copy('F');
+    std::cout << f.flags().f_contiguous << ", " << (f + f).flags().f_contiguous << ", " << f.reshape({3, 2}, 'F') << std::endl;
+    // (True, True, array([[0, 4],
+    //                     [3, 2],
+    //                     [1, 5]]))
+
+    std::cout << ">>> v = np.arange(4.); blas.ddot(v, v), blas.dnrm2(v), blas.dgemv(2., x.astype(float), v[:3])" << std::endl;
+    auto v = ndarray<double>::arange(4);
+    std::cout << ndarray<double>::blas::dot(v, v) << ", " << ndarray<double>::blas::nrm2(v) << ", "
+              << ndarray<double>::blas::gemv(2., x.astype<double>(), v.slice(std::make_pair(0, 3))) << std::endl;
+    // (14.0, 3.7416573867739413, array([10., 28.]))
+
     return 0;
 }